@@ -0,0 +1,293 @@
+/*
+   Copyright 2022-2024 mkckr0 <https://github.com/mkckr0>
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+*/
+
+#include "async_log.hpp"
+#include "metrics.hpp"
+
+#include <algorithm>
+#include <atomic>
+#include <bit>
+#include <chrono>
+#include <cstdint>
+#include <cstring>
+#include <memory>
+#include <mutex>
+#include <semaphore>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <vector>
+
+#include <spdlog/spdlog.h>
+#include <spdlog/sinks/sink.h>
+
+namespace async_log {
+
+namespace {
+
+// The first slot of a record, the following slots only carry the rest of the message.
+struct record_t {
+    spdlog::log_clock::time_point time;
+    size_t thread_id;
+    spdlog::level::level_enum level;
+    uint32_t size; // of the whole message, over all its slots
+    uint32_t truncated; // bytes cut off after max_message_size
+    char message[slot_message_size];
+};
+
+size_t slots_of(size_t size)
+{
+    return std::max<size_t>((size + slot_message_size - 1) / slot_message_size, 1);
+}
+
+// Bounded multi-producer queue (Vyukov). The sequence number of a slot tells
+// whether it's free for the producer at that position or filled for the
+// consumer, so producers only contend on the tail index. A long record takes
+// consecutive slots with one claim of the tail.
+class ring {
+public:
+    explicit ring(size_t capacity)
+        : _slots(std::make_unique<slot_t[]>(capacity))
+        , _mask(capacity - 1)
+        , _max_size(std::min(max_message_size, capacity * slot_message_size))
+    {
+        for (size_t i = 0; i < capacity; ++i) {
+            _slots[i].seq.store(i, std::memory_order_relaxed);
+        }
+    }
+
+    // Returns false when full, never blocks.
+    bool push(const spdlog::details::log_msg& msg)
+    {
+        const size_t size = std::min(msg.payload.size(), _max_size);
+        const size_t count = slots_of(size);
+        auto pos = _tail.load(std::memory_order_relaxed);
+        while (true) {
+            // the consumer frees the slots in order, when the last one is free all are
+            auto last = pos + count - 1;
+            auto seq = _slots[last & _mask].seq.load(std::memory_order_acquire);
+            auto diff = (intptr_t)seq - (intptr_t)last;
+            if (diff == 0) {
+                if (_tail.compare_exchange_weak(pos, pos + count, std::memory_order_relaxed)) {
+                    break;
+                }
+            } else if (diff < 0) {
+                return false;
+            } else {
+                pos = _tail.load(std::memory_order_relaxed);
+            }
+        }
+
+        auto& r = _slots[pos & _mask].record;
+        r.time = msg.time;
+        r.thread_id = msg.thread_id;
+        r.level = msg.level;
+        r.size = (uint32_t)size;
+        r.truncated = (uint32_t)(msg.payload.size() - size);
+        for (size_t i = 0; i < count; ++i) {
+            auto offset = i * slot_message_size;
+            std::memcpy(_slots[(pos + i) & _mask].record.message, msg.payload.data() + offset, std::min(size - offset, slot_message_size));
+        }
+        // the first slot last, the consumer reads all of them once it sees it
+        for (size_t i = count; i-- > 0;) {
+            _slots[(pos + i) & _mask].seq.store(pos + i + 1, std::memory_order_release);
+        }
+        return true;
+    }
+
+    bool empty() const
+    {
+        return _slots[_head & _mask].seq.load(std::memory_order_acquire) != _head + 1;
+    }
+
+    // Only called by the writer thread. f gets the record and its whole message.
+    template <typename F>
+    size_t drain(F&& f)
+    {
+        size_t n = 0;
+        while (!empty()) {
+            auto& r = _slots[_head & _mask].record;
+            const size_t count = slots_of(r.size);
+            std::string_view message(r.message, std::min<size_t>(r.size, slot_message_size));
+            if (count > 1 || r.truncated) {
+                _spill.clear();
+                for (size_t i = 0; i < count; ++i) {
+                    auto offset = i * slot_message_size;
+                    _spill.append(_slots[(_head + i) & _mask].record.message, std::min(r.size - offset, slot_message_size));
+                }
+                if (r.truncated) {
+                    _spill += fmt::format(" ... ({} bytes truncated)", r.truncated);
+                }
+                message = _spill;
+            }
+            f(r, message);
+            for (size_t i = 0; i < count; ++i) {
+                _slots[(_head + i) & _mask].seq.store(_head + i + _mask + 1, std::memory_order_release);
+            }
+            _head += count;
+            ++n;
+        }
+        return n;
+    }
+
+private:
+    struct slot_t {
+        std::atomic<size_t> seq;
+        record_t record;
+    };
+
+    std::unique_ptr<slot_t[]> _slots;
+    const size_t _mask;
+    const size_t _max_size;
+    alignas(64) std::atomic<size_t> _tail { 0 };
+    alignas(64) size_t _head = 0;
+    std::string _spill; // a record of several slots in one piece, writer thread only
+};
+
+class ring_sink : public spdlog::sinks::sink {
+public:
+    ring_sink(size_t capacity, std::string logger_name, std::vector<spdlog::sink_ptr> sinks)
+        : _ring(capacity)
+        , _logger_name(std::move(logger_name))
+        , _sinks(std::move(sinks))
+    {
+        _writer = std::thread([this] { write_loop(); });
+    }
+
+    ~ring_sink() override
+    {
+        _stopped = true;
+        _wakeup.release();
+        _writer.join();
+        write_queued();
+    }
+
+    void log(const spdlog::details::log_msg& msg) override
+    {
+        if (!_ring.push(msg)) {
+            _dropped.fetch_add(1, std::memory_order_relaxed);
+            metrics::get().log_dropped.inc();
+            return;
+        }
+        // only a sleeping writer costs the producer a wake up call
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        if (_sleeping.load(std::memory_order_relaxed) && _sleeping.exchange(false, std::memory_order_relaxed)) {
+            _wakeup.release();
+        }
+    }
+
+    void flush() override
+    {
+        // the writer flushes after every batch
+    }
+
+    void set_pattern(const std::string& pattern) override
+    {
+        for (auto& sink : _sinks) {
+            sink->set_pattern(pattern);
+        }
+    }
+
+    void set_formatter(std::unique_ptr<spdlog::formatter> formatter) override
+    {
+        for (auto& sink : _sinks) {
+            sink->set_formatter(formatter->clone());
+        }
+    }
+
+    const std::vector<spdlog::sink_ptr>& sinks() const { return _sinks; }
+    uint64_t dropped() const { return _dropped.load(std::memory_order_relaxed); }
+
+private:
+    void write_loop()
+    {
+        while (!_stopped) {
+            if (write_queued()) {
+                continue;
+            }
+            _sleeping.store(true, std::memory_order_relaxed);
+            // pairs with the fence in log, either the producer sees _sleeping or this sees its record
+            std::atomic_thread_fence(std::memory_order_seq_cst);
+            if (_ring.empty() && !_stopped) {
+                _wakeup.acquire();
+            }
+            _sleeping.store(false, std::memory_order_relaxed);
+        }
+    }
+
+    size_t write_queued()
+    {
+        auto n = _ring.drain([this](const record_t& r, std::string_view message) {
+            spdlog::details::log_msg msg(r.time, spdlog::source_loc {}, _logger_name, r.level, spdlog::string_view_t(message.data(), message.size()));
+            msg.thread_id = r.thread_id;
+            for (auto& sink : _sinks) {
+                if (sink->should_log(msg.level)) {
+                    sink->log(msg);
+                }
+            }
+        });
+        if (n) {
+            for (auto& sink : _sinks) {
+                sink->flush();
+            }
+        }
+        return n;
+    }
+
+    ring _ring;
+    const std::string _logger_name;
+    const std::vector<spdlog::sink_ptr> _sinks;
+    std::atomic<uint64_t> _dropped { 0 };
+    std::atomic_bool _stopped = false;
+    std::atomic_bool _sleeping = false;
+    std::counting_semaphore<> _wakeup { 0 };
+    std::thread _writer;
+};
+
+std::mutex g_mutex;
+std::shared_ptr<ring_sink> g_sink;
+
+} // namespace
+
+void start(size_t capacity)
+{
+    std::lock_guard lock(g_mutex);
+    if (g_sink) {
+        return;
+    }
+    auto logger = spdlog::default_logger();
+    g_sink = std::make_shared<ring_sink>(std::bit_ceil(std::max<size_t>(capacity, 2)), logger->name(), logger->sinks());
+    logger->sinks() = { g_sink };
+}
+
+void stop()
+{
+    std::shared_ptr<ring_sink> sink;
+    {
+        std::lock_guard lock(g_mutex);
+        if (!g_sink) {
+            return;
+        }
+        sink = std::move(g_sink);
+    }
+    auto logger = spdlog::default_logger();
+    logger->sinks() = sink->sinks();
+    if (auto dropped = sink->dropped()) {
+        spdlog::warn("async log dropped {} record(s)", dropped);
+    }
+}
+
+} // namespace async_log
@@ -0,0 +1,46 @@
+/*
+   Copyright 2022-2024 mkckr0 <https://github.com/mkckr0>
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+*/
+
+#ifndef ASYNC_LOG_HPP
+#define ASYNC_LOG_HPP
+
+#include <cstddef>
+
+// Asynchronous mode for the default spdlog logger. Its sinks are moved behind
+// a bounded lock-free ring: the logging thread formats the message as usual,
+// copies the record into a preallocated slot and returns, and a background
+// thread writes the records to the original sinks.
+//
+// A full ring drops the record instead of blocking, drops are counted in
+// metrics::registry::log_dropped. A message longer than a slot spills into
+// the following slots. Messages longer than max_message_size are truncated
+// and end with the count of the cut bytes.
+namespace async_log {
+
+constexpr size_t slot_message_size = 256;
+constexpr size_t max_message_size = 16 * slot_message_size;
+
+// capacity is rounded up to a power of two. start and stop replace the sinks
+// of the default logger, call them while no other thread logs.
+void start(size_t capacity = 8192);
+
+// Write the queued records and give the sinks back to the default logger. The
+// writer thread also stops at exit without it.
+void stop();
+
+} // namespace async_log
+
+#endif // !ASYNC_LOG_HPP
@@ -1,4 +1,11 @@
 #include "audio_manager.hpp"
+#include "metrics.hpp"
+#include "network_manager.hpp"
+#include "synthetic_source.hpp"
+#include "thread_util.hpp"
+#include "tracer.hpp"
+
+#include <spdlog/spdlog.h>
 
 audio_manager::audio_manager()
 {
@@ -10,18 +17,146 @@ audio_manager::~audio_manager() = default;
 void audio_manager::start_loopback_recording(std::shared_ptr<network_manager> network_manager, const capture_config& config)
 {
     _stopped = false;
+    if (config.synthetic) {
+        auto encoding = AudioFormat::ENCODING_PCM_FLOAT;
+        switch (config.encoding) {
+        case encoding_t::encoding_s8:
+            encoding = AudioFormat::ENCODING_PCM_8BIT;
+            break;
+        case encoding_t::encoding_s16:
+            encoding = AudioFormat::ENCODING_PCM_16BIT;
+            break;
+        case encoding_t::encoding_s24:
+            encoding = AudioFormat::ENCODING_PCM_24BIT;
+            break;
+        case encoding_t::encoding_s32:
+            encoding = AudioFormat::ENCODING_PCM_32BIT;
+            break;
+        default:
+            break;
+        }
+        _format->set_encoding(encoding);
+        _format->set_channels(config.channels ? config.channels : 2);
+        _format->set_sample_rate(config.sample_rate ? config.sample_rate : 48000);
+        spdlog::info("synthetic AudioFormat:\n{}", _format->DebugString());
+
+        _synthetic = std::make_unique<synthetic_source>(*_format, config.synthetic_period);
+        _synthetic_next = pipeline_clock::now();
+        if (pipeline_clock::is_manual()) {
+            // the test calls poll()
+            _synthetic_sink = network_manager;
+            return;
+        }
+        _record_thread = std::thread([network_manager = network_manager, policy = config.thread, self = shared_from_this()] {
+            thread_util::apply(policy, "capture");
+            self->do_synthetic_recording(network_manager);
+        });
+        return;
+    }
     _record_thread = std::thread([network_manager = network_manager, config = config, self = shared_from_this()] {
         self->do_loopback_recording(network_manager, config);
     });
 }
 
+void audio_manager::do_synthetic_recording(std::shared_ptr<network_manager> network_manager)
+{
+    tracer::set_thread_name("capture");
+    while (!_stopped) {
+        pipeline_clock::sleep_until(_synthetic_next);
+        pump_synthetic(*network_manager);
+    }
+}
+
+void audio_manager::pump_synthetic(network_manager& network_manager)
+{
+    auto now = pipeline_clock::now();
+    while (_synthetic_next <= now) {
+        tracer::scope trace("capture", "capture");
+        const auto& quantum = _synthetic->next_quantum(now);
+        network_manager.broadcast_audio_data(quantum.data(), quantum.size(), _synthetic->block_align());
+
+        _synthetic_next += _synthetic->period();
+        if (now - _synthetic_next > _synthetic->period()) {
+            // fell behind, e.g. the machine was suspended
+            metrics::get().capture_xruns.inc();
+            _synthetic_next = now;
+        }
+    }
+}
+
+void audio_manager::poll()
+{
+    auto network_manager = _synthetic_sink.lock();
+    if (_synthetic && network_manager) {
+        pump_synthetic(*network_manager);
+    }
+}
+
+void audio_manager::set_playout_policy(const thread_util::thread_policy& policy)
+{
+    _playout_policy = policy;
+}
+
+void audio_manager::audio_init(AudioFormat& format)
+{
+    if (_null_playout) {
+        spdlog::info("null playout, the received audio is discarded");
+        return;
+    }
+    do_audio_init(format);
+}
+
+void audio_manager::audio_start()
+{
+    if (!_null_playout) {
+        do_audio_start();
+    }
+}
+
+void audio_manager::audio_play(std::span<const char> buffer)
+{
+    _played_bytes.fetch_add(buffer.size(), std::memory_order_relaxed);
+    if (!_null_playout) {
+        do_audio_play(buffer);
+    }
+}
+
+void audio_manager::audio_stop()
+{
+    if (!_null_playout) {
+        do_audio_stop();
+    }
+}
+
+void audio_manager::set_null_playout(bool enabled)
+{
+    _null_playout = enabled;
+}
+
+uint64_t audio_manager::played_bytes() const
+{
+    return _played_bytes.load(std::memory_order_relaxed);
+}
+
+std::chrono::nanoseconds audio_manager::record_thread_cpu_time()
+{
+    return thread_util::cpu_time(_record_thread);
+}
+
 void audio_manager::stop()
 {
     _stopped = true;
-    _record_thread.join();
+    if (_record_thread.joinable()) {
+        _record_thread.join();
+    }
 }
 
 std::string audio_manager::get_format_binary()
 {
     return _format->SerializeAsString();
+}
+
+void audio_manager::set_format(const AudioFormat& format)
+{
+    *_format = format;
 }
\ No newline at end of file
@@ -25,13 +25,20 @@
 #include "win32/audio_manager_impl.hpp"
 #endif
 
+#include <atomic>
+#include <chrono>
+#include <cstdint>
 #include <memory>
+#include <span>
 #include <sstream>
 #include <thread>
 
 #include "client.pb.h"
+#include "pipeline_clock.hpp"
+#include "thread_util.hpp"
 
 class network_manager;
+class synthetic_source;
 
 class audio_manager : private detail::audio_manager_impl, public std::enable_shared_from_this<audio_manager> {
 public:
@@ -74,6 +81,9 @@ public:
         encoding_t encoding = encoding_t::encoding_default;
         int channels = 0;
         int sample_rate = 0;
+        bool synthetic = false; // generate a test signal instead of capturing the endpoint
+        std::chrono::microseconds synthetic_period { 10000 };
+        thread_util::thread_policy thread; // the thread that delivers the quanta, on Linux the PipeWire data thread
     };
 
     audio_manager();
@@ -82,22 +92,49 @@ public:
     void start_loopback_recording(std::shared_ptr<network_manager> network_manager, const capture_config& config);
     void stop();
     void do_loopback_recording(std::shared_ptr<network_manager> network_manager, const capture_config& config);
+    void do_synthetic_recording(std::shared_ptr<network_manager> network_manager);
+    std::chrono::nanoseconds record_thread_cpu_time();
+    // Broadcast the synthetic quanta that are due, for tests that drive the pipeline with a manual pipeline_clock.
+    void poll();
     
     void audio_init(AudioFormat& format);
     void audio_start();
-    void audio_play(const std::vector<char>& buffer);
+    // Called on the client network thread for every datagram, doesn't allocate.
+    void audio_play(std::span<const char> buffer);
     void audio_stop();
+    // Discard the received audio instead of opening the output device, for
+    // tests. Must be set before audio_init.
+    void set_null_playout(bool enabled);
+    // Bytes passed to audio_play.
+    uint64_t played_bytes() const;
+    // Scheduling of the playout thread, must be set before audio_start. Only Windows plays audio.
+    void set_playout_policy(const thread_util::thread_policy& policy);
 
     std::string get_format_binary();
+    // Serve the format of another server instead of the captured one, for a relay.
+    void set_format(const AudioFormat& format);
 
     endpoint_list_t get_endpoint_list();
 
     std::string get_default_endpoint();
     
 private:
+    void pump_synthetic(network_manager& network_manager);
+    // the output device of the platform
+    void do_audio_init(AudioFormat& format);
+    void do_audio_start();
+    void do_audio_play(std::span<const char> buffer);
+    void do_audio_stop();
+
     std::thread _record_thread;
     std::atomic_bool _stopped;
     std::shared_ptr<AudioFormat> _format;
+    std::unique_ptr<synthetic_source> _synthetic;
+    pipeline_clock::time_point _synthetic_next;
+    std::weak_ptr<network_manager> _synthetic_sink; // only in manual time, network_manager owns this
+    thread_util::thread_policy _playout_policy;
+    bool _null_playout = false;
+    std::atomic<uint64_t> _played_bytes { 0 };
 };
 
 #endif // !BASIC_AUDIO_MANAGER_HPP
\ No newline at end of file
@@ -0,0 +1,261 @@
+/*
+   Copyright 2022-2024 mkckr0 <https://github.com/mkckr0>
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+*/
+
+#include "audio_pipeline.hpp"
+#include "metrics.hpp"
+#include "tracer.hpp"
+
+#include <algorithm>
+#include <cstring>
+#include <stdexcept>
+#include <string>
+
+namespace {
+
+metrics::histogram& stage_time(audio_pipeline::stage_t stage)
+{
+    auto& m = metrics::get();
+    switch (stage) {
+    case audio_pipeline::stage_t::convert:
+        return m.convert_time;
+    case audio_pipeline::stage_t::encode:
+        return m.encode_time;
+    default:
+        return m.packetize_time;
+    }
+}
+
+} // namespace
+
+const char* audio_pipeline::stage_name(stage_t stage)
+{
+    switch (stage) {
+    case stage_t::convert:
+        return "convert";
+    case stage_t::encode:
+        return "encode";
+    case stage_t::packetize:
+        return "packetize";
+    }
+    return "unknown";
+}
+
+char* audio_pipeline::quantum_t::writable()
+{
+    if (borrowed) {
+        if (data.size() < size) {
+            data.resize(size);
+        }
+        std::memcpy(data.data(), borrowed, size);
+        borrowed = nullptr;
+    }
+    return data.data();
+}
+
+std::array<bool, audio_pipeline::stage_count> audio_pipeline::config::parse_threaded_stages(std::string_view spec)
+{
+    std::array<bool, stage_count> own_thread {};
+    while (!spec.empty()) {
+        auto comma = spec.find(',');
+        auto name = spec.substr(0, comma);
+        spec = comma == std::string_view::npos ? std::string_view() : spec.substr(comma + 1);
+
+        size_t i = 0;
+        while (i < stage_count && name != stage_name((stage_t)i)) {
+            ++i;
+        }
+        if (i == stage_count) {
+            throw std::invalid_argument("unknown pipeline stage: " + std::string(name));
+        }
+        own_thread[i] = true;
+    }
+    return own_thread;
+}
+
+audio_pipeline::audio_pipeline(const config& config, sink_fn sink)
+    : _config(config)
+    , _sink(std::move(sink))
+    , _slots(std::max<size_t>(config.slots, 1))
+    , _free(_slots.size())
+{
+    for (uint32_t i = 0; i < _slots.size(); ++i) {
+        _slots[i].variants.resize(_config.encoders.size());
+        _free.try_push(i);
+    }
+    if (_config.encoders.size() > 1 && _config.encode_workers) {
+        _encode_pool = std::make_unique<worker_pool>(_config.encode_workers, _config.encode_worker_thread);
+    }
+    _encode_task = [this](size_t i) {
+        _config.encoders[i](*_encoding, _encoding->variants[i]);
+    };
+
+    // split the stages at every threaded stage, the first group runs on the capture thread
+    _groups.push_back(std::make_unique<group_t>());
+    for (size_t stage = 0; stage < stage_count; ++stage) {
+        if (_config.own_thread[stage]) {
+            _groups.back()->end_stage = stage;
+            auto& group = _groups.emplace_back(std::make_unique<group_t>());
+            group->first_stage = stage;
+            // the pool bounds the queued quanta, so a push never fails
+            group->queue = std::make_unique<spsc_queue<uint32_t>>(_slots.size());
+        }
+    }
+    _groups.back()->end_stage = stage_count;
+
+    // the whole pipeline runs inside push, while the capture buffer is valid
+    _borrow = _groups.size() == 1;
+    // the encoders only read the quantum, the variants have their own bytes
+    _in_place = _borrow && std::none_of(_config.stages.begin(), _config.stages.end(), [](const stage_fn& fn) {
+        return (bool)fn;
+    });
+
+    for (size_t i = 1; i < _groups.size(); ++i) {
+        _groups[i]->thread = std::thread([this, i] {
+            group_loop(i);
+        });
+    }
+}
+
+audio_pipeline::~audio_pipeline()
+{
+    stop();
+}
+
+void audio_pipeline::stop()
+{
+    _stopped = true;
+    for (auto& group : _groups) {
+        if (group->thread.joinable()) {
+            group->ready.release();
+            group->thread.join();
+        }
+    }
+    _encode_pool = nullptr;
+}
+
+void audio_pipeline::push(const char* data, size_t count, int block_align, std::shared_ptr<void> owner)
+{
+    uint32_t slot;
+    if (!_free.try_pop(slot)) {
+        metrics::get().pipeline_dropped.inc();
+        return;
+    }
+    auto& quantum = _slots[slot];
+    if (_borrow) {
+        quantum.borrowed = data;
+        if (_in_place) {
+            quantum.owner = std::move(owner);
+        }
+    } else {
+        if (quantum.data.size() < count) {
+            quantum.data.resize(count);
+        }
+        std::memcpy(quantum.data.data(), data, count);
+    }
+    quantum.size = count;
+    quantum.block_align = block_align;
+    quantum.capture_time = pipeline_clock::now();
+    run_group(0, slot);
+}
+
+void audio_pipeline::run_group(size_t group_index, uint32_t slot)
+{
+    auto& group = *_groups[group_index];
+    auto& quantum = _slots[slot];
+    for (size_t stage = group.first_stage; stage < group.end_stage; ++stage) {
+        run_stage(stage, quantum);
+    }
+
+    auto& m = metrics::get();
+    if (group_index + 1 < _groups.size()) {
+        auto& next = *_groups[group_index + 1];
+        next.queue->try_push(slot);
+        m.pipeline_queued.add(1);
+        next.ready.release();
+        return;
+    }
+
+    m.pipeline_latency.observe(pipeline_clock::now() - quantum.capture_time);
+    _sink(quantum);
+    quantum.borrowed = nullptr;
+    quantum.owner = nullptr;
+    quantum.segments.clear();
+    for (auto& variant : quantum.variants) {
+        variant.segments.clear();
+    }
+    _free.try_push(slot);
+}
+
+void audio_pipeline::run_stage(size_t stage, quantum_t& quantum)
+{
+    auto& fn = _config.stages[stage];
+    const bool has_variants = (stage_t)stage == stage_t::encode && !_config.encoders.empty();
+    if (!fn && !has_variants && (stage_t)stage != stage_t::packetize) {
+        return;
+    }
+
+    tracer::scope trace("server", stage_name((stage_t)stage));
+    auto begin = pipeline_clock::now();
+    if (fn) {
+        fn(quantum);
+    } else if ((stage_t)stage == stage_t::packetize) {
+        quantum.segments = packetizer::split(quantum.bytes(), quantum.size, quantum.block_align, packetizer::default_mtu, quantum.borrowed ? quantum.owner : nullptr);
+        for (auto& variant : quantum.variants) {
+            variant.segments = packetizer::split(variant.data.data(), variant.size, variant.block_align);
+        }
+    }
+    if (has_variants) {
+        encode_variants(quantum);
+    }
+    stage_time((stage_t)stage).observe(pipeline_clock::now() - begin);
+    if ((stage_t)stage == stage_t::packetize) {
+        metrics::get().segments_per_quantum.observe(quantum.segments.size());
+    }
+}
+
+void audio_pipeline::encode_variants(quantum_t& quantum)
+{
+    // only the encode stage thread gets here, one quantum at a time
+    _encoding = &quantum;
+    if (_encode_pool) {
+        _encode_pool->parallel_for(_config.encoders.size(), _encode_task);
+    } else {
+        for (size_t i = 0; i < _config.encoders.size(); ++i) {
+            _encode_task(i);
+        }
+    }
+    _encoding = nullptr;
+}
+
+void audio_pipeline::group_loop(size_t group_index)
+{
+    auto& group = *_groups[group_index];
+    auto name = stage_name((stage_t)group.first_stage);
+    tracer::set_thread_name(name);
+    thread_util::apply(_config.threads[group.first_stage], name);
+
+    while (true) {
+        group.ready.acquire();
+        if (_stopped) {
+            return;
+        }
+        uint32_t slot;
+        if (group.queue->try_pop(slot)) {
+            metrics::get().pipeline_queued.sub(1);
+            run_group(group_index, slot);
+        }
+    }
+}
@@ -0,0 +1,164 @@
+/*
+   Copyright 2022-2024 mkckr0 <https://github.com/mkckr0>
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+*/
+
+#ifndef AUDIO_PIPELINE_HPP
+#define AUDIO_PIPELINE_HPP
+
+#include <array>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <semaphore>
+#include <string_view>
+#include <thread>
+#include <vector>
+
+#include "packetizer.hpp"
+#include "pipeline_clock.hpp"
+#include "spsc_queue.hpp"
+#include "thread_util.hpp"
+#include "worker_pool.hpp"
+
+// The stages between the capture callback and the network thread:
+//
+//   capture -> convert -> encode -> packetize -> send
+//
+// The capture thread takes a free slot of a fixed pool for a quantum and
+// runs the stages up to the first one that has its own thread. From there
+// the slot index travels through bounded SPSC queues, one in front of every
+// threaded stage, and the last stage hands the segments to the sink, which
+// posts them to the network thread. The slot then goes back to the capture
+// thread through the free queue.
+//
+// The capture thread never waits: when every slot is in flight the quantum is
+// dropped and counted. By default every stage runs inline on the capture
+// thread, which is the plain call chain. Then the slot only points at the
+// capture buffer, e.g. the mapped PipeWire buffer, and the stages read it in
+// place. The quantum is copied into the slot only when a stage has its own
+// thread, since the capture buffer goes back once push returns. When no stage
+// replaces the bytes either, a capture that can hold its buffer passes an
+// owner to push and the segments are sent from the capture buffer itself.
+//
+// The encode stage may also produce variants of every quantum, e.g. other
+// streams or formats, one per encoder. The encoders of a quantum run in
+// parallel on a worker_pool and the packetize stage splits every variant
+// after they all finished, in encoder order.
+class audio_pipeline {
+public:
+    enum class stage_t : uint8_t {
+        convert,
+        encode,
+        packetize,
+    };
+    static constexpr size_t stage_count = 3;
+
+    static const char* stage_name(stage_t stage);
+
+    struct variant_t {
+        std::vector<char> data; // keeps its capacity between quanta
+        size_t size = 0;
+        int block_align = 0;
+        packetizer::segment_list_t segments; // output of the packetize stage
+    };
+
+    struct quantum_t {
+        std::vector<char> data; // keeps its capacity between quanta
+        const char* borrowed = nullptr; // the capture buffer instead of data, only valid during push
+        std::shared_ptr<void> owner; // keeps borrowed valid past push, see sends_in_place
+        size_t size = 0;
+        int block_align = 0;
+        pipeline_clock::time_point capture_time;
+        packetizer::segment_list_t segments; // output of the packetize stage
+        std::vector<variant_t> variants; // one per encoder, in order
+
+        const char* bytes() const { return borrowed ? borrowed : data.data(); }
+        // The bytes to change in place, a borrowed capture buffer is copied into data first.
+        char* writable();
+    };
+
+    // Transforms a quantum, e.g. a codec or FEC. Reads bytes() and changes
+    // them through writable(), or writes new ones to data and clears borrowed.
+    // May change size and block_align.
+    using stage_fn = std::function<void(quantum_t& quantum)>;
+    // Encodes one variant of a quantum. Runs in parallel with the other encoders of the same quantum.
+    using encoder_fn = std::function<void(const quantum_t& quantum, variant_t& variant)>;
+    // Receives every quantum after the last stage. May move the segments out.
+    using sink_fn = std::function<void(quantum_t& quantum)>;
+
+    struct config {
+        // Empty convert and encode stages are skipped, an empty packetize
+        // stage splits the quantum with packetizer::split.
+        std::array<stage_fn, stage_count> stages;
+        std::vector<encoder_fn> encoders;
+        size_t encode_workers = 0; // 0 runs the encoders one after another on the encode stage thread
+        thread_util::thread_policy encode_worker_thread;
+        // Stages that run on their own thread, behind a queue.
+        std::array<bool, stage_count> own_thread {};
+        std::array<thread_util::thread_policy, stage_count> threads;
+        size_t slots = 8; // quanta in flight between the capture and the sink
+
+        // Parse a stage list like "encode,packetize" into own_thread.
+        // Throws std::invalid_argument on unknown stages.
+        static std::array<bool, stage_count> parse_threaded_stages(std::string_view spec);
+    };
+
+    audio_pipeline(const config& config, sink_fn sink);
+    ~audio_pipeline();
+
+    audio_pipeline(const audio_pipeline&) = delete;
+    audio_pipeline& operator=(const audio_pipeline&) = delete;
+
+    // Only called by the capture thread. With an owner and sends_in_place the
+    // segments point into data and keep the owner until their last send.
+    void push(const char* data, size_t count, int block_align, std::shared_ptr<void> owner = nullptr);
+
+    // Whether the packetize stage splits the capture buffer itself: every
+    // stage is inline and none of them replaces the bytes. Only then the
+    // capture needs to hold its buffer past push.
+    bool sends_in_place() const { return _in_place; }
+
+    // Join the stage threads. Quanta still queued are dropped.
+    void stop();
+
+private:
+    // The stages from first_stage to the next threaded stage, on one thread.
+    struct group_t {
+        size_t first_stage = 0;
+        size_t end_stage = 0;
+        std::unique_ptr<spsc_queue<uint32_t>> queue; // null for the capture group
+        std::counting_semaphore<> ready { 0 };
+        std::thread thread;
+    };
+
+    void run_group(size_t group_index, uint32_t slot);
+    void run_stage(size_t stage, quantum_t& quantum);
+    void encode_variants(quantum_t& quantum);
+    void group_loop(size_t group_index);
+
+    config _config;
+    sink_fn _sink;
+    std::vector<quantum_t> _slots;
+    spsc_queue<uint32_t> _free;
+    std::vector<std::unique_ptr<group_t>> _groups;
+    std::unique_ptr<worker_pool> _encode_pool;
+    std::function<void(size_t)> _encode_task; // reused, so that starting the encoders doesn't allocate
+    quantum_t* _encoding = nullptr; // the quantum _encode_task works on
+    bool _borrow = false; // every stage is inline, push doesn't copy, see quantum_t::borrowed
+    bool _in_place = false;
+    std::atomic_bool _stopped = false;
+};
+
+#endif // !AUDIO_PIPELINE_HPP
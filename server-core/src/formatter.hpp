@@ -17,6 +17,8 @@
 #ifndef FORMATTER_HPP
 #define FORMATTER_HPP
 
+#include <cstring>
+
 #include <fmt/ostream.h>
 
 #include "pre_asio.hpp"
@@ -24,6 +26,19 @@
 
 template<> struct fmt::formatter<asio::ip::tcp::endpoint> : fmt::ostream_formatter {};
 template<> struct fmt::formatter<asio::ip::udp::endpoint> : fmt::ostream_formatter {};
+// the sessions run on TCP or Unix stream sockets, the Unix peers have no address
+template<> struct fmt::formatter<asio::generic::stream_protocol::endpoint> : fmt::formatter<std::string_view> {
+    auto format(const asio::generic::stream_protocol::endpoint& endpoint, format_context& ctx) const {
+        const auto family = endpoint.protocol().family();
+        if ((family != AF_INET && family != AF_INET6) || endpoint.size() > asio::ip::tcp::endpoint().capacity()) {
+            return formatter<string_view>::format("unix", ctx);
+        }
+        asio::ip::tcp::endpoint ip;
+        std::memcpy(ip.data(), endpoint.data(), endpoint.size());
+        ip.resize(endpoint.size());
+        return formatter<string_view>::format(fmt::format("{}", ip), ctx);
+    }
+};
 template<> struct fmt::formatter<asio::error_code> : fmt::formatter<std::string_view> {
     auto format(asio::error_code& ec, format_context& ctx) const {
         return formatter<string_view>::format(ec.message(), ctx);
@@ -0,0 +1,250 @@
+/*
+   Copyright 2022-2024 mkckr0 <https://github.com/mkckr0>
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+*/
+
+#include "handler_allocator.hpp"
+#include "metrics.hpp"
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <mutex>
+#include <new>
+
+namespace {
+
+// Every block starts with a header, 16 bytes keep the alignment of operator new.
+constexpr size_t header_size = 16;
+constexpr size_t class_count = 9; // 64 bytes to 16 KiB with the header, the largest fit a jumbo frame segment
+constexpr size_t max_cached = 256; // per size class and thread, the rest goes back to the heap
+constexpr size_t min_grow = 32; // blocks allocated at once when a free list is empty
+
+struct cache_t;
+
+// While the block is allocated it knows its owner, while it's free the owner
+// is replaced by the link to the next free block.
+struct header_t {
+    union {
+        cache_t* owner; // nullptr for blocks that are too large to recycle
+        header_t* next;
+    };
+    size_t size_class;
+};
+static_assert(sizeof(header_t) <= header_size);
+
+// The free lists of one thread. It outlives its thread, so other threads can
+// still free into it, but releases its blocks when the thread exits and is
+// handed to the next new thread.
+struct cache_t {
+    std::array<header_t*, class_count> free {};
+    std::array<size_t, class_count> count {};
+    std::array<size_t, class_count> owned {}; // free or in use, allocated by this thread
+    std::atomic<header_t*> remote { nullptr }; // freed by other threads
+    cache_t* next_retired = nullptr;
+};
+
+// remote of a cache whose thread exited, frees go straight to the heap
+header_t* const closed = reinterpret_cast<header_t*>(alignof(header_t));
+
+// caches of exited threads, only touched when a thread starts or exits
+std::mutex g_retired_mutex;
+cache_t* g_retired = nullptr;
+
+size_t block_size(size_t size_class)
+{
+    return (size_t)64 << size_class;
+}
+
+size_t size_class_of(size_t size)
+{
+    size_t size_class = 0;
+    while (size_class < class_count && block_size(size_class) < size + header_size) {
+        ++size_class;
+    }
+    return size_class;
+}
+
+void push_local(cache_t& cache, header_t* block)
+{
+    auto size_class = block->size_class;
+    if (cache.count[size_class] == max_cached) {
+        --cache.owned[size_class];
+        ::operator delete(block);
+        return;
+    }
+    block->next = cache.free[size_class];
+    cache.free[size_class] = block;
+    ++cache.count[size_class];
+}
+
+void delete_list(header_t* block)
+{
+    while (block) {
+        auto next = block->next;
+        ::operator delete(block);
+        block = next;
+    }
+}
+
+// Move the blocks freed by other threads to the local lists.
+void drain_remote(cache_t& cache)
+{
+    auto block = cache.remote.exchange(nullptr, std::memory_order_acquire);
+    while (block) {
+        auto next = block->next;
+        push_local(cache, block);
+        block = next;
+    }
+}
+
+struct thread_cache {
+    ~thread_cache()
+    {
+        if (!cache) {
+            return;
+        }
+        // the blocks still in use stay owned, they can come back through
+        // remote to the thread that reuses the cache
+        for (size_t size_class = 0; size_class < class_count; ++size_class) {
+            cache->owned[size_class] -= cache->count[size_class];
+            delete_list(cache->free[size_class]);
+            cache->free[size_class] = nullptr;
+        }
+        cache->count = {};
+        auto block = cache->remote.exchange(closed, std::memory_order_acquire);
+        while (block) {
+            auto next = block->next;
+            --cache->owned[block->size_class];
+            ::operator delete(block);
+            block = next;
+        }
+
+        // never deleted, late frees of other threads still read remote
+        std::lock_guard lock(g_retired_mutex);
+        cache->next_retired = g_retired;
+        g_retired = cache;
+        cache = nullptr;
+    }
+
+    cache_t* cache = nullptr;
+};
+
+thread_local thread_cache t_cache;
+
+cache_t& local_cache()
+{
+    if (!t_cache.cache) {
+        {
+            std::lock_guard lock(g_retired_mutex);
+            if (g_retired) {
+                t_cache.cache = g_retired;
+                g_retired = g_retired->next_retired;
+            }
+        }
+        if (t_cache.cache) {
+            // frees of blocks of the previous thread may have seen closed and gone to the heap
+            t_cache.cache->remote.store(nullptr, std::memory_order_release);
+        } else {
+            t_cache.cache = new cache_t;
+        }
+    }
+    return *t_cache.cache;
+}
+
+header_t* new_block(cache_t& cache, size_t size_class)
+{
+    auto header = static_cast<header_t*>(::operator new(block_size(size_class)));
+    header->size_class = size_class;
+    ++cache.owned[size_class];
+    return header;
+}
+
+} // namespace
+
+namespace handler_memory {
+
+void* allocate(size_t size, size_t align)
+{
+    auto& m = metrics::get();
+    if (align > header_size) {
+        m.handler_memory_allocated.inc();
+        return ::operator new(size, std::align_val_t(align));
+    }
+
+    auto size_class = size_class_of(size);
+    if (size_class == class_count) {
+        m.handler_memory_allocated.inc();
+        auto header = static_cast<header_t*>(::operator new(size + header_size));
+        header->owner = nullptr;
+        header->size_class = class_count;
+        return reinterpret_cast<char*>(header) + header_size;
+    }
+
+    auto& cache = local_cache();
+    if (!cache.free[size_class] && cache.remote.load(std::memory_order_relaxed)) {
+        drain_remote(cache);
+    }
+    auto header = cache.free[size_class];
+    if (header) {
+        cache.free[size_class] = header->next;
+        --cache.count[size_class];
+        m.handler_memory_reused.inc();
+    } else {
+        // at least double the blocks of the class, so that a later peak of a
+        // few more quanta in flight than during the warm-up, e.g. two quanta
+        // back to back, is still served from the list
+        size_t grow = std::min(std::max(cache.owned[size_class], min_grow), max_cached - cache.count[size_class]);
+        header = new_block(cache, size_class);
+        for (size_t i = 1; i < grow; ++i) {
+            push_local(cache, new_block(cache, size_class));
+        }
+        m.handler_memory_allocated.inc(grow);
+    }
+    header->owner = &cache;
+    return reinterpret_cast<char*>(header) + header_size;
+}
+
+void deallocate(void* p, size_t, size_t align) noexcept
+{
+    if (!p) {
+        return;
+    }
+    if (align > header_size) {
+        ::operator delete(p, std::align_val_t(align));
+        return;
+    }
+
+    auto block = reinterpret_cast<header_t*>(static_cast<char*>(p) - header_size);
+    auto owner = block->owner;
+    if (!owner) {
+        ::operator delete(block);
+        return;
+    }
+    if (owner == t_cache.cache) {
+        push_local(*owner, block);
+        return;
+    }
+
+    auto head = owner->remote.load(std::memory_order_relaxed);
+    do {
+        if (head == closed) {
+            ::operator delete(block);
+            return;
+        }
+        block->next = head;
+    } while (!owner->remote.compare_exchange_weak(head, block, std::memory_order_release, std::memory_order_relaxed));
+}
+
+} // namespace handler_memory
@@ -0,0 +1,99 @@
+/*
+   Copyright 2022-2024 mkckr0 <https://github.com/mkckr0>
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+*/
+
+#ifndef HANDLER_ALLOCATOR_HPP
+#define HANDLER_ALLOCATOR_HPP
+
+#include <cstddef>
+#include <type_traits>
+#include <utility>
+
+// Per-thread free lists for the short lived allocations of the audio path:
+// asio operations with their completion handlers, and objects that live as
+// long as the sends of a quantum, like its segments. Blocks up to 16 KiB are
+// kept in size classes by the thread that allocated them and reused by it. A
+// block freed by another thread, e.g. a handler posted by the capture thread
+// and run on the network thread, goes back to its thread through a lock-free
+// list.
+namespace handler_memory {
+
+void* allocate(size_t size, size_t align);
+void deallocate(void* p, size_t size, size_t align) noexcept;
+
+} // namespace handler_memory
+
+// Stateless standard allocator on handler_memory, for std::allocate_shared.
+template <typename T>
+class handler_allocator {
+public:
+    using value_type = T;
+
+    handler_allocator() noexcept = default;
+
+    template <typename U>
+    handler_allocator(const handler_allocator<U>&) noexcept
+    {
+    }
+
+    T* allocate(size_t n)
+    {
+        return static_cast<T*>(handler_memory::allocate(sizeof(T) * n, alignof(T)));
+    }
+
+    void deallocate(T* p, size_t n) noexcept
+    {
+        handler_memory::deallocate(p, sizeof(T) * n, alignof(T));
+    }
+
+    template <typename U>
+    bool operator==(const handler_allocator<U>&) const noexcept
+    {
+        return true;
+    }
+};
+
+// Wraps a completion handler so that asio::associated_allocator finds
+// handler_allocator and the operation that holds it is allocated from
+// handler_memory instead of the heap.
+template <typename Handler>
+class recycled_handler {
+public:
+    using allocator_type = handler_allocator<void>;
+
+    explicit recycled_handler(Handler handler)
+        : _handler(std::move(handler))
+    {
+    }
+
+    allocator_type get_allocator() const noexcept { return {}; }
+
+    template <typename... Args>
+    void operator()(Args&&... args)
+    {
+        _handler(std::forward<Args>(args)...);
+    }
+
+private:
+    Handler _handler;
+};
+
+template <typename Handler>
+recycled_handler<std::decay_t<Handler>> recycled(Handler&& handler)
+{
+    return recycled_handler<std::decay_t<Handler>>(std::forward<Handler>(handler));
+}
+
+#endif // !HANDLER_ALLOCATOR_HPP
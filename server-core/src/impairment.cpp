@@ -0,0 +1,263 @@
+/*
+   Copyright 2022-2024 mkckr0 <https://github.com/mkckr0>
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+*/
+
+#include "impairment.hpp"
+
+#include <algorithm>
+#include <charconv>
+#include <stdexcept>
+#include <string>
+
+namespace {
+
+std::string_view trim(std::string_view s)
+{
+    while (!s.empty() && s.front() == ' ') {
+        s.remove_prefix(1);
+    }
+    while (!s.empty() && s.back() == ' ') {
+        s.remove_suffix(1);
+    }
+    return s;
+}
+
+std::pair<double, std::string_view> parse_number(std::string_view key, std::string_view s)
+{
+    // std::from_chars for double isn't available everywhere yet
+    std::string str(s);
+    size_t pos = 0;
+    double value = 0;
+    try {
+        value = std::stod(str, &pos);
+    } catch (const std::exception&) {
+        throw std::invalid_argument("impairment: bad value for " + std::string(key) + ": " + str);
+    }
+    if (value < 0) {
+        throw std::invalid_argument("impairment: negative value for " + std::string(key));
+    }
+    return { value, s.substr(pos) };
+}
+
+// "1%" or "0.01"
+double parse_probability(std::string_view key, std::string_view s)
+{
+    auto [value, unit] = parse_number(key, s);
+    if (unit == "%") {
+        value /= 100;
+    } else if (!unit.empty()) {
+        throw std::invalid_argument("impairment: bad unit for " + std::string(key) + ": " + std::string(unit));
+    }
+    if (value > 1) {
+        throw std::invalid_argument("impairment: probability out of range for " + std::string(key));
+    }
+    return value;
+}
+
+// "20ms", "500us", "1s", plain numbers are milliseconds
+std::chrono::microseconds parse_duration(std::string_view key, std::string_view s)
+{
+    auto [value, unit] = parse_number(key, s);
+    double scale = 1000;
+    if (unit == "us") {
+        scale = 1;
+    } else if (unit == "s") {
+        scale = 1000000;
+    } else if (!unit.empty() && unit != "ms") {
+        throw std::invalid_argument("impairment: bad unit for " + std::string(key) + ": " + std::string(unit));
+    }
+    return std::chrono::microseconds((int64_t)(value * scale));
+}
+
+// "2mbit", "500kbit", plain numbers are bit/s
+uint64_t parse_rate(std::string_view key, std::string_view s)
+{
+    auto [value, unit] = parse_number(key, s);
+    double scale = 1;
+    if (unit == "kbit") {
+        scale = 1e3;
+    } else if (unit == "mbit") {
+        scale = 1e6;
+    } else if (unit == "gbit") {
+        scale = 1e9;
+    } else if (!unit.empty() && unit != "bit") {
+        throw std::invalid_argument("impairment: bad unit for " + std::string(key) + ": " + std::string(unit));
+    }
+    return (uint64_t)(value * scale);
+}
+
+uint64_t parse_integer(std::string_view key, std::string_view s)
+{
+    uint64_t value = 0;
+    auto [ptr, ec] = std::from_chars(s.data(), s.data() + s.size(), value);
+    if (ec != std::errc() || ptr != s.data() + s.size()) {
+        throw std::invalid_argument("impairment: bad value for " + std::string(key) + ": " + std::string(s));
+    }
+    return value;
+}
+
+// split "a:b:c" into at most N parts
+template <size_t N>
+size_t split_values(std::string_view s, std::array<std::string_view, N>& parts)
+{
+    size_t n = 0;
+    while (n < N) {
+        auto pos = s.find(':');
+        parts[n++] = s.substr(0, pos);
+        if (pos == std::string_view::npos) {
+            return n;
+        }
+        s.remove_prefix(pos + 1);
+    }
+    throw std::invalid_argument("impairment: too many values");
+}
+
+} // namespace
+
+bool impairment::config::enabled() const
+{
+    return loss > 0 || burst_enter > 0 || delay.count() > 0 || jitter.count() > 0 || reorder > 0 || duplicate > 0 || rate > 0;
+}
+
+impairment::config impairment::config::parse(std::string_view spec)
+{
+    config c;
+    while (!spec.empty()) {
+        auto end = spec.find(',');
+        auto item = trim(spec.substr(0, end));
+        spec = end == std::string_view::npos ? std::string_view() : spec.substr(end + 1);
+        if (item.empty()) {
+            continue;
+        }
+
+        auto eq = item.find('=');
+        if (eq == std::string_view::npos) {
+            throw std::invalid_argument("impairment: expected key=value: " + std::string(item));
+        }
+        auto key = trim(item.substr(0, eq));
+        auto value = trim(item.substr(eq + 1));
+
+        if (key == "loss") {
+            c.loss = parse_probability(key, value);
+        } else if (key == "burst") {
+            std::array<std::string_view, 3> parts;
+            auto n = split_values(value, parts);
+            if (n < 2) {
+                throw std::invalid_argument("impairment: burst needs enter:exit[:loss]");
+            }
+            c.burst_enter = parse_probability(key, parts[0]);
+            c.burst_exit = parse_probability(key, parts[1]);
+            if (n > 2) {
+                c.burst_loss = parse_probability(key, parts[2]);
+            }
+        } else if (key == "delay") {
+            c.delay = parse_duration(key, value);
+        } else if (key == "jitter") {
+            c.jitter = parse_duration(key, value);
+        } else if (key == "reorder") {
+            std::array<std::string_view, 2> parts;
+            auto n = split_values(value, parts);
+            c.reorder = parse_probability(key, parts[0]);
+            if (n > 1) {
+                c.reorder_gap = parse_duration(key, parts[1]);
+            }
+        } else if (key == "duplicate") {
+            c.duplicate = parse_probability(key, value);
+        } else if (key == "rate") {
+            c.rate = parse_rate(key, value);
+        } else if (key == "limit") {
+            c.queue_limit = parse_duration(key, value);
+        } else if (key == "seed") {
+            c.seed = parse_integer(key, value);
+        } else {
+            throw std::invalid_argument("impairment: unknown key: " + std::string(key));
+        }
+    }
+    return c;
+}
+
+impairment::impairment(const config& config, uint64_t stream_id)
+    : _config(config)
+    , _state(config.seed * 0x9e3779b97f4a7c15 + stream_id)
+{
+}
+
+// splitmix64, the standard distributions are not reproducible across libraries
+double impairment::uniform()
+{
+    uint64_t z = (_state += 0x9e3779b97f4a7c15);
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111eb;
+    z ^= z >> 31;
+    return (double)(z >> 11) * 0x1.0p-53;
+}
+
+std::chrono::microseconds impairment::jitter()
+{
+    if (_config.jitter.count() == 0) {
+        return {};
+    }
+    auto j = (double)_config.jitter.count();
+    return std::chrono::microseconds((int64_t)((uniform() * 2 - 1) * j));
+}
+
+bool impairment::lost()
+{
+    if (_config.burst_enter > 0) {
+        if (_bad) {
+            _bad = uniform() >= _config.burst_exit;
+        } else {
+            _bad = uniform() < _config.burst_enter;
+        }
+    }
+    auto p = _bad ? _config.burst_loss : _config.loss;
+    return p > 0 && uniform() < p;
+}
+
+auto impairment::process(pipeline_clock::time_point now, size_t size) -> verdict
+{
+    using namespace std::chrono;
+
+    verdict v;
+
+    // serialize onto the rate limited link first, like a bottleneck queue in front of the lossy hop
+    microseconds queue_delay {};
+    if (_config.rate > 0) {
+        auto start = std::max(now, _link_free);
+        if (start - now > _config.queue_limit) {
+            v.queue_dropped = true;
+            return v;
+        }
+        _link_free = start + nanoseconds((int64_t)(size * 8 * 1000000000ull / _config.rate));
+        queue_delay = duration_cast<microseconds>(_link_free - now);
+    }
+
+    if (lost()) {
+        return v;
+    }
+
+    auto base = _config.delay + queue_delay;
+    auto delay = std::max(base + jitter(), microseconds {});
+    if (_config.reorder > 0 && uniform() < _config.reorder) {
+        delay += _config.reorder_gap;
+        v.reordered = true;
+    }
+    v.delay[v.copies++] = delay;
+
+    if (_config.duplicate > 0 && uniform() < _config.duplicate) {
+        v.delay[v.copies++] = std::max(base + jitter(), microseconds {});
+    }
+    return v;
+}
@@ -0,0 +1,77 @@
+/*
+   Copyright 2022-2024 mkckr0 <https://github.com/mkckr0>
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+*/
+
+#ifndef IMPAIRMENT_HPP
+#define IMPAIRMENT_HPP
+
+#include <array>
+#include <chrono>
+#include <cstdint>
+#include <string_view>
+
+#include "pipeline_clock.hpp"
+
+// Simulates a bad network on the send path, so that jitter buffers and loss
+// concealment can be tested on one machine. Each stream has its own state and
+// random generator seeded from the config seed and the stream id, so the same
+// config and the same sequence of datagrams always give the same result.
+class impairment {
+public:
+    struct config {
+        double loss = 0; // loss probability, in the good state when bursts are enabled
+        // Gilbert-Elliott burst loss, the chain is stepped once per datagram
+        double burst_enter = 0; // good -> bad transition probability, 0 disables bursts
+        double burst_exit = 1; // bad -> good transition probability
+        double burst_loss = 1; // loss probability in the bad state
+        std::chrono::microseconds delay { 0 };
+        std::chrono::microseconds jitter { 0 }; // uniform in [-jitter, +jitter], may reorder on its own
+        double reorder = 0; // probability to hold a datagram back by reorder_gap
+        std::chrono::microseconds reorder_gap { 10000 };
+        double duplicate = 0;
+        uint64_t rate = 0; // bit/s, 0 is unlimited
+        std::chrono::microseconds queue_limit { 200000 }; // tail drop when the rate queue is longer
+        uint64_t seed = 1;
+
+        bool enabled() const;
+
+        // Parse "loss=1%,burst=0.5%:30%:80%,delay=20ms,jitter=5ms,reorder=1%:15ms,duplicate=0.1%,rate=2mbit,limit=100ms,seed=7".
+        // Throws std::invalid_argument on malformed input.
+        static config parse(std::string_view spec);
+    };
+
+    struct verdict {
+        size_t copies = 0; // 0 if dropped, 2 if duplicated
+        std::array<std::chrono::microseconds, 2> delay {};
+        bool queue_dropped = false;
+        bool reordered = false;
+    };
+
+    impairment(const config& config, uint64_t stream_id);
+
+    verdict process(pipeline_clock::time_point now, size_t size);
+
+private:
+    double uniform();
+    std::chrono::microseconds jitter();
+    bool lost();
+
+    config _config;
+    uint64_t _state;
+    bool _bad = false;
+    pipeline_clock::time_point _link_free;
+};
+
+#endif // !IMPAIRMENT_HPP
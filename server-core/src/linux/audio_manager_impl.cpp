@@ -18,15 +18,23 @@
 
 #include "audio_manager.hpp"
 #include "client.pb.h"
+#include "handler_allocator.hpp"
 #include "network_manager.hpp"
+#include "metrics.hpp"
+#include "tracer.hpp"
 
+#include <cstring>
 #include <fstream>
 #include <functional>
 #include <iostream>
+#include <mutex>
 #include <vector>
 
 #include <pipewire/pipewire.h>
 #include <spa/param/audio/format-utils.h>
+#include <spa/param/param.h>
+#include <spa/pod/builder.h>
+#include <spa/utils/result.h>
 #include <spdlog/spdlog.h>
 
 using namespace io::github::mkckr0::audio_share_app::pb;
@@ -69,6 +77,9 @@ audio_manager_impl::audio_manager_impl()
     _loop = pw_main_loop_new(nullptr);
     _context = pw_context_new(pw_main_loop_get_loop(_loop), nullptr, 0);
     _core = pw_context_connect(_context, nullptr, 0);
+    if (_core == nullptr) {
+        spdlog::warn("failed to connect to pipewire: {}", strerror(errno));
+    }
     _roundtrip = new roundtrip {
         ._core = _core,
         ._sync = 0,
@@ -78,7 +89,9 @@ audio_manager_impl::audio_manager_impl()
 
 audio_manager_impl::~audio_manager_impl()
 {
-    pw_core_disconnect(_core);
+    if (_core) {
+        pw_core_disconnect(_core);
+    }
     pw_context_destroy(_context);
     pw_main_loop_destroy(_loop);
     pw_deinit();
@@ -87,6 +100,76 @@ audio_manager_impl::~audio_manager_impl()
 
 } // namespace detail
 
+// The process callback runs on the data thread of PipeWire, which gets its
+// priority from PipeWire, e.g. through RTKit in the RT module. So the
+// priority of the policy is asked from the module instead of set directly,
+// and only the CPUs are set here. Called on the main loop.
+static void apply_data_thread_policy(struct pw_context* context, const thread_util::thread_policy& policy)
+{
+#if PW_CHECK_VERSION(0, 3, 50)
+    auto thread = pw_data_loop_get_thread(pw_context_get_data_loop(context));
+    if (thread == nullptr) {
+        spdlog::warn("the pipewire data thread isn't running, the capture thread policy isn't applied");
+        return;
+    }
+    if (policy.realtime_priority > 0) {
+        if (int res = pw_thread_utils_acquire_rt(thread, policy.realtime_priority); res < 0) {
+            spdlog::warn("pipewire refused realtime priority {} for the capture thread: {}", policy.realtime_priority, spa_strerror(res));
+        }
+    }
+    thread_util::set_affinity((pthread_t)thread, policy.cpus, "capture");
+    spdlog::info("capture thread: {}", thread_util::describe((pthread_t)thread));
+#else
+    if (policy.realtime_priority > 0 || !policy.cpus.empty()) {
+        spdlog::warn("the capture thread policy needs pipewire 0.3.50 or later");
+    }
+#endif
+}
+
+// The capture buffers asked from PipeWire. A buffer sent in place stays held
+// until the last send of its segments completed, so there are more than the
+// few a copying capture needs.
+constexpr int capture_buffers = 16;
+constexpr int min_capture_buffers = 4;
+constexpr int max_capture_buffers = 32;
+
+// The pw_buffers held by segments that point into them. The last segment of a
+// quantum goes on any thread, e.g. a network thread or with the io_uring or
+// zerocopy completion, and queues the buffer back itself. The queue of the
+// stream takes one producer at a time, so every pw_stream_queue_buffer of the
+// stream goes through here. The lock is only held for the queueing.
+struct held_buffers_t {
+    struct pw_stream* stream = nullptr;
+    std::mutex mutex;
+    bool closed = false;
+
+    void queue(struct pw_buffer* buffer)
+    {
+        std::lock_guard lock(mutex);
+        if (!closed) {
+            pw_stream_queue_buffer(stream, buffer);
+        }
+    }
+
+    // The stream is destroyed next, and its buffers with it.
+    void close()
+    {
+        std::lock_guard lock(mutex);
+        closed = true;
+    }
+};
+
+// The owner of the segments of one quantum sent in place.
+struct capture_hold_t {
+    std::shared_ptr<held_buffers_t> held;
+    struct pw_buffer* buffer;
+
+    ~capture_hold_t()
+    {
+        held->queue(buffer);
+    }
+};
+
 void audio_manager::do_loopback_recording(std::shared_ptr<network_manager> network_manager, const capture_config& config)
 {
     spdlog::info("endpoint_id: {}", config.endpoint_id);
@@ -144,24 +227,37 @@ void audio_manager::do_loopback_recording(std::shared_ptr<network_manager> netwo
 
     struct user_data_t {
         struct pw_main_loop* loop;
+        struct pw_context* context;
         struct pw_stream* stream;
         std::shared_ptr<class network_manager> network_manager;
         std::shared_ptr<AudioFormat> format;
         int block_align;
+        const thread_util::thread_policy* thread_policy;
+        bool thread_policy_applied; // only touched by the main loop
+        std::shared_ptr<held_buffers_t> held;
     } user_data = {
         .loop = _loop,
+        .context = _context,
         .stream = nullptr,
         .network_manager = network_manager,
         .format = _format,
         .block_align = 0,
+        .thread_policy = &config.thread,
+        .thread_policy_applied = false,
+        .held = std::make_shared<held_buffers_t>(),
     };
 
     static const struct pw_stream_events stream_events = {
         .version = PW_VERSION_STREAM_EVENTS,
         .state_changed = [](void* data, enum pw_stream_state old, enum pw_stream_state state, const char* error) {
             if (state == PW_STREAM_STATE_STREAMING) {
+                auto user_data = (struct user_data_t*)data;
+                if (!user_data->thread_policy_applied) {
+                    // the data thread runs once the stream streams
+                    user_data->thread_policy_applied = true;
+                    apply_data_thread_policy(user_data->context, *user_data->thread_policy);
+                }
                 if (spdlog::get_level() == spdlog::level::trace) {
-                    auto user_data = (struct user_data_t*)data;
                     auto loop = pw_main_loop_get_loop(user_data->loop);
                     auto timer = pw_loop_add_timer(loop, [](void *data, uint64_t expirations){
                         auto user_data = (struct user_data_t*)data;
@@ -265,23 +361,37 @@ void audio_manager::do_loopback_recording(std::shared_ptr<network_manager> netwo
             auto* user_data = (struct user_data_t*)data;
             struct pw_buffer *b;
             struct spa_buffer *buf;
+
+            tracer::set_thread_name("pipewire");
+            tracer::scope trace("capture", "capture");
     
             if ((b = pw_stream_dequeue_buffer(user_data->stream)) == nullptr) {
                 pw_log_warn("out of buffers: %m");
+                metrics::get().capture_xruns.inc();
                 return;
             }
     
             buf = b->buffer;
             if (buf->datas[0].data == nullptr) {
+                user_data->held->queue(b);
                 return;
             }
 
             auto begin = (const char*)buf->datas[0].data + buf->datas[0].chunk->offset;
             auto count = buf->datas[0].chunk->size;
 
+            if (user_data->network_manager->sends_capture_in_place()) {
+                // the segments point into the mapped buffer, the last of them gives it back
+                auto hold = std::allocate_shared<capture_hold_t>(handler_allocator<capture_hold_t>(), user_data->held, b);
+                user_data->network_manager->broadcast_audio_data(begin, count, user_data->block_align, std::move(hold));
+                return;
+            }
+
+            // the pipeline is done with the mapped buffer when this returns, it
+            // copies the quantum for a threaded stage and the segments own their bytes
             user_data->network_manager->broadcast_audio_data(begin, count, user_data->block_align);
     
-            pw_stream_queue_buffer(user_data->stream, b); },
+            user_data->held->queue(b); },
     };
 
     struct pw_properties* props = pw_properties_new(
@@ -291,27 +401,35 @@ void audio_manager::do_loopback_recording(std::shared_ptr<network_manager> netwo
         nullptr);
 
     user_data.stream = pw_stream_new_simple(pw_main_loop_get_loop(_loop), "audio-share-server", props, &stream_events, &user_data);
+    user_data.held->stream = user_data.stream;
 
     // clang-format off
     uint8_t buffer[1024];
     struct spa_pod_builder pod_builder = SPA_POD_BUILDER_INIT(buffer, sizeof(buffer));
-    const struct spa_pod* params[1];
+    const struct spa_pod* params[2];
     struct spa_audio_info_raw info = SPA_AUDIO_INFO_RAW_INIT(
         .format = spa_format,
         .rate = spa_sample_rate,
         .channels = spa_channels,
     );
     params[0] = spa_format_audio_raw_build(&pod_builder, SPA_PARAM_EnumFormat, &info);
+    params[1] = (const struct spa_pod*)spa_pod_builder_add_object(&pod_builder,
+        SPA_TYPE_OBJECT_ParamBuffers, SPA_PARAM_Buffers,
+        SPA_PARAM_BUFFERS_buffers, SPA_POD_CHOICE_RANGE_Int(capture_buffers, min_capture_buffers, max_capture_buffers));
     // clang-format on
 
     pw_stream_connect(user_data.stream, PW_DIRECTION_INPUT, std::stoi(selected_endpoint_id),
         pw_stream_flags(PW_STREAM_FLAG_AUTOCONNECT
             | PW_STREAM_FLAG_MAP_BUFFERS
             | PW_STREAM_FLAG_RT_PROCESS),
-        params, 1);
+        params, 2);
 
     pw_main_loop_run(_loop);
 
+    // stop_server stopped the network threads before the capture, only a send
+    // the kernel hasn't finished may still read a held buffer after this
+    user_data.held->close();
+
     pw_stream_destroy(user_data.stream);
 }
 
@@ -421,17 +539,22 @@ std::string audio_manager::get_default_endpoint()
     return user_data.default_id;
 }
 
-void audio_manager::audio_init(AudioFormat& format)
+void audio_manager::do_audio_init(AudioFormat& format)
+{
+    spdlog::error("not implement");
+}
+
+void audio_manager::do_audio_start()
 {
     spdlog::error("not implement");
 }
 
-void audio_manager::audio_start()
+void audio_manager::do_audio_play(std::span<const char> buffer)
 {
     spdlog::error("not implement");
 }
 
-void audio_manager::audio_play(const std::vector<char>& buffer)
+void audio_manager::do_audio_stop()
 {
     spdlog::error("not implement");
 }
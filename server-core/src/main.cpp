@@ -1,25 +1,62 @@
 #include <cxxopts.hpp>
+#include <algorithm>
+#include <csignal>
+#include <cstdlib>
 #include <iostream>
 #include <spdlog/spdlog.h>
 
 #include "config.h"
+#include "async_log.hpp"
 #include "audio_manager.hpp"
 #include "network_manager.hpp"
+#include "tracer.hpp"
 
 using string = std::string;
 
-std::pair<std::string, uint16_t> parse_host_port(const std::string& s) {
+std::pair<std::string, uint16_t> parse_host_port(const std::string& s, uint16_t default_port = 65530) {
+    if (s.starts_with("unix:")) {
+        // a Unix socket path, network_manager ignores the port
+        return {s, default_port};
+    }
     size_t pos = s.find(':');
     std::string host = s.substr(0, pos);
     uint16_t port;
     if (pos == std::string::npos) {
-        port = 65530;
+        port = default_port;
     } else {
         port = (uint16_t)std::stoi(s.substr(pos + 1));
     }
     return {host, port};
 }
 
+// The runtime dir of the user keeps the ring's socket out of the shared /tmp.
+std::string default_shm_path() {
+    const char* dir = std::getenv("XDG_RUNTIME_DIR");
+    if (dir && *dir) {
+        return std::string(dir) + "/audio-share.sock";
+    }
+    return "/tmp/audio-share.sock";
+}
+
+// Without --trace, Ctrl-C ends the process right away. With it, write the
+// trace first, then exit the same way while the other threads still run.
+void write_trace_on_signal(const std::string& path) {
+    asio::io_context ioc;
+    asio::signal_set signals(ioc, SIGINT, SIGTERM);
+    signals.async_wait([&](const asio::error_code& ec, int) {
+        if (ec) {
+            return;
+        }
+        if (tracer::write(path)) {
+            spdlog::info("trace written to {}", path);
+        } else {
+            spdlog::error("failed to write the trace to {}", path);
+        }
+        std::_Exit(EXIT_SUCCESS);
+    });
+    ioc.run();
+}
+
 int main(int argc, char* argv[])
 {
     auto default_address = network_manager::get_default_address();
@@ -31,19 +68,45 @@ int main(int argc, char* argv[])
     help_string += fmt::format("  {} -l\n", AUDIO_SHARE_BIN_NAME);
     help_string += fmt::format("  {} --list-encoding\n", AUDIO_SHARE_BIN_NAME);
     help_string += fmt::format("  {} --connect={}\n", AUDIO_SHARE_BIN_NAME, "192.168.3.2");
+    help_string += fmt::format("  {} --bind=unix:{}\n", AUDIO_SHARE_BIN_NAME, "/run/audio-share.sock");
+    help_string += fmt::format("  {} --bind={} --relay={}\n", AUDIO_SHARE_BIN_NAME, default_address.empty() ? "192.168.4.2": default_address, "192.168.3.2");
     cxxopts::Options options(AUDIO_SHARE_BIN_NAME, help_string);
 
     // clang-format off
     options.add_options()
         ("h,help", "Print usage")
         ("l,list-endpoint", "List available endpoints")
-        ("connect", "Connect to server", cxxopts::value<string>(), "[host][:<port>]")
-        ("b,bind", "The server bind address. If not set, will use default", cxxopts::value<string>()->implicit_value(default_address), "[host][:<port>]")
+        ("connect", "Connect to server. unix:<path> connects to a server on the same host over a Unix socket", cxxopts::value<string>(), "[host][:<port>]")
+        ("b,bind", "The server bind address. If not set, will use default. unix:<path> serves the clients on the same host over a Unix socket instead of TCP and UDP, Linux only", cxxopts::value<string>()->implicit_value(default_address), "[host][:<port>]")
         ("e,endpoint", "Specify the endpoint id. If not set or set \"default\", will use default", cxxopts::value<string>()->default_value("default"), "[endpoint]")
         ("encoding", "Specify the capture encoding. If not set or set \"default\", will use default", cxxopts::value<audio_manager::encoding_t>()->default_value("default"), "[encoding]")
         ("list-encoding", "List available encoding")
         ("channels", "Specify the capture channels. If not set or set \"0\", will use default", cxxopts::value<int>()->default_value("0"), "[channels]")
         ("sample-rate", "Specify the capture sample rate(Hz). If not set or set \"0\", will use default. The common values are 44100, 48000, etc.", cxxopts::value<int>()->default_value("0"), "[sample_rate]")
+        ("synthetic", "Broadcast a generated test signal instead of capturing the endpoint")
+        ("relay", "Subscribe to this server and send its audio to the own clients unchanged instead of capturing, to build distribution trees. Used with --bind. Reconnects with backoff when the upstream session ends and closes the own sessions when the upstream format changes", cxxopts::value<string>(), "[host][:<port>]")
+        ("metrics", "Serve Prometheus metrics at http://[host][:<port>]/metrics. The default port is 9464", cxxopts::value<string>()->implicit_value("127.0.0.1"), "[host][:<port>]")
+        ("impair", "Simulate a bad network on the audio datagrams for testing, e.g. \"loss=1%,burst=1%:30%,delay=20ms,jitter=5ms,reorder=1%,duplicate=0.1%,rate=2mbit,seed=1\"", cxxopts::value<string>(), "[spec]")
+        ("shm", "With --bind, hand a shared memory ring with the audio to the clients on the same host through a Unix socket at this path, $XDG_RUNTIME_DIR/audio-share.sock by default, that only the own user may connect to. With --connect, read the ring of a server on the same host instead of receiving datagrams. Linux only", cxxopts::value<string>()->implicit_value(default_shm_path()), "[path]")
+        ("record", "Record the received audio datagrams with their receive time to a file, for as-replay. Used with --connect", cxxopts::value<string>(), "[file]")
+        ("warn-post-latency", "Warn when a quantum waits longer for the network thread. The default is 5000, 0 disables", cxxopts::value<int>(), "[us]")
+        ("warn-send-latency", "Warn when the sends of a quantum complete later after it is posted. The default is 10000, 0 disables", cxxopts::value<int>(), "[us]")
+        ("warn-loop-lag", "Warn when a 100ms timer on the network thread fires later. The default is 5000, 0 disables", cxxopts::value<int>(), "[us]")
+        ("trace", "Trace the pipeline stages of every audio quantum and write them as Chrome trace JSON on Ctrl-C. Open it in https://ui.perfetto.dev", cxxopts::value<string>(), "[file]")
+        ("pipeline-threads", "Run these stages between the capture and the network thread on their own threads, e.g. \"packetize\". The stages are convert, encode and packetize", cxxopts::value<string>(), "[stages]")
+        ("pipeline-slots", "Quanta in flight between the capture and the network thread, more are dropped. The default is 8", cxxopts::value<int>(), "[n]")
+        ("send-backend", "Send the audio datagrams with \"asio\" or \"uring\", which batches the sends of a quantum into one io_uring submission on Linux. The default is asio", cxxopts::value<string>(), "[backend]")
+        ("zerocopy", "Send the quanta from this size up with MSG_ZEROCOPY and UDP GSO instead of copying them once per peer, Linux only. Pays off for large quanta, e.g. 192kHz 8 channel", cxxopts::value<int>()->implicit_value("16384"), "[bytes]")
+        ("connected-peers", "Send to every peer from its own UDP socket connected to it, sharing the server port with SO_REUSEPORT, which skips the route lookup per datagram. Linux only")
+        ("sender-threads", "Send the audio from this many threads, each with its own UDP socket on the server port via SO_REUSEPORT, with the peers spread over them. Linux only, 0 sends from the network thread", cxxopts::value<int>(), "[n]")
+        ("accept-threads", "Accept the TCP connections on this many threads, each with its own listening socket on the server port via SO_REUSEPORT, for storms of connections. The sessions still run on the network thread. Linux only, 0 accepts on the network thread", cxxopts::value<int>(), "[n]")
+        ("capture-cpus", "Pin the capture thread to CPUs, e.g. \"2\", \"2,3\" or \"0-3\"", cxxopts::value<string>(), "[cpus]")
+        ("network-cpus", "Pin the network thread to CPUs", cxxopts::value<string>(), "[cpus]")
+        ("pipeline-cpus", "Pin the pipeline stage threads to CPUs", cxxopts::value<string>(), "[cpus]")
+        ("sender-cpus", "Pin the sender threads to CPUs", cxxopts::value<string>(), "[cpus]")
+        ("playout-cpus", "Pin the playout thread to CPUs. Used with --connect on Windows", cxxopts::value<string>(), "[cpus]")
+        ("rt-priority", "Request realtime scheduling for the capture, network and playout threads. On Linux it's SCHED_FIFO with this priority(1-99), which needs CAP_SYS_NICE or an rtprio limit. The PipeWire capture thread asks PipeWire for it, which uses RTKit", cxxopts::value<int>(), "[priority]")
+        ("async-log", "Write the log from a background thread. The audio threads drop records instead of waiting when its queue is full")
         ("V,verbose", "Set log level to \"trace\"")
         ("v,version", "Show version")
         ;
@@ -64,6 +127,9 @@ int main(int argc, char* argv[])
         if (result.count("verbose")) {
             spdlog::set_level(spdlog::level::trace);
         }
+        if (result.count("async-log")) {
+            async_log::start();
+        }
 
         if (result.count("list-endpoint")) {
             auto audio_manager = std::make_shared<class audio_manager>();
@@ -94,6 +160,23 @@ int main(int argc, char* argv[])
             return EXIT_SUCCESS;
         }
 
+        auto thread_policy = [&](const char* cpus_option) {
+            thread_util::thread_policy policy;
+            if (result.count(cpus_option)) {
+                policy.cpus = thread_util::thread_policy::parse_cpus(result[cpus_option].as<string>());
+            }
+            if (result.count("rt-priority")) {
+                policy.realtime_priority = result["rt-priority"].as<int>();
+            }
+            return policy;
+        };
+
+        std::string trace_path;
+        if (result.count("trace")) {
+            trace_path = result["trace"].as<string>();
+            tracer::start();
+        }
+
         if (result.count("bind")) {
             auto s = result["bind"].as<string>();
             auto [host, port] = parse_host_port(s);
@@ -106,10 +189,65 @@ int main(int argc, char* argv[])
             capture_config.encoding = result["encoding"].as<audio_manager::encoding_t>();
             capture_config.channels = result["channels"].as<int>();
             capture_config.sample_rate = result["sample-rate"].as<int>();
+            capture_config.synthetic = result.count("synthetic");
+            capture_config.thread = thread_policy("capture-cpus");
+
+            network_manager::server_config server_config;
+            if (result.count("relay")) {
+                std::tie(server_config.upstream_host, server_config.upstream_port) = parse_host_port(result["relay"].as<string>());
+            }
+            if (result.count("metrics")) {
+                std::tie(server_config.metrics_host, server_config.metrics_port) = parse_host_port(result["metrics"].as<string>(), 9464);
+            }
+            if (result.count("impair")) {
+                server_config.impairment = impairment::config::parse(result["impair"].as<string>());
+            }
+            if (result.count("warn-post-latency")) {
+                server_config.post_latency_warning = std::chrono::microseconds(result["warn-post-latency"].as<int>());
+            }
+            if (result.count("warn-send-latency")) {
+                server_config.send_latency_warning = std::chrono::microseconds(result["warn-send-latency"].as<int>());
+            }
+            if (result.count("warn-loop-lag")) {
+                server_config.loop_lag_warning = std::chrono::microseconds(result["warn-loop-lag"].as<int>());
+            }
+            server_config.net_thread = thread_policy("network-cpus");
+            if (result.count("pipeline-threads")) {
+                server_config.pipeline.own_thread = audio_pipeline::config::parse_threaded_stages(result["pipeline-threads"].as<string>());
+            }
+            if (result.count("pipeline-slots")) {
+                server_config.pipeline.slots = (size_t)std::max(1, result["pipeline-slots"].as<int>());
+            }
+            server_config.pipeline.threads.fill(thread_policy("pipeline-cpus"));
+            if (result.count("send-backend")) {
+                auto backend = result["send-backend"].as<string>();
+                if (backend == "uring") {
+                    server_config.send_backend = network_manager::send_backend_t::uring;
+                } else if (backend != "asio") {
+                    throw std::invalid_argument("unknown send backend: " + backend);
+                }
+            }
+            if (result.count("zerocopy")) {
+                server_config.zerocopy_min_payload = (size_t)std::max(1, result["zerocopy"].as<int>());
+            }
+            server_config.connected_peers = result.count("connected-peers");
+            if (result.count("sender-threads")) {
+                server_config.sender_threads = (size_t)std::max(0, result["sender-threads"].as<int>());
+            }
+            server_config.sender_thread = thread_policy("sender-cpus");
+            if (result.count("accept-threads")) {
+                server_config.accept_threads = (size_t)std::max(0, result["accept-threads"].as<int>());
+            }
+            if (result.count("shm")) {
+                server_config.shm_path = result["shm"].as<string>();
+            }
 
             auto network_manager = std::make_shared<class network_manager>(audio_manager);
 
-            network_manager->start_server(host, port, capture_config);
+            network_manager->start_server(host, port, capture_config, server_config);
+            if (!trace_path.empty()) {
+                write_trace_on_signal(trace_path);
+            }
             network_manager->wait_server();
 
             return EXIT_SUCCESS;
@@ -121,8 +259,17 @@ int main(int argc, char* argv[])
 
             auto audio_manager = std::make_shared<class audio_manager>();
             auto network_manager = std::make_shared<class network_manager>(audio_manager);
+            if (result.count("record")) {
+                network_manager->set_record_path(result["record"].as<string>());
+            }
+            network_manager->set_net_thread_policy(thread_policy("network-cpus"));
+            network_manager->set_use_shm(result.count("shm"));
+            audio_manager->set_playout_policy(thread_policy("playout-cpus"));
 
             network_manager->start_client(host, port);
+            if (!trace_path.empty()) {
+                write_trace_on_signal(trace_path);
+            }
             network_manager->wait_client();
 
             return EXIT_SUCCESS;
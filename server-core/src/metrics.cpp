@@ -0,0 +1,132 @@
+/*
+   Copyright 2022-2024 mkckr0 <https://github.com/mkckr0>
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+*/
+
+#include "metrics.hpp"
+
+#include <algorithm>
+#include <iterator>
+
+#include <fmt/format.h>
+
+namespace metrics {
+
+registry& get()
+{
+    static registry r;
+    return r;
+}
+
+void text_writer::header(std::string_view name, std::string_view type, std::string_view help)
+{
+    fmt::format_to(std::back_inserter(_out), "# HELP {} {}\n# TYPE {} {}\n", name, help, name, type);
+}
+
+void text_writer::sample(std::string_view name, uint64_t value, std::string_view labels)
+{
+    if (labels.empty()) {
+        fmt::format_to(std::back_inserter(_out), "{} {}\n", name, value);
+    } else {
+        fmt::format_to(std::back_inserter(_out), "{}{{{}}} {}\n", name, labels, value);
+    }
+}
+
+void text_writer::sample(std::string_view name, int64_t value, std::string_view labels)
+{
+    if (labels.empty()) {
+        fmt::format_to(std::back_inserter(_out), "{} {}\n", name, value);
+    } else {
+        fmt::format_to(std::back_inserter(_out), "{}{{{}}} {}\n", name, labels, value);
+    }
+}
+
+void text_writer::write(std::string_view name, std::string_view help, const counter& c)
+{
+    header(name, "counter", help);
+    sample(name, c.value());
+}
+
+void text_writer::write(std::string_view name, std::string_view help, const gauge& g)
+{
+    header(name, "gauge", help);
+    sample(name, g.value());
+}
+
+void text_writer::write(std::string_view name, std::string_view help, const histogram& h, double scale)
+{
+    header(name, "histogram", help);
+    uint64_t cumulative = 0;
+    for (size_t i = 0; i < histogram::bucket_count; ++i) {
+        cumulative += h.bucket(i);
+        fmt::format_to(std::back_inserter(_out), "{}_bucket{{le=\"{}\"}} {}\n", name, (double)(uint64_t(1) << i) * scale, cumulative);
+    }
+    // the overflow only counts in +Inf, read count after the buckets so that
+    // +Inf is never less than the last bucket
+    cumulative += h.overflow();
+    auto count = std::max(h.count(), cumulative);
+    fmt::format_to(std::back_inserter(_out), "{}_bucket{{le=\"+Inf\"}} {}\n", name, count);
+    fmt::format_to(std::back_inserter(_out), "{}_sum {}\n", name, (double)h.sum() * scale);
+    fmt::format_to(std::back_inserter(_out), "{}_count {}\n", name, count);
+}
+
+void write_registry(text_writer& w, const registry& r)
+{
+    w.write("audio_share_capture_quanta_total", "Audio quanta delivered by the capture backend", r.capture_quanta);
+    w.write("audio_share_capture_xruns_total", "Capture overruns or discontinuities reported by the audio backend", r.capture_xruns);
+    w.write("audio_share_capture_bytes_total", "Bytes delivered by the capture backend", r.capture_bytes);
+    w.write("audio_share_segments_per_quantum", "UDP segments produced per audio quantum", r.segments_per_quantum);
+    w.write("audio_share_convert_seconds", "Time spent in the convert stage per quantum", r.convert_time, 1e-6);
+    w.write("audio_share_encode_seconds", "Time spent in the encode stage per quantum", r.encode_time, 1e-6);
+    w.write("audio_share_packetize_seconds", "Time spent in the packetize stage per quantum", r.packetize_time, 1e-6);
+    w.write("audio_share_pipeline_latency_seconds", "Time from the capture of a quantum to its post to the network thread", r.pipeline_latency, 1e-6);
+    w.write("audio_share_pipeline_queued", "Quanta waiting in the queues in front of threaded stages", r.pipeline_queued);
+    w.write("audio_share_pipeline_dropped_total", "Quanta dropped because every pipeline slot was in flight", r.pipeline_dropped);
+    w.write("audio_share_post_queue_bytes", "Bytes posted to the network thread but not yet executed", r.post_queue_bytes);
+    w.write("audio_share_udp_bytes_sent_total", "UDP payload bytes sent to all peers", r.udp_bytes_sent);
+    w.write("audio_share_udp_packets_sent_total", "UDP datagrams sent to all peers", r.udp_packets_sent);
+    w.write("audio_share_udp_send_errors_total", "UDP sends completed with an error", r.udp_send_errors);
+    w.write("audio_share_udp_sync_sends_total", "UDP sends that completed right away on the non-blocking socket", r.udp_sync_sends);
+    w.write("audio_share_udp_async_sends_total", "UDP sends that waited for the socket, e.g. because its buffer was full", r.udp_async_sends);
+    w.write("audio_share_send_queue_bytes", "Bytes handed to the socket but not yet completed", r.send_queue_bytes);
+    w.write("audio_share_post_latency_seconds", "Time from posting a quantum to the start of its handler on the network thread", r.post_latency, 1e-6);
+    w.write("audio_share_send_latency_seconds", "Time from posting a quantum to the completion of its last send", r.send_latency, 1e-6);
+    w.write("audio_share_loop_lag_seconds", "How late a periodic timer fires on the network thread", r.loop_lag, 1e-6);
+    w.write("audio_share_post_latency_warnings_total", "Quanta whose post latency exceeded the warning threshold", r.post_latency_warnings);
+    w.write("audio_share_send_latency_warnings_total", "Quanta whose send latency exceeded the warning threshold", r.send_latency_warnings);
+    w.write("audio_share_loop_lag_warnings_total", "Loop lag probes that exceeded the warning threshold", r.loop_lag_warnings);
+    w.write("audio_share_impaired_dropped_total", "Datagrams dropped by the impairment simulator", r.impaired_dropped);
+    w.write("audio_share_impaired_duplicated_total", "Datagrams duplicated by the impairment simulator", r.impaired_duplicated);
+    w.write("audio_share_impaired_reordered_total", "Datagrams held back for reordering by the impairment simulator", r.impaired_reordered);
+    w.write("audio_share_uring_submits_total", "io_uring_enter calls that submitted sends", r.uring_submits);
+    w.write("audio_share_uring_fallbacks_total", "Sends that went through asio because every io_uring buffer or entry was in flight", r.uring_fallbacks);
+    w.write("audio_share_zerocopy_sends_total", "sendmsg calls with MSG_ZEROCOPY, one per GSO batch", r.zerocopy_sends);
+    w.write("audio_share_zerocopy_copied_total", "Zero-copy sends that the kernel copied anyway", r.zerocopy_copied);
+    w.write("audio_share_zerocopy_fallbacks_total", "Segments of zero-copy quanta sent with a copy instead", r.zerocopy_fallbacks);
+    w.write("audio_share_zerocopy_pending", "Zero-copy sends whose completion notification hasn't arrived", r.zerocopy_pending);
+    w.write("audio_share_tcp_accepted_total", "Accepted TCP connections", r.tcp_accepted);
+    w.write("audio_share_handshakes_total", "Sessions that completed cmd_start_play", r.handshakes);
+    w.write("audio_share_heartbeat_timeouts_total", "Sessions closed because of a heartbeat timeout", r.heartbeat_timeouts);
+    w.write("audio_share_sessions", "Sessions currently playing", r.sessions);
+    w.write("audio_share_relay_datagrams_total", "Audio datagrams received from the upstream server of a relay", r.relay_datagrams);
+    w.write("audio_share_relay_bytes_total", "Bytes received from the upstream server of a relay", r.relay_bytes);
+    w.write("audio_share_relay_reconnects_total", "Upstream sessions a relay lost and connected again", r.relay_reconnects);
+    w.write("audio_share_shm_datagrams_total", "Audio datagrams written to the shared memory ring", r.shm_datagrams);
+    w.write("audio_share_shm_readers", "Sessions reading the shared memory ring", r.shm_readers);
+    w.write("audio_share_log_dropped_total", "Log records dropped because the async log queue was full", r.log_dropped);
+    w.write("audio_share_handler_memory_reused_total", "Handler and per-quantum allocations served from a per-thread free list", r.handler_memory_reused);
+    w.write("audio_share_handler_memory_allocated_total", "Handler and per-quantum allocations that went to the heap", r.handler_memory_allocated);
+}
+
+} // namespace metrics
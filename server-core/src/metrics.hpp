@@ -0,0 +1,172 @@
+/*
+   Copyright 2022-2024 mkckr0 <https://github.com/mkckr0>
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+*/
+
+#ifndef METRICS_HPP
+#define METRICS_HPP
+
+#include <array>
+#include <atomic>
+#include <bit>
+#include <chrono>
+#include <cstdint>
+#include <string>
+#include <string_view>
+
+namespace metrics {
+
+// All updates are relaxed atomics. Metrics are only read by the exporter, so
+// no ordering between different metrics is required.
+
+class counter {
+public:
+    void inc(uint64_t n = 1) { _value.fetch_add(n, std::memory_order_relaxed); }
+    uint64_t value() const { return _value.load(std::memory_order_relaxed); }
+
+private:
+    std::atomic<uint64_t> _value { 0 };
+};
+
+class gauge {
+public:
+    void set(int64_t v) { _value.store(v, std::memory_order_relaxed); }
+    void add(int64_t n) { _value.fetch_add(n, std::memory_order_relaxed); }
+    void sub(int64_t n) { _value.fetch_sub(n, std::memory_order_relaxed); }
+    int64_t value() const { return _value.load(std::memory_order_relaxed); }
+
+private:
+    std::atomic<int64_t> _value { 0 };
+};
+
+// Histogram with power of two bucket bounds: bucket i counts samples <= 2^i,
+// larger samples only count in overflow.
+class histogram {
+public:
+    static constexpr size_t bucket_count = 24;
+
+    void observe(uint64_t v)
+    {
+        size_t i = v <= 1 ? 0 : (size_t)std::bit_width(v - 1);
+        if (i >= bucket_count) {
+            i = bucket_count;
+        }
+        _buckets[i].fetch_add(1, std::memory_order_relaxed);
+        _sum.fetch_add(v, std::memory_order_relaxed);
+        _count.fetch_add(1, std::memory_order_relaxed);
+    }
+
+    template <typename Rep, typename Period>
+    void observe(std::chrono::duration<Rep, Period> d)
+    {
+        auto us = std::chrono::duration_cast<std::chrono::microseconds>(d).count();
+        observe(us > 0 ? (uint64_t)us : 0);
+    }
+
+    uint64_t bucket(size_t i) const { return _buckets[i].load(std::memory_order_relaxed); }
+    uint64_t overflow() const { return _buckets[bucket_count].load(std::memory_order_relaxed); }
+    uint64_t sum() const { return _sum.load(std::memory_order_relaxed); }
+    uint64_t count() const { return _count.load(std::memory_order_relaxed); }
+
+private:
+    std::array<std::atomic<uint64_t>, bucket_count + 1> _buckets {}; // the last one is the overflow
+    std::atomic<uint64_t> _sum { 0 };
+    std::atomic<uint64_t> _count { 0 };
+};
+
+// Process wide metrics. Members are grouped by the thread that writes them so
+// that the capture thread and the network thread don't share cache lines.
+struct registry {
+    // capture thread
+    alignas(64) counter capture_quanta;
+    counter capture_xruns;
+    counter capture_bytes;
+
+    // audio_pipeline stages, on the capture thread or on their own threads
+    alignas(64) histogram segments_per_quantum;
+    histogram convert_time; // us
+    histogram encode_time; // us
+    histogram packetize_time; // us
+    histogram pipeline_latency; // us, from the capture to the hand-off to the network thread
+    gauge pipeline_queued;
+    counter pipeline_dropped;
+
+    // posted by the capture thread, drained by the network thread
+    alignas(64) gauge post_queue_bytes;
+
+    // network thread, and the sender threads when there are any
+    alignas(64) counter udp_bytes_sent;
+    counter udp_packets_sent;
+    counter udp_send_errors;
+    counter udp_sync_sends;
+    counter udp_async_sends;
+    gauge send_queue_bytes;
+    histogram post_latency; // us, from post to the start of the handler on the network thread
+    histogram send_latency; // us, from post to the last send completion of a quantum
+    histogram loop_lag; // us, how late the loop lag probe timer fires
+    counter post_latency_warnings;
+    counter send_latency_warnings;
+    counter loop_lag_warnings;
+    counter impaired_dropped;
+    counter impaired_duplicated;
+    counter impaired_reordered;
+    counter uring_submits;
+    counter uring_fallbacks;
+    counter zerocopy_sends;
+    counter zerocopy_copied;
+    counter zerocopy_fallbacks;
+    gauge zerocopy_pending;
+
+    alignas(64) counter tcp_accepted;
+    counter handshakes;
+    counter heartbeat_timeouts;
+    gauge sessions;
+    counter relay_datagrams;
+    counter relay_bytes;
+    counter relay_reconnects;
+    counter shm_datagrams;
+    gauge shm_readers;
+
+    // any thread that logs
+    alignas(64) counter log_dropped;
+
+    // any thread that allocates handler_memory
+    alignas(64) counter handler_memory_reused;
+    counter handler_memory_allocated;
+};
+
+registry& get();
+
+// Prometheus text exposition format (version 0.0.4)
+class text_writer {
+public:
+    void header(std::string_view name, std::string_view type, std::string_view help);
+    void sample(std::string_view name, uint64_t value, std::string_view labels = {});
+    void sample(std::string_view name, int64_t value, std::string_view labels = {});
+    void write(std::string_view name, std::string_view help, const counter& c);
+    void write(std::string_view name, std::string_view help, const gauge& g);
+    // scale converts the bucket unit to the exported unit, e.g. 1e-6 for us to seconds
+    void write(std::string_view name, std::string_view help, const histogram& h, double scale = 1.0);
+
+    const std::string& str() const { return _out; }
+
+private:
+    std::string _out;
+};
+
+void write_registry(text_writer& writer, const registry& r);
+
+} // namespace metrics
+
+#endif // !METRICS_HPP
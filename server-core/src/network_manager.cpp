@@ -17,10 +17,22 @@
 #include "network_manager.hpp"
 #include "formatter.hpp"
 #include "audio_manager.hpp"
+#include "handler_allocator.hpp"
+#include "metrics.hpp"
+#include "packet_trace.hpp"
+#include "packetizer.hpp"
+#include "synthetic_source.hpp"
+#include "thread_util.hpp"
+#include "tracer.hpp"
 
 #include <list>
 #include <ranges>
 #include <coroutine>
+#include <cerrno>
+#include <cstring>
+#include <random>
+#include <string_view>
+#include <utility>
 
 #ifdef _WINDOWS
 #define NOMINMAX
@@ -33,7 +45,10 @@
 
 #ifdef linux
 #include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
 #include <ifaddrs.h>
+#include <unistd.h>
 #endif
 
 #include <spdlog/spdlog.h>
@@ -43,6 +58,191 @@
 namespace ip = asio::ip;
 using namespace std::chrono_literals;
 
+namespace {
+
+// host of a server on the same host, followed by the path of its Unix socket
+constexpr std::string_view local_scheme = "unix:";
+
+// Counts the samples over a threshold and logs at most one warning a second,
+// so a stalled network thread doesn't also flood the log.
+class latency_warning {
+public:
+    explicit latency_warning(const char* what)
+        : _what(what)
+    {
+    }
+
+    void observe(pipeline_clock::duration value, std::chrono::microseconds threshold, metrics::counter& over)
+    {
+        if (threshold.count() == 0 || value <= threshold) {
+            return;
+        }
+        over.inc();
+        auto count = _count.fetch_add(1, std::memory_order_relaxed) + 1;
+
+        auto now = std::chrono::steady_clock::now().time_since_epoch().count();
+        auto last = _last_log.load(std::memory_order_relaxed);
+        if (now - last < std::chrono::steady_clock::duration(1s).count() || !_last_log.compare_exchange_strong(last, now)) {
+            return;
+        }
+        _count.fetch_sub(count, std::memory_order_relaxed);
+        spdlog::warn("{} {}us exceeded {}us, {} time(s) since the last warning", _what,
+            std::chrono::duration_cast<std::chrono::microseconds>(value).count(), threshold.count(), count);
+    }
+
+private:
+    const char* _what;
+    std::atomic<uint64_t> _count { 0 };
+    std::atomic<std::chrono::steady_clock::rep> _last_log { 0 };
+};
+
+latency_warning g_post_latency_warning("post latency");
+latency_warning g_send_latency_warning("send latency");
+latency_warning g_loop_lag_warning("network thread loop lag");
+
+// observes the send latency when the last send of a quantum completes
+struct quantum_latency_probe {
+    pipeline_clock::time_point post_time;
+    pipeline_clock::time_point send_time;
+    std::chrono::microseconds warning;
+    uint64_t trace_id = 0; // 0 when tracing was off at the post
+
+    ~quantum_latency_probe()
+    {
+        auto now = pipeline_clock::now();
+        auto& m = metrics::get();
+        m.send_latency.observe(now - post_time);
+        g_send_latency_warning.observe(now - post_time, warning, m.send_latency_warnings);
+        if (trace_id) {
+            tracer::async("server", "send_completion", trace_id, send_time, now);
+        }
+    }
+};
+
+// For the logs, a peer that already reset has no remote endpoint any more.
+template <typename Socket>
+typename Socket::endpoint_type remote_endpoint_of(const Socket& socket)
+{
+    asio::error_code ec;
+    return socket.remote_endpoint(ec);
+}
+
+// Let more UDP sockets bind to the port of this one, which every socket
+// sharing the port needs before bind. Linux only.
+template <typename Socket>
+bool enable_reuse_port(Socket& socket)
+{
+#ifdef linux
+    int on = 1;
+    return setsockopt(socket.native_handle(), SOL_SOCKET, SO_REUSEPORT, &on, sizeof(on)) == 0;
+#else
+    return false;
+#endif
+}
+
+#ifdef linux
+// Receive one datagram with the SO_TIMESTAMPNS time the kernel attached to it.
+// Returns -1 with errno set like recvmsg().
+ssize_t receive_with_kernel_timestamp(int fd, char* data, size_t size, std::chrono::nanoseconds& timestamp)
+{
+    iovec iov { data, size };
+    alignas(cmsghdr) char control[CMSG_SPACE(sizeof(timespec))];
+    msghdr msg {};
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+
+    auto n = recvmsg(fd, &msg, MSG_DONTWAIT);
+    if (n < 0) {
+        return n;
+    }
+    timestamp = std::chrono::steady_clock::now().time_since_epoch();
+    for (auto cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+        if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_TIMESTAMPNS) {
+            timespec ts;
+            std::memcpy(&ts, CMSG_DATA(cmsg), sizeof(ts));
+            timestamp = std::chrono::seconds(ts.tv_sec) + std::chrono::nanoseconds(ts.tv_nsec);
+        }
+    }
+    return n;
+}
+
+// Pass up to two fds to the process on the other end of a Unix socket, along
+// with data. Returns false with errno set.
+bool send_fds(int socket, const void* data, size_t size, const int* fds, size_t count)
+{
+    iovec iov { (void*)data, size };
+    alignas(cmsghdr) char control[CMSG_SPACE(sizeof(int) * 2)] {};
+    msghdr msg {};
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = CMSG_SPACE(sizeof(int) * count);
+    auto cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(int) * count);
+    std::memcpy(CMSG_DATA(cmsg), fds, sizeof(int) * count);
+    return sendmsg(socket, &msg, MSG_NOSIGNAL | MSG_DONTWAIT) == (ssize_t)size;
+}
+
+// Receive the data and fds of send_fds. Returns the number of fds received,
+// the caller owns them, 0 when the data is short.
+size_t receive_fds(int socket, void* data, size_t size, int* fds, size_t count)
+{
+    iovec iov { data, size };
+    alignas(cmsghdr) char control[CMSG_SPACE(sizeof(int) * 2)] {};
+    msghdr msg {};
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = CMSG_SPACE(sizeof(int) * count);
+    auto n = recvmsg(socket, &msg, MSG_CMSG_CLOEXEC | MSG_DONTWAIT);
+    if (n <= 0) {
+        return 0;
+    }
+    auto cmsg = CMSG_FIRSTHDR(&msg);
+    if (!cmsg || cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS) {
+        return 0;
+    }
+    auto received = std::min(count, (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int));
+    std::memcpy(fds, CMSG_DATA(cmsg), sizeof(int) * received);
+    if ((size_t)n != size) {
+        for (size_t i = 0; i < received; ++i) {
+            close(fds[i]);
+        }
+        return 0;
+    }
+    return received;
+}
+
+// A socket an acceptor thread released for the network thread, closed if it
+// never gets there.
+struct released_socket {
+    int fd = -1;
+
+    explicit released_socket(int fd)
+        : fd(fd)
+    {
+    }
+
+    released_socket(released_socket&& other) noexcept
+        : fd(std::exchange(other.fd, -1))
+    {
+    }
+
+    ~released_socket()
+    {
+        if (fd >= 0) {
+            close(fd);
+        }
+    }
+};
+#endif // linux
+
+} // namespace
+
 network_manager::network_manager(std::shared_ptr<audio_manager>& audio_manager)
     : _audio_manager(audio_manager)
 {
@@ -148,47 +348,154 @@ std::string network_manager::select_default_address(const std::vector<std::strin
 }
 
 void network_manager::start_server(const std::string& host, uint16_t port, const audio_manager::capture_config& capture_config)
+{
+    start_server(host, port, capture_config, server_config {});
+}
+
+void network_manager::start_server(const std::string& host, uint16_t port, const audio_manager::capture_config& capture_config, const server_config& server_config)
 {
     _ioc = std::make_shared<asio::io_context>();
-    {
+    _server_config = server_config;
+    if (host.starts_with(local_scheme)) {
+        // the sessions and their audio stay on the host, there is no TCP or UDP socket
+        start_local_listener(host.substr(local_scheme.size()));
+    } else {
         ip::tcp::endpoint endpoint { ip::make_address(host), port };
 
-        ip::tcp::acceptor acceptor(*_ioc, endpoint.protocol());
-        acceptor.set_option(ip::tcp::acceptor::reuse_address(true));
-        acceptor.bind(endpoint);
-        acceptor.listen();
-
-        _audio_manager->start_loopback_recording(shared_from_this(), capture_config);
-        asio::co_spawn(*_ioc, accept_tcp_loop(std::move(acceptor)), asio::detached);
+        if (_server_config.accept_threads) {
+            start_acceptor_threads(endpoint);
+        }
+        tcp_acceptor acceptor(*_ioc);
+        if (_acceptor_threads.empty()) {
+            acceptor.open(endpoint.protocol());
+            acceptor.set_option(ip::tcp::acceptor::reuse_address(true));
+            acceptor.bind(endpoint);
+            acceptor.listen();
+        }
+        if (acceptor.is_open()) {
+            asio::co_spawn(*_ioc, accept_tcp_loop(std::move(acceptor)), asio::detached);
+        }
 
         // start tcp success
         spdlog::info("tcp listen success on {}", endpoint);
     }
 
-    {
+    if (_server_config.upstream_port) {
+        // a relay sends the datagrams of its upstream server instead of capturing
+        _datagram_handler = [this](const char* data, size_t size) {
+            relay_datagram(data, size);
+        };
+        asio::co_spawn(*_ioc, relay_connect(shared_from_this()), asio::detached);
+    } else {
+        // owned by this, stopped in stop_server after the capture. Peers
+        // receive the main stream, the encoder variants aren't sent yet.
+        _pipeline = std::make_unique<audio_pipeline>(server_config.pipeline, [this](audio_pipeline::quantum_t& quantum) {
+            post_segments(std::move(quantum.segments), quantum.size);
+        });
+        _audio_manager->start_loopback_recording(shared_from_this(), capture_config);
+    }
+
+    if (_local_path.empty()) {
         ip::udp::endpoint endpoint { ip::make_address(host), port };
         _udp_server = std::make_unique<udp_socket>(*_ioc, endpoint.protocol());
+        if (_server_config.sender_threads && pipeline_clock::is_manual()) {
+            // the test drives the network thread, the sender threads would run on their own
+            _server_config.sender_threads = 0;
+        }
+        if ((_server_config.connected_peers || _server_config.sender_threads) && !enable_reuse_port(*_udp_server)) {
+            spdlog::warn("SO_REUSEPORT isn't available, sending to every peer from the server socket");
+            _server_config.connected_peers = false;
+            _server_config.sender_threads = 0;
+        }
         _udp_server->bind(endpoint);
-        asio::co_spawn(*_ioc, accept_udp_loop(), asio::detached);
+        _udp_server->non_blocking(true);
+        if (_server_config.sender_threads) {
+            start_sender_shards(_udp_server->local_endpoint());
+        }
+        if (!_sender_shards.empty()) {
+            _server_config.connected_peers = false;
+        }
+        if (_sender_shards.empty() && server_config.send_backend == send_backend_t::uring) {
+            start_uring_sender();
+        }
+        if (_sender_shards.empty() && server_config.zerocopy_min_payload) {
+            start_zerocopy_sender();
+        }
+        asio::co_spawn(*_ioc, accept_udp_loop(*_udp_server), asio::detached);
 
         // start udp success
         spdlog::info("udp listen success on {}", endpoint);
     }
 
-    _net_thread = std::thread([self = shared_from_this()] {
-        self->_ioc->run();
-    });
+    if (server_config.metrics_port) {
+        ip::tcp::endpoint endpoint { ip::make_address(server_config.metrics_host), server_config.metrics_port };
+
+        ip::tcp::acceptor acceptor(*_ioc, endpoint.protocol());
+        acceptor.set_option(ip::tcp::acceptor::reuse_address(true));
+        acceptor.bind(endpoint);
+        acceptor.listen();
+        asio::co_spawn(*_ioc, accept_metrics_loop(std::move(acceptor)), asio::detached);
+
+        spdlog::info("metrics listen success on http://{}/metrics", endpoint);
+    }
+
+    if (!server_config.shm_path.empty()) {
+        start_shm_ring();
+    }
+
+    // timers can't be late on a manual clock
+    if (server_config.loop_lag_interval.count() && !pipeline_clock::is_manual()) {
+        asio::co_spawn(*_ioc, loop_lag_loop(), asio::detached);
+    }
+
+    if (server_config.impairment.enabled()) {
+        spdlog::warn("network impairment is enabled, audio datagrams will be dropped and delayed on purpose");
+    }
+
+    // with a manual clock the test polls the io_context instead
+    if (!pipeline_clock::is_manual()) {
+        _net_thread = std::thread([self = shared_from_this()] {
+            tracer::set_thread_name("network");
+            thread_util::apply(self->_server_config.net_thread, "network");
+            self->_ioc->run();
+        });
+    }
 
     spdlog::info("server started");
 }
 
 void network_manager::stop_server()
 {
+    // no new sessions for the network thread
+    stop_acceptor_threads();
     if (_ioc) {
         _ioc->stop();
     }
-    _net_thread.join();
+    if (_net_thread.joinable()) {
+        _net_thread.join();
+    }
+    stop_sender_shards();
     _audio_manager->stop();
+    if (_pipeline) {
+        _pipeline->stop();
+        _pipeline = nullptr;
+    }
+    // waits for the sends in flight
+    _uring_sender = nullptr;
+    _zerocopy_sender = nullptr;
+    _shm_sessions.clear();
+    if (_shm_ring) {
+#ifdef linux
+        unlink(_server_config.shm_path.c_str());
+#endif
+        _shm_ring = nullptr;
+    }
+    if (!_local_path.empty()) {
+#ifdef linux
+        unlink(_local_path.c_str());
+#endif
+        _local_path.clear();
+    }
     _playing_peer_list.clear();
     _udp_server = nullptr;
     _ioc = nullptr;
@@ -197,7 +504,9 @@ void network_manager::stop_server()
 
 void network_manager::wait_server()
 {
-    _net_thread.join();
+    if (_net_thread.joinable()) {
+        _net_thread.join();
+    }
 }
 
 bool network_manager::is_running() const
@@ -205,7 +514,26 @@ bool network_manager::is_running() const
     return _ioc != nullptr;
 }
 
-asio::awaitable<void> network_manager::read_loop(std::shared_ptr<tcp_socket> peer)
+size_t network_manager::poll()
+{
+    if (!_ioc) {
+        return 0;
+    }
+    _audio_manager->poll();
+    // handlers may post more handlers, run until the queue is drained
+    size_t total = 0;
+    while (auto n = _ioc->poll()) {
+        total += n;
+    }
+    return total;
+}
+
+std::chrono::nanoseconds network_manager::net_thread_cpu_time()
+{
+    return thread_util::cpu_time(_net_thread);
+}
+
+asio::awaitable<void> network_manager::read_loop(std::shared_ptr<session_socket> peer)
 {
     while (true) {
         cmd_t cmd = cmd_t::cmd_none;
@@ -220,6 +548,12 @@ asio::awaitable<void> network_manager::read_loop(std::shared_ptr<tcp_socket> pee
 
         if (cmd == cmd_t::cmd_get_format) {
             auto format = _audio_manager->get_format_binary();
+            if (format.empty()) {
+                // a relay that hasn't subscribed to its upstream server yet
+                spdlog::info("{} no audio format yet", __func__);
+                close_session(peer);
+                break;
+            }
             auto size = (uint32_t)format.size();
             std::array<asio::const_buffer, 3> buffers = {
                 asio::buffer(&cmd, sizeof(cmd)),
@@ -233,6 +567,8 @@ asio::awaitable<void> network_manager::read_loop(std::shared_ptr<tcp_socket> pee
                 break;
             }
         } else if (cmd == cmd_t::cmd_start_play) {
+            // a client that falls back from the ring already has its heartbeat loop
+            const bool had_shm = _shm_sessions.contains(peer);
             int id = add_playing_peer(peer);
             if (id <= 0) {
                 spdlog::error("{} id error", __func__);
@@ -240,9 +576,38 @@ asio::awaitable<void> network_manager::read_loop(std::shared_ptr<tcp_socket> pee
                 spdlog::trace("{} {}", __func__, ec);
                 break;
             }
-            std::array<asio::const_buffer, 2> buffers = {
+            asio::error_code ec;
+            if (!_local_path.empty()) {
+                // a Unix session gets its audio socket with the reply
+                ec = co_await start_local_audio(peer, id);
+            } else {
+                std::array<asio::const_buffer, 2> buffers = {
+                    asio::buffer(&cmd, sizeof(cmd)),
+                    asio::buffer(&id, sizeof(id)),
+                };
+                std::tie(ec, std::ignore) = co_await asio::async_write(*peer, buffers);
+            }
+            if (ec) {
+                spdlog::trace("{} {}", __func__, ec);
+                close_session(peer);
+                break;
+            }
+            metrics::get().handshakes.inc();
+            if (!had_shm) {
+                asio::co_spawn(*_ioc, heartbeat_loop(peer), asio::detached);
+            }
+        } else if (cmd == cmd_t::cmd_get_shm) {
+            // token | Unix socket path, empty when there is no ring
+            std::string reply;
+            if (auto token = add_shm_session(peer)) {
+                reply.append((const char*)&token, sizeof(token));
+                reply += _server_config.shm_path;
+            }
+            auto size = (uint32_t)reply.size();
+            std::array<asio::const_buffer, 3> buffers = {
                 asio::buffer(&cmd, sizeof(cmd)),
-                asio::buffer(&id, sizeof(id)),
+                asio::buffer(&size, sizeof(size)),
+                asio::buffer(reply),
             };
             auto [ec, _] = co_await asio::async_write(*peer, buffers);
             if (ec) {
@@ -250,11 +615,18 @@ asio::awaitable<void> network_manager::read_loop(std::shared_ptr<tcp_socket> pee
                 close_session(peer);
                 break;
             }
-            asio::co_spawn(*_ioc, heartbeat_loop(peer), asio::detached);
+            if (size) {
+                // a client that died keeps no ring reader
+                asio::co_spawn(*_ioc, heartbeat_loop(peer), asio::detached);
+            }
         } else if (cmd == cmd_t::cmd_heartbeat) {
             auto it = _playing_peer_list.find(peer);
             if (it != _playing_peer_list.end()) {
-                it->second->last_tick = std::chrono::steady_clock::now();
+                it->second->last_tick = pipeline_clock::now();
+            }
+            auto shm = _shm_sessions.find(peer);
+            if (shm != _shm_sessions.end()) {
+                shm->second.last_tick = pipeline_clock::now();
             }
         } else {
             spdlog::error("{} error cmd", __func__);
@@ -265,12 +637,29 @@ asio::awaitable<void> network_manager::read_loop(std::shared_ptr<tcp_socket> pee
     spdlog::trace("stop {}", __func__);
 }
 
-asio::awaitable<void> network_manager::heartbeat_loop(std::shared_ptr<tcp_socket> peer)
+asio::awaitable<void> network_manager::loop_lag_loop()
+{
+    auto& m = metrics::get();
+    pipeline_timer timer(*_ioc);
+    while (true) {
+        timer.expires_after(_server_config.loop_lag_interval);
+        auto [ec] = co_await timer.async_wait();
+        if (ec) {
+            co_return;
+        }
+        // the handlers that ran ahead of the timer delayed it
+        auto lag = pipeline_clock::now() - timer.expiry();
+        m.loop_lag.observe(lag);
+        g_loop_lag_warning.observe(lag, _server_config.loop_lag_warning, m.loop_lag_warnings);
+    }
+}
+
+asio::awaitable<void> network_manager::heartbeat_loop(std::shared_ptr<session_socket> peer)
 {
     std::error_code ec;
     size_t _;
 
-    steady_timer timer(*_ioc);
+    pipeline_timer timer(*_ioc);
     while (true) {
         timer.expires_after(3s);
         std::tie(ec) = co_await timer.async_wait();
@@ -282,14 +671,21 @@ asio::awaitable<void> network_manager::heartbeat_loop(std::shared_ptr<tcp_socket
             break;
         }
 
+        pipeline_clock::time_point last_tick;
         auto it = _playing_peer_list.find(peer);
-        if (it == _playing_peer_list.end()) {
-            spdlog::trace("{} it == _playing_peer_list.end()", __func__);
+        auto shm = _shm_sessions.find(peer);
+        if (it != _playing_peer_list.end()) {
+            last_tick = it->second->last_tick;
+        } else if (shm != _shm_sessions.end()) {
+            last_tick = shm->second.last_tick;
+        } else {
+            spdlog::trace("{} no session", __func__);
             close_session(peer);
             break;
         }
-        if (std::chrono::steady_clock::now() - it->second->last_tick > _heartbeat_timeout) {
-            spdlog::info("{} timeout", it->first->remote_endpoint());
+        if (pipeline_clock::now() - last_tick > _heartbeat_timeout) {
+            spdlog::info("{} timeout", remote_endpoint_of(*peer));
+            metrics::get().heartbeat_timeouts.inc();
             close_session(peer);
             break;
         }
@@ -307,76 +703,236 @@ asio::awaitable<void> network_manager::heartbeat_loop(std::shared_ptr<tcp_socket
 
 asio::awaitable<void> network_manager::accept_tcp_loop(tcp_acceptor acceptor)
 {
+    // the session runs on the network thread, an acceptor thread accepts on
+    // its own io_context and moves the socket over
+    const bool handoff = acceptor.get_executor() != asio::any_io_executor(_ioc->get_executor());
+    const asio::generic::stream_protocol protocol(acceptor.local_endpoint().protocol());
     while (true) {
-        auto peer = std::make_shared<tcp_socket>(acceptor.get_executor());
-        auto [ec] = co_await acceptor.async_accept(*peer);
+        auto [ec, socket] = co_await acceptor.async_accept();
         if (ec) {
             spdlog::error("{} {}", __func__, ec);
             co_return;
         }
 
-        spdlog::info("accept {}", peer->remote_endpoint());
+        spdlog::info("accept {}", remote_endpoint_of(socket));
+        metrics::get().tcp_accepted.inc();
 
         // No-Delay
-        peer->set_option(ip::tcp::no_delay(true), ec);
+        socket.set_option(ip::tcp::no_delay(true), ec);
         if (ec) {
             spdlog::info("{} {}", __func__, ec);
         }
 
-        asio::co_spawn(acceptor.get_executor(), read_loop(peer), asio::detached);
+        if (!handoff) {
+            asio::co_spawn(*_ioc, read_loop(std::make_shared<session_socket>(std::move(socket))), asio::detached);
+            continue;
+        }
+#ifdef linux
+        released_socket released(socket.release(ec));
+        if (ec) {
+            spdlog::error("{} release {}", __func__, ec);
+            continue;
+        }
+        asio::post(*_ioc, [self = shared_from_this(), protocol, released = std::move(released)]() mutable {
+            auto peer = std::make_shared<session_socket>(*self->_ioc);
+            asio::error_code ec;
+            peer->assign(protocol, released.fd, ec);
+            if (ec) {
+                spdlog::error("accept_tcp_loop assign {}", ec);
+                return;
+            }
+            released.fd = -1;
+            asio::co_spawn(*self->_ioc, self->read_loop(peer), asio::detached);
+        });
+#endif
     }
 }
 
-asio::awaitable<void> network_manager::accept_udp_loop()
+asio::awaitable<void> network_manager::accept_udp_loop(udp_socket& socket)
 {
     while (true) {
         int id = 0;
         ip::udp::endpoint udp_peer;
-        auto [ec, _] = co_await _udp_server->async_receive_from(asio::buffer(&id, sizeof(id)), udp_peer);
+        auto [ec, _] = co_await socket.async_receive_from(asio::buffer(&id, sizeof(id)), udp_peer);
         if (ec) {
             spdlog::info("{} {}", __func__, ec);
             co_return;
         }
 
-        fill_udp_peer(id, udp_peer);
+        // the sender shard sockets share the port, the kernel spreads the peers over all of them
+        asio::dispatch(*_ioc, [self = shared_from_this(), id, udp_peer] {
+            self->fill_udp_peer(id, udp_peer);
+        });
+    }
+}
+
+asio::awaitable<void> network_manager::accept_metrics_loop(tcp_acceptor acceptor)
+{
+    while (true) {
+        auto peer = std::make_shared<tcp_socket>(acceptor.get_executor());
+        auto [ec] = co_await acceptor.async_accept(*peer);
+        if (ec) {
+            spdlog::error("{} {}", __func__, ec);
+            co_return;
+        }
+
+        asio::co_spawn(acceptor.get_executor(), metrics_session(peer), asio::detached);
+    }
+}
+
+asio::awaitable<void> network_manager::metrics_session(std::shared_ptr<tcp_socket> peer)
+{
+    // a client that sends nothing or doesn't read the response is closed
+    pipeline_timer timer(peer->get_executor(), _metrics_timeout);
+    timer.async_wait([peer](const asio::error_code& ec) {
+        if (!ec) {
+            asio::error_code ignored;
+            peer->close(ignored);
+        }
+    });
+
+    std::string request;
+    auto [ec, _] = co_await asio::async_read_until(*peer, asio::dynamic_buffer(request, 4096), "\r\n\r\n");
+    if (ec) {
+        spdlog::trace("{} {}", __func__, ec);
+        timer.cancel();
+        co_return;
+    }
+
+    std::string status = "200 OK";
+    std::string body;
+    if (request.starts_with("GET /metrics ") || request.starts_with("GET /metrics?")) {
+        body = render_metrics();
+    } else {
+        status = "404 Not Found";
+    }
+
+    auto response = fmt::format("HTTP/1.1 {}\r\n"
+                                "Content-Type: text/plain; version=0.0.4\r\n"
+                                "Content-Length: {}\r\n"
+                                "Connection: close\r\n"
+                                "\r\n"
+                                "{}",
+        status, body.size(), body);
+    std::tie(ec, _) = co_await asio::async_write(*peer, asio::buffer(response));
+    if (ec) {
+        spdlog::trace("{} {}", __func__, ec);
+    }
+    timer.cancel();
+    peer->shutdown(ip::tcp::socket::shutdown_both, ec);
+    peer->close(ec);
+}
+
+std::string network_manager::render_metrics()
+{
+    metrics::text_writer writer;
+    metrics::write_registry(writer, metrics::get());
+
+    auto labels = [](const peer_info_t& info) {
+        return fmt::format("id=\"{}\",udp=\"{}\"", info.id, info.udp_peer);
+    };
+    writer.header("audio_share_peer_bytes_sent_total", "counter", "UDP payload bytes sent per peer");
+    for (auto&& [peer, info] : _playing_peer_list) {
+        writer.sample("audio_share_peer_bytes_sent_total", info->stats->bytes_sent.value(), labels(*info));
+    }
+    writer.header("audio_share_peer_packets_sent_total", "counter", "UDP datagrams sent per peer");
+    for (auto&& [peer, info] : _playing_peer_list) {
+        writer.sample("audio_share_peer_packets_sent_total", info->stats->packets_sent.value(), labels(*info));
     }
+    writer.header("audio_share_peer_send_errors_total", "counter", "UDP sends completed with an error per peer");
+    for (auto&& [peer, info] : _playing_peer_list) {
+        writer.sample("audio_share_peer_send_errors_total", info->stats->send_errors.value(), labels(*info));
+    }
+    return writer.str();
 }
 
-auto network_manager::close_session(std::shared_ptr<tcp_socket>& peer) -> playing_peer_list_t::iterator
+auto network_manager::close_session(std::shared_ptr<session_socket>& peer) -> playing_peer_list_t::iterator
 {
-    spdlog::info("close {}", peer->remote_endpoint());
-    auto it = remove_playing_peer(peer);
-    peer->shutdown(ip::tcp::socket::shutdown_both);
-    peer->close();
+    spdlog::info("close {}", remote_endpoint_of(*peer));
+    auto it = _playing_peer_list.end();
+    auto shm = _shm_sessions.find(peer);
+    if (shm != _shm_sessions.end()) {
+        _shm_ring->remove_reader(shm->second.event_fd);
+        _shm_sessions.erase(shm);
+        metrics::get().shm_readers.set((int64_t)_shm_sessions.size());
+    } else {
+        it = remove_playing_peer(peer);
+    }
+    // a session can be closed twice, e.g. by a format change and then its read loop
+    asio::error_code ec;
+    peer->shutdown(session_socket::shutdown_both, ec);
+    peer->close(ec);
     return it;
 }
 
-int network_manager::add_playing_peer(std::shared_ptr<tcp_socket>& peer)
+uint64_t network_manager::add_shm_session(std::shared_ptr<session_socket>& peer)
+{
+    if (!_shm_ring || _shm_sessions.contains(peer) || _playing_peer_list.contains(peer)) {
+        return 0;
+    }
+    shm_session_t session;
+    try {
+        session.event_fd = _shm_ring->add_reader();
+    } catch (const std::system_error& e) {
+        spdlog::error("{} {}", __func__, e.what());
+        return 0;
+    }
+    session.last_tick = pipeline_clock::now();
+    std::random_device random;
+    while (!session.token) {
+        session.token = (uint64_t)random() << 32 | random();
+    }
+    _shm_sessions[peer] = session;
+    metrics::get().shm_readers.set((int64_t)_shm_sessions.size());
+    spdlog::info("{} {}", __func__, remote_endpoint_of(*peer));
+    return session.token;
+}
+
+int network_manager::add_playing_peer(std::shared_ptr<session_socket>& peer)
 {
     if (_playing_peer_list.contains(peer)) {
-        spdlog::error("{} repeat add tcp://{}", __func__, peer->remote_endpoint());
+        spdlog::error("{} repeat add {}", __func__, remote_endpoint_of(*peer));
         return 0;
     }
+    auto shm = _shm_sessions.find(peer);
+    if (shm != _shm_sessions.end()) {
+        // the client couldn't map the ring and falls back to datagrams
+        _shm_ring->remove_reader(shm->second.event_fd);
+        _shm_sessions.erase(shm);
+        metrics::get().shm_readers.set((int64_t)_shm_sessions.size());
+    }
 
     auto info = _playing_peer_list[peer] = std::make_shared<peer_info_t>();
     static int g_id = 0;
     info->id = ++g_id;
-    info->last_tick = std::chrono::steady_clock::now();
+    info->last_tick = pipeline_clock::now();
+    if (_server_config.impairment.enabled()) {
+        info->impairment = std::make_unique<impairment>(_server_config.impairment, info->id);
+    }
+    if (!_sender_shards.empty()) {
+        info->shard = (size_t)info->id % _sender_shards.size();
+    }
+    metrics::get().sessions.set((int64_t)_playing_peer_list.size());
 
-    spdlog::trace("{} add id:{} tcp://{}", __func__, info->id, peer->remote_endpoint());
+    spdlog::trace("{} add id:{} {}", __func__, info->id, remote_endpoint_of(*peer));
     return info->id;
 }
 
-auto network_manager::remove_playing_peer(std::shared_ptr<tcp_socket>& peer) -> playing_peer_list_t::iterator
+auto network_manager::remove_playing_peer(std::shared_ptr<session_socket>& peer) -> playing_peer_list_t::iterator
 {
     auto it = _playing_peer_list.find(peer);
     if (it == _playing_peer_list.end()) {
-        spdlog::error("{} repeat remove tcp://{}", __func__, peer->remote_endpoint());
+        spdlog::error("{} repeat remove {}", __func__, remote_endpoint_of(*peer));
         return it;
     }
 
+    auto shard = it->second->shard;
     it = _playing_peer_list.erase(it);
-    spdlog::trace("{} remove tcp://{}", __func__, peer->remote_endpoint());
+    if (!_sender_shards.empty()) {
+        update_sender_shard(shard);
+    }
+    metrics::get().sessions.set((int64_t)_playing_peer_list.size());
+    spdlog::trace("{} remove {}", __func__, remote_endpoint_of(*peer));
     return it;
 }
 
@@ -392,76 +948,635 @@ void network_manager::fill_udp_peer(int id, asio::ip::udp::endpoint udp_peer)
     }
 
     it->second->udp_peer = udp_peer;
-    spdlog::info("{} fill udp peer id:{} tcp://{} udp://{}", __func__, id, it->first->remote_endpoint(), udp_peer);
+    spdlog::info("{} fill udp peer id:{} tcp://{} udp://{}", __func__, id, remote_endpoint_of(*it->first), udp_peer);
+    if (_server_config.connected_peers) {
+        connect_udp_peer(*it->second);
+    }
+    if (!_sender_shards.empty()) {
+        update_sender_shard(it->second->shard);
+    }
+}
+
+void network_manager::connect_udp_peer(peer_info_t& info)
+{
+    // The kernel delivers the datagrams of the peer to the connected socket,
+    // which nobody reads, but the other peers still register on _udp_server
+    // because a connected socket only matches its own peer.
+    asio::error_code ec;
+    auto socket = std::make_unique<udp_socket>(*_ioc);
+    socket->open(_udp_server->local_endpoint().protocol(), ec);
+    if (!ec && !enable_reuse_port(*socket)) {
+        ec.assign(errno, asio::system_category());
+    }
+    if (!ec) {
+        socket->bind(_udp_server->local_endpoint(), ec);
+    }
+    if (!ec) {
+        socket->connect(info.udp_peer, ec);
+    }
+    if (!ec) {
+        socket->non_blocking(true, ec);
+    }
+    if (ec) {
+        spdlog::warn("{} id:{} udp://{} {}, sending from the server socket", __func__, info.id, info.udp_peer, ec);
+        info.connected_socket = nullptr;
+        return;
+    }
+    info.connected_socket = std::move(socket);
 }
 
-void network_manager::broadcast_audio_data(const char* data, size_t count, int block_align)
+void network_manager::broadcast_audio_data(const char* data, size_t count, int block_align, std::shared_ptr<void> owner)
 {
     if (count <= 0) {
         return;
     }
     // spdlog::trace("broadcast_audio_data count: {}", count);
 
-    // divide udp frame
-    constexpr int mtu = 1492;
-    int max_seg_size = mtu - 20 - 8;
-    max_seg_size -= max_seg_size % block_align; // one single sample can't be divided
-
-    std::list<std::shared_ptr<std::vector<uint8_t>>> seg_list;
-
-    for (int begin_pos = 0; begin_pos < count;) {
-        const int real_seg_size = std::min((int)count - begin_pos, max_seg_size);
-        auto seg = std::make_shared<std::vector<uint8_t>>(real_seg_size);
-        std::copy((const uint8_t*)data + begin_pos, (const uint8_t*)data + begin_pos + real_seg_size, seg->begin());
-        seg_list.push_back(seg);
-        begin_pos += real_seg_size;
-    }
+    auto& m = metrics::get();
+    m.capture_quanta.inc();
+    m.capture_bytes.inc(count);
+    _pipeline->push(data, count, block_align, std::move(owner));
+}
 
-    _ioc->post([seg_list = std::move(seg_list), self = shared_from_this()] {
-        for (const auto& seg : seg_list) {
-            for (auto& [peer, info] : self->_playing_peer_list) {
-                self->_udp_server->async_send_to(asio::buffer(*seg), info->udp_peer, [seg](const asio::error_code& ec, std::size_t bytes_transferred) { });
-            }
-        }
-    });
+bool network_manager::sends_capture_in_place() const
+{
+    return _pipeline && _pipeline->sends_in_place();
 }
 
+void network_manager::relay_datagram(const char* data, size_t size)
+{
+    auto& m = metrics::get();
+    m.relay_datagrams.inc();
+    m.relay_bytes.inc(size);
+
+    // every upstream datagram is one segment, forwarded as it is
+    packetizer::segment_list_t seg_list;
+    seg_list.push_back(packetizer::make_segment(data, size));
+    post_segments(std::move(seg_list), size);
+}
 
-void network_manager::start_client(const std::string& host, uint16_t port)
+void network_manager::update_format(const audio_manager::AudioFormat& format)
 {
-    if (_ioc == nullptr) {
-        _ioc = std::make_shared<asio::io_context>();
+    const auto old_format = _audio_manager->get_format_binary();
+    if (old_format == format.SerializeAsString()) {
+        return;
+    }
+    _audio_manager->set_format(format);
+    if (old_format.empty()) {
+        return;
     }
 
-    auto task = [] (std::shared_ptr<network_manager> self, const std::string host, uint16_t port) -> void {
-        assert(self != nullptr && "self is a null pointer");
-        assert(self->_ioc != nullptr && "network_manager::_ioc is a null pointer");
-
-        try {
-            spdlog::info("connect to server {}:{}", host, port);
-            asio::co_spawn(*self->_ioc, self->client_connect(self, host, port), asio::detached);
-            auto work = asio::make_work_guard(*self->_ioc);
-            self->_ioc->run();
-        } catch (std::exception& e) {
-            spdlog::error("exception in io_context thread: {}", e.what());
-        }
-    };
-
-    try {
-        if (!_net_thread.joinable()) {
-            spdlog::info("start thread");
-            _net_thread = std::thread(task, shared_from_this(), host, port);
-        }
-    } catch (std::exception& e) {
-        spdlog::error("failed to start the network thread: {}", e.what());
+    // the protocol can't announce a new format, so every session that got the
+    // old one is closed, on every transport, and its client fetches the new one
+    std::vector<std::shared_ptr<session_socket>> sessions;
+    for (const auto& [peer, info] : _playing_peer_list) {
+        sessions.push_back(peer);
+    }
+    for (const auto& [peer, shm] : _shm_sessions) {
+        sessions.push_back(peer);
+    }
+    spdlog::info("relay: the upstream format changed, closing {} sessions", sessions.size());
+    for (auto& peer : sessions) {
+        close_session(peer);
     }
+}
 
-    spdlog::info("start client");
+void network_manager::relay_lost()
+{
+    spdlog::warn("relay: lost the upstream server, reconnecting");
+    metrics::get().relay_reconnects.inc();
+    if (_upstream_close) {
+        auto close = std::move(_upstream_close);
+        _upstream_close = nullptr;
+        close();
+    }
+    asio::co_spawn(*_ioc, relay_connect(shared_from_this()), asio::detached);
 }
 
-asio::awaitable<void> network_manager::client_heartbeat_loop(std::shared_ptr<tcp_socket> socket)
+void network_manager::post_segments(packetizer::segment_list_t seg_list, size_t count)
 {
-    asio::steady_timer timer(*_ioc);
+    metrics::get().post_queue_bytes.add((int64_t)count);
+
+    const uint64_t trace_id = tracer::enabled() ? tracer::next_id() : 0;
+    // the handler memory goes back to the posting thread through handler_memory
+    auto segments = std::allocate_shared<packetizer::segment_list_t>(handler_allocator<packetizer::segment_list_t>(), std::move(seg_list));
+    asio::post(*_ioc, recycled([segments = std::move(segments), count, post_time = pipeline_clock::now(), trace_id, self = shared_from_this()] {
+        const auto& seg_list = *segments;
+        auto& m = metrics::get();
+        m.post_queue_bytes.sub((int64_t)count);
+        auto now = pipeline_clock::now();
+        m.post_latency.observe(now - post_time);
+        g_post_latency_warning.observe(now - post_time, self->_server_config.post_latency_warning, m.post_latency_warnings);
+        if (trace_id) {
+            tracer::async("server", "post", trace_id, post_time, now);
+        }
+        if (self->_shm_ring && self->_shm_ring->readers()) {
+            // once for all the clients on the same host
+            for (const auto& seg : seg_list) {
+                self->_shm_ring->write(seg->data(), seg->size());
+            }
+            self->_shm_ring->notify();
+            m.shm_datagrams.inc(seg_list.size());
+        }
+        if (self->_playing_peer_list.empty()) {
+            return;
+        }
+
+        tracer::scope trace("server", "send");
+        std::shared_ptr<void> probe = std::allocate_shared<quantum_latency_probe>(handler_allocator<quantum_latency_probe>(), post_time, now, self->_server_config.send_latency_warning, trace_id);
+        auto send = [self, probe](const packetizer::segment_t& seg, const std::shared_ptr<peer_info_t>& info) {
+#ifdef linux
+            if (info->local_socket) {
+                send_datagram(*info->local_socket, nullptr, seg, info, probe);
+                return;
+            }
+#endif
+            if (info->connected_socket) {
+                send_datagram(*info->connected_socket, nullptr, seg, info, probe);
+            } else {
+                send_datagram(*self->_udp_server, &info->udp_peer, seg, info, probe);
+            }
+        };
+
+        // the sender threads send to the peers without impairment and hand
+        // the references of the quantum back, it's released on this thread
+        const bool sharded = !self->_sender_shards.empty();
+        for (auto& shard : self->_sender_shards) {
+            asio::post(shard->ioc, recycled([shard = shard.get(), home = self->_ioc.get(), segments, probe]() mutable {
+                for (const auto& seg : *segments) {
+                    for (const auto& peer : shard->peers) {
+                        send_datagram(*shard->socket, &peer->endpoint, seg, peer, probe, home);
+                    }
+                }
+                asio::post(*home, recycled([segments = std::move(segments), probe = std::move(probe)] {}));
+            }));
+        }
+
+        // a large quantum goes to the peers without copies, what the kernel doesn't take is sent below
+        const bool zerocopy = self->_zerocopy_sender && count >= self->_server_config.zerocopy_min_payload;
+        if (zerocopy) {
+            // the kernel reads the segments until their notification arrives
+            for (auto& [peer, info] : self->_playing_peer_list) {
+                if (info->impairment) {
+                    continue;
+                }
+                size_t bytes_sent = 0;
+                auto sent = self->_zerocopy_sender->send(*segments, info->udp_peer.data(), (uint32_t)info->udp_peer.size(), segments, bytes_sent);
+                if (sent) {
+                    // the sender keeps the bytes in send_queue_bytes until their notification
+                    count_send(*info->stats, 0, true, bytes_sent, sent);
+                }
+                for (auto seg = std::next(segments->begin(), sent); seg != segments->end(); ++seg) {
+                    m.zerocopy_fallbacks.inc();
+                    send(*seg, info);
+                }
+            }
+        }
+
+        auto& uring = self->_uring_sender;
+        for (const auto& seg : seg_list) {
+            // pinned, the io_uring sends to every peer read the segment itself
+            int buffer = uring && !zerocopy ? uring->acquire(seg->data(), seg->size(), seg, probe) : -1;
+            auto send_now = [&](const std::shared_ptr<peer_info_t>& info) {
+                if (buffer >= 0) {
+                    m.send_queue_bytes.add((int64_t)seg->size());
+                    if (uring->send_to(buffer, info->udp_peer.data(), (uint32_t)info->udp_peer.size(), info)) {
+                        return;
+                    }
+                    m.send_queue_bytes.sub((int64_t)seg->size());
+                }
+                if (uring && !zerocopy) {
+                    m.uring_fallbacks.inc();
+                }
+                send(seg, info);
+            };
+
+            for (auto& [peer, info] : self->_playing_peer_list) {
+                if (!info->impairment) {
+                    if (!zerocopy && !sharded) {
+                        send_now(info);
+                    }
+                    continue;
+                }
+
+                auto verdict = info->impairment->process(now, seg->size());
+                if (verdict.copies == 0) {
+                    m.impaired_dropped.inc();
+                    continue;
+                }
+                if (verdict.copies > 1) {
+                    m.impaired_duplicated.inc();
+                }
+                if (verdict.reordered) {
+                    m.impaired_reordered.inc();
+                }
+                for (size_t i = 0; i < verdict.copies; ++i) {
+                    if (verdict.delay[i].count() == 0) {
+                        send_now(info);
+                        continue;
+                    }
+                    auto timer = std::allocate_shared<pipeline_timer>(handler_allocator<pipeline_timer>(), *self->_ioc, verdict.delay[i]);
+                    timer->async_wait(recycled([timer, send, seg, info = info](const asio::error_code& ec) {
+                        if (!ec) {
+                            send(seg, info);
+                        }
+                    }));
+                }
+            }
+            if (buffer >= 0) {
+                uring->release(buffer);
+            }
+        }
+        // one system call for the quantum
+        if (uring) {
+            uring->submit();
+        }
+    }));
+}
+
+void network_manager::start_uring_sender()
+{
+    if (!uring_sender::supported()) {
+        spdlog::warn("io_uring isn't available, sending with asio");
+        return;
+    }
+    try {
+        // the completions run on the reaper thread, the peers are kept alive by
+        // the sends and released on the network thread
+        _uring_sender = std::make_unique<uring_sender>((int)_udp_server->native_handle(), _server_config.uring, [](void* context, size_t size, int result) {
+            count_send(*((peer_info_t*)context)->stats, size, result >= 0, result >= 0 ? (size_t)result : 0);
+        }, [this] {
+            asio::post(*_ioc, recycled([this] {
+                if (_uring_sender) {
+                    _uring_sender->reclaim();
+                }
+            }));
+        });
+        spdlog::info("sending audio with io_uring");
+    } catch (const std::system_error& e) {
+        spdlog::warn("{}, sending with asio", e.what());
+    }
+}
+
+void network_manager::start_sender_shards(const ip::udp::endpoint& endpoint)
+{
+    try {
+        for (size_t i = 0; i < _server_config.sender_threads; ++i) {
+            auto shard = std::make_unique<sender_shard_t>();
+            shard->socket = std::make_unique<udp_socket>(shard->ioc, endpoint.protocol());
+            if (!enable_reuse_port(*shard->socket)) {
+                throw std::system_error(errno, std::system_category(), "SO_REUSEPORT");
+            }
+            shard->socket->bind(endpoint);
+            shard->socket->non_blocking(true);
+            asio::co_spawn(shard->ioc, accept_udp_loop(*shard->socket), asio::detached);
+            shard->thread = std::thread([shard = shard.get(), policy = _server_config.sender_thread] {
+                tracer::set_thread_name("sender");
+                thread_util::apply(policy, "sender");
+                auto work = asio::make_work_guard(shard->ioc);
+                shard->ioc.run();
+            });
+            _sender_shards.push_back(std::move(shard));
+        }
+        spdlog::info("sending audio from {} threads", _sender_shards.size());
+    } catch (const std::system_error& e) {
+        spdlog::warn("{}, sending from the network thread", e.what());
+        stop_sender_shards();
+    }
+}
+
+void network_manager::start_acceptor_threads(const ip::tcp::endpoint& endpoint)
+{
+    try {
+        auto bound = endpoint;
+        for (size_t i = 0; i < _server_config.accept_threads; ++i) {
+            auto acceptor_thread = std::make_unique<acceptor_thread_t>();
+            tcp_acceptor acceptor(acceptor_thread->ioc, endpoint.protocol());
+            acceptor.set_option(ip::tcp::acceptor::reuse_address(true));
+            if (!enable_reuse_port(acceptor)) {
+                throw std::system_error(errno, std::system_category(), "SO_REUSEPORT");
+            }
+            acceptor.bind(bound);
+            acceptor.listen();
+            // the others share the port the first one got
+            bound = acceptor.local_endpoint();
+            asio::co_spawn(acceptor_thread->ioc, accept_tcp_loop(std::move(acceptor)), asio::detached);
+            acceptor_thread->thread = std::thread([ioc = &acceptor_thread->ioc] {
+                tracer::set_thread_name("acceptor");
+                ioc->run();
+            });
+            _acceptor_threads.push_back(std::move(acceptor_thread));
+        }
+        spdlog::info("accepting on {} threads", _acceptor_threads.size());
+    } catch (const std::system_error& e) {
+        spdlog::warn("{}, accepting on the network thread", e.what());
+        stop_acceptor_threads();
+    }
+}
+
+void network_manager::stop_acceptor_threads()
+{
+    for (auto& acceptor_thread : _acceptor_threads) {
+        acceptor_thread->ioc.stop();
+        if (acceptor_thread->thread.joinable()) {
+            acceptor_thread->thread.join();
+        }
+    }
+    _acceptor_threads.clear();
+}
+
+void network_manager::start_local_listener(const std::string& path)
+{
+#ifdef linux
+    // a socket left by a previous run
+    unlink(path.c_str());
+    local_acceptor acceptor(*_ioc, asio::local::stream_protocol::endpoint(path));
+    _local_path = path;
+    asio::co_spawn(*_ioc, accept_local_loop(std::move(acceptor)), asio::detached);
+    spdlog::info("unix listen success on {}", path);
+#else
+    throw std::system_error(std::make_error_code(std::errc::function_not_supported), "Unix socket sessions");
+#endif
+}
+
+#ifdef linux
+asio::awaitable<void> network_manager::accept_local_loop(local_acceptor acceptor)
+{
+    while (true) {
+        auto peer = std::make_shared<session_socket>(*_ioc);
+        auto [ec] = co_await acceptor.async_accept(*peer);
+        if (ec) {
+            spdlog::error("{} {}", __func__, ec);
+            co_return;
+        }
+
+        spdlog::info("accept unix session");
+        asio::co_spawn(*_ioc, read_loop(peer), asio::detached);
+    }
+}
+#endif // linux
+
+// The audio of a Unix session goes over a datagram socket pair instead of UDP,
+// the client gets its end with the reply to cmd_start_play. A connected pair
+// isn't limited by net.unix.max_dgram_qlen, only by the socket buffer.
+asio::awaitable<asio::error_code> network_manager::start_local_audio(std::shared_ptr<session_socket> peer, int id)
+{
+#ifdef linux
+    auto it = _playing_peer_list.find(peer);
+    if (it == _playing_peer_list.end()) {
+        co_return asio::error::operation_aborted;
+    }
+    auto socket = std::make_unique<local_datagram_socket>(*_ioc);
+    asio::local::datagram_protocol::socket remote(*_ioc);
+    asio::error_code ec;
+    asio::local::connect_pair(*socket, remote, ec);
+    if (!ec) {
+        socket->non_blocking(true, ec);
+    }
+    if (ec) {
+        co_return ec;
+    }
+    // before any wait, the quanta sent meanwhile queue up for the client
+    it->second->local_socket = std::move(socket);
+
+    std::tie(ec) = co_await peer->async_wait(session_socket::wait_write);
+    if (ec) {
+        co_return ec;
+    }
+    const std::array<uint32_t, 2> reply = { (uint32_t)cmd_t::cmd_start_play, (uint32_t)id };
+    const int fd = remote.native_handle();
+    if (!send_fds(peer->native_handle(), reply.data(), sizeof(reply), &fd, 1)) {
+        co_return asio::error_code(errno, asio::error::get_system_category());
+    }
+    co_return ec;
+#else
+    co_return asio::error::operation_not_supported;
+#endif
+}
+
+void network_manager::start_shm_ring()
+{
+#ifdef linux
+    const auto& path = _server_config.shm_path;
+    try {
+        _shm_ring = std::make_unique<shm_ring::writer>(_server_config.shm);
+        // a socket left by a previous run
+        unlink(path.c_str());
+        local_acceptor acceptor(*_ioc);
+        acceptor.open();
+        acceptor.bind(asio::local::stream_protocol::endpoint(path));
+        // the ring carries the audio, only the own user may take it
+        if (chmod(path.c_str(), 0600) != 0) {
+            throw std::system_error(errno, std::generic_category(), "chmod " + path);
+        }
+        acceptor.listen();
+        asio::co_spawn(*_ioc, accept_shm_loop(std::move(acceptor)), asio::detached);
+        spdlog::info("shared memory ring for the local clients on {}", path);
+    } catch (const std::system_error& e) {
+        spdlog::warn("{}, the local clients receive datagrams", e.what());
+        _shm_ring = nullptr;
+    }
+#else
+    spdlog::warn("the shared memory ring is Linux only, the local clients receive datagrams");
+#endif
+}
+
+#ifdef linux
+asio::awaitable<void> network_manager::accept_shm_loop(local_acceptor acceptor)
+{
+    while (true) {
+        auto peer = std::make_shared<local_socket>(acceptor.get_executor());
+        auto [ec] = co_await acceptor.async_accept(*peer);
+        if (ec) {
+            spdlog::error("{} {}", __func__, ec.message());
+            co_return;
+        }
+        asio::co_spawn(*_ioc, shm_handoff(peer), asio::detached);
+    }
+}
+
+// Hands the fds of the ring to the client that shows the token of its TCP session.
+asio::awaitable<void> network_manager::shm_handoff(std::shared_ptr<local_socket> peer)
+{
+    uint64_t token = 0;
+    auto [ec, _] = co_await asio::async_read(*peer, asio::buffer(&token, sizeof(token)));
+    if (ec || !_shm_ring) {
+        co_return;
+    }
+    auto it = std::find_if(_shm_sessions.begin(), _shm_sessions.end(), [token](const shm_session_list_t::value_type& e) {
+        return token && e.second.token == token;
+    });
+    if (it == _shm_sessions.end()) {
+        spdlog::warn("{} unknown token", __func__);
+        co_return;
+    }
+    it->second.token = 0;
+    const int fds[] = { _shm_ring->fd(), it->second.event_fd };
+    const char byte = 0;
+    if (!send_fds(peer->native_handle(), &byte, 1, fds, 2)) {
+        spdlog::error("{} {}", __func__, std::strerror(errno));
+    }
+}
+#endif // linux
+
+void network_manager::stop_sender_shards()
+{
+    for (auto& shard : _sender_shards) {
+        shard->ioc.stop();
+        if (shard->thread.joinable()) {
+            shard->thread.join();
+        }
+    }
+    _sender_shards.clear();
+}
+
+void network_manager::update_sender_shard(size_t index)
+{
+    // the shard gets its peers in order with the quanta
+    std::vector<shard_peer_t> peers;
+    for (const auto& [peer, info] : _playing_peer_list) {
+        if (info->shard == index && !info->impairment && info->udp_peer.port()) {
+            peers.push_back({ info->id, info->udp_peer, info->stats });
+        }
+    }
+    auto shard = _sender_shards[index].get();
+    asio::post(shard->ioc, [shard, peers = std::move(peers)]() mutable {
+        // a peer that stays keeps its state, its sends in flight still count
+        std::vector<std::shared_ptr<shard_peer_t>> next;
+        next.reserve(peers.size());
+        for (auto& peer : peers) {
+            auto it = std::find_if(shard->peers.begin(), shard->peers.end(), [id = peer.id](const std::shared_ptr<shard_peer_t>& p) {
+                return p && p->id == id;
+            });
+            if (it != shard->peers.end()) {
+                (*it)->endpoint = peer.endpoint;
+                next.push_back(std::move(*it));
+            } else {
+                next.push_back(std::make_shared<shard_peer_t>(std::move(peer)));
+            }
+        }
+        shard->peers = std::move(next);
+    });
+}
+
+void network_manager::start_zerocopy_sender()
+{
+    try {
+        _zerocopy_sender = std::make_unique<zerocopy_sender>((int)_udp_server->native_handle(), _server_config.zerocopy);
+        asio::co_spawn(*_ioc, zerocopy_reap_loop(), asio::detached);
+        spdlog::info("quanta from {} bytes up are sent with zero copy", _server_config.zerocopy_min_payload);
+    } catch (const std::system_error& e) {
+        spdlog::warn("{}, sending every quantum with copies", e.what());
+    }
+}
+
+asio::awaitable<void> network_manager::zerocopy_reap_loop()
+{
+    // the completion notifications arrive on the error queue of the socket
+    while (true) {
+        auto [ec] = co_await _udp_server->async_wait(ip::udp::socket::wait_error);
+        if (ec || !_zerocopy_sender) {
+            co_return;
+        }
+        _zerocopy_sender->reap();
+    }
+}
+
+template <typename Socket, typename Peer>
+void network_manager::send_datagram(Socket& socket, const typename Socket::endpoint_type* endpoint, const packetizer::segment_t& seg, const std::shared_ptr<Peer>& info, const std::shared_ptr<void>& probe, asio::io_context* home)
+{
+    auto& m = metrics::get();
+    m.send_queue_bytes.add((int64_t)seg->size());
+    // the socket is non-blocking, so try the send right away and only
+    // wait for the socket when its buffer is full
+    if (!info->async_sends) {
+        asio::error_code ec;
+        auto bytes_transferred = endpoint
+            ? socket.send_to(asio::buffer(seg->data(), seg->size()), *endpoint, 0, ec)
+            : socket.send(asio::buffer(seg->data(), seg->size()), 0, ec);
+        if (ec != asio::error::would_block) {
+            m.udp_sync_sends.inc();
+            count_send(*info->stats, seg->size(), !ec, bytes_transferred);
+            return;
+        }
+    }
+    m.udp_async_sends.inc();
+    ++info->async_sends;
+    auto on_sent = [seg, info, probe, home](const asio::error_code& ec, std::size_t bytes_transferred) mutable {
+        --info->async_sends;
+        count_send(*info->stats, seg->size(), !ec, bytes_transferred);
+        if (home) {
+            // the segment and the probe are released on the thread of home
+            asio::post(*home, recycled([seg = std::move(seg), probe = std::move(probe)] {}));
+        }
+    };
+    if (endpoint) {
+        socket.async_send_to(asio::buffer(seg->data(), seg->size()), *endpoint, recycled(std::move(on_sent)));
+    } else {
+        socket.async_send(asio::buffer(seg->data(), seg->size()), recycled(std::move(on_sent)));
+    }
+}
+
+void network_manager::count_send(peer_stats_t& stats, size_t size, bool ok, size_t bytes_transferred, size_t packets)
+{
+    auto& m = metrics::get();
+    m.send_queue_bytes.sub((int64_t)size);
+    if (!ok) {
+        m.udp_send_errors.inc();
+        stats.send_errors.inc();
+        return;
+    }
+    m.udp_bytes_sent.inc(bytes_transferred);
+    m.udp_packets_sent.inc(packets);
+    stats.bytes_sent.inc(bytes_transferred);
+    stats.packets_sent.inc(packets);
+}
+
+
+void network_manager::start_client(const std::string& host, uint16_t port)
+{
+    if (_ioc == nullptr) {
+        _ioc = std::make_shared<asio::io_context>();
+    }
+
+    auto task = [] (std::shared_ptr<network_manager> self, const std::string host, uint16_t port) -> void {
+        assert(self != nullptr && "self is a null pointer");
+        assert(self->_ioc != nullptr && "network_manager::_ioc is a null pointer");
+
+        tracer::set_thread_name("network");
+        thread_util::apply(self->_net_thread_policy, "network");
+        try {
+            spdlog::info("connect to server {}:{}", host, port);
+            asio::co_spawn(*self->_ioc, self->client_connect(self, host, port), asio::detached);
+            auto work = asio::make_work_guard(*self->_ioc);
+            self->_ioc->run();
+        } catch (std::exception& e) {
+            spdlog::error("exception in io_context thread: {}", e.what());
+        }
+    };
+
+    if (pipeline_clock::is_manual()) {
+        // the test polls the io_context
+        asio::co_spawn(*_ioc, client_connect(shared_from_this(), host, port), asio::detached);
+        spdlog::info("start client");
+        return;
+    }
+
+    try {
+        if (!_net_thread.joinable()) {
+            spdlog::info("start thread");
+            _net_thread = std::thread(task, shared_from_this(), host, port);
+        }
+    } catch (std::exception& e) {
+        spdlog::error("failed to start the network thread: {}", e.what());
+    }
+
+    spdlog::info("start client");
+}
+
+asio::awaitable<void> network_manager::client_heartbeat_loop(std::shared_ptr<session_socket> socket)
+{
+    pipeline_timer timer(*_ioc);
 
     while (true) {
         if (!is_running()) {
@@ -471,12 +1586,19 @@ asio::awaitable<void> network_manager::client_heartbeat_loop(std::shared_ptr<tcp
         auto [ec, _] = co_await asio::async_write(*socket, asio::buffer(&cmd, sizeof(cmd)));
         if (ec) {
             spdlog::error("send cmd_heartbeat failed, {}", ec.message());
+            if (_server_config.upstream_port) {
+                // the peers keep their sessions and get the audio again after the reconnect
+                relay_lost();
+            }
             co_return;
         }
 
         spdlog::trace("send cmd_heartbeat successfully, {}", ec.message());
         timer.expires_after(std::chrono::seconds(3));
-        co_await timer.async_wait(asio::use_awaitable);
+        std::tie(ec) = co_await timer.async_wait();
+        if (ec) {
+            co_return;
+        }
     }
 }
 
@@ -499,37 +1621,140 @@ asio::awaitable<void> network_manager::client_udp_loop(audio_manager::AudioForma
     }
     spdlog::info("send size: {}, content: {}", n, std::format("{:08x}", id));
 
+    co_await client_receive_loop(std::move(audio_format), socket, id);
+}
+
+asio::awaitable<void> network_manager::client_local_loop(audio_manager::AudioFormat audio_format, int fd, uint32_t id)
+{
+#ifdef linux
+    spdlog::info("unix datagram socket, id:{}", id);
+    asio::local::datagram_protocol::socket socket(*_ioc, asio::local::datagram_protocol(), fd);
+    co_await client_receive_loop(std::move(audio_format), socket, id);
+#else
+    co_return;
+#endif
+}
+
+template <typename Socket>
+asio::awaitable<void> network_manager::client_receive_loop(audio_manager::AudioFormat audio_format, Socket& socket, uint32_t id)
+{
+    asio::error_code ec {};
+    uint32_t n;
+    std::unique_ptr<packet_trace::writer> recorder;
+    if (!_record_path.empty()) {
+        auto clock = packet_trace::clock_source::steady;
+#ifdef linux
+        int on = 1;
+        if (setsockopt(socket.native_handle(), SOL_SOCKET, SO_TIMESTAMPNS, &on, sizeof(on)) == 0) {
+            clock = packet_trace::clock_source::kernel;
+        }
+#endif
+        recorder = open_recorder(audio_format, clock);
+    }
+    auto last_flush = std::chrono::steady_clock::now();
+
     std::array<char, 4096> recv_buffer {};
-    _audio_manager->audio_init(audio_format);
-    _audio_manager->audio_start();
-    while (true) {
-        if (!is_running()) {
-            co_return;
+    if (!_datagram_handler) {
+        _audio_manager->audio_init(audio_format);
+        _audio_manager->audio_start();
+    }
+    if (_server_config.upstream_port) {
+        // the relay closes the socket when it loses the upstream session
+        _upstream_close = [&socket] {
+            asio::error_code ec;
+            socket.close(ec);
+        };
+    }
+    while (is_running()) {
+#ifdef linux
+        if (recorder && recorder->clock() == packet_trace::clock_source::kernel) {
+            co_await socket.async_wait(Socket::wait_read, asio::redirect_error(asio::use_awaitable, ec));
+            if (ec == asio::error::operation_aborted || !socket.is_open()) {
+                break;
+            }
+            if (ec) {
+                continue;
+            }
+            std::chrono::nanoseconds timestamp;
+            auto r = receive_with_kernel_timestamp(socket.native_handle(), recv_buffer.data(), recv_buffer.size(), timestamp);
+            if (r < 0) {
+                continue;
+            }
+            n = (uint32_t)r;
+            recorder->write(timestamp, recv_buffer.data(), n);
+        } else
+#endif
+        {
+            n = co_await socket.async_receive(asio::buffer(recv_buffer), asio::redirect_error(asio::use_awaitable, ec));
+            if (ec == asio::error::operation_aborted || !socket.is_open()) {
+                break;
+            }
+            if (ec) {
+                continue;
+            }
+            if (recorder) {
+                recorder->write(std::chrono::steady_clock::now().time_since_epoch(), recv_buffer.data(), n);
+            }
         }
-        n = co_await socket.async_receive(asio::buffer(recv_buffer), asio::redirect_error(asio::use_awaitable, ec));
-        if (ec) {
+        tracer::scope trace("client", "receive");
+        if (tracer::enabled()) {
+            // the probes of a synthetic source carry the capture time, the
+            // id keeps the spans of clients in one process apart
+            synthetic_source::probe_t probe;
+            if (synthetic_source::read_probe(recv_buffer.data(), n, probe)) {
+                tracer::async("client", "capture_to_receive", (uint64_t)id << 32 | probe.seq, pipeline_clock::time_point(std::chrono::nanoseconds(probe.timestamp_ns)), pipeline_clock::now());
+            }
+        }
+        if (recorder && std::chrono::steady_clock::now() - last_flush > 1s) {
+            recorder->flush();
+            last_flush = std::chrono::steady_clock::now();
+        }
+        if (_datagram_handler) {
+            _datagram_handler(recv_buffer.data(), n);
             continue;
         }
-        _audio_manager->audio_play(std::vector<char>(recv_buffer.begin(), recv_buffer.begin() + n));
+        _audio_manager->audio_play({ recv_buffer.data(), n });
     }
+    _upstream_close = nullptr;
 }
 
 asio::awaitable<void> network_manager::client_connect(std::shared_ptr<network_manager> self, const std::string host, uint16_t port)
 {
     audio_manager::AudioFormat audio_format;
     uint32_t udp_id = 0;
-    auto socket = std::make_shared<tcp_socket>(*self->_ioc);
-    ip::tcp::resolver resolver(*self->_ioc);
-    ip::tcp::resolver::results_type endpoints = resolver.resolve(host, std::to_string(port));
+    int audio_fd = -1; // the client's end of the audio socket pair of a Unix session
+    auto socket = std::make_shared<session_socket>(*self->_ioc);
+    const bool local = host.starts_with(local_scheme);
 
     try {
         // resolve
-        {
-            auto [ec, _] = co_await asio::async_connect(*socket, endpoints);
+        if (local) {
+#ifdef linux
+            auto [ec] = co_await socket->async_connect(asio::local::stream_protocol::endpoint(host.substr(local_scheme.size())));
+#else
+            asio::error_code ec = asio::error::operation_not_supported;
+#endif
             if (ec) {
                 spdlog::error("error connecting to server: {}", ec.message());
                 co_return;
             }
+        } else {
+            ip::tcp::resolver resolver(*self->_ioc);
+            asio::error_code ec = asio::error::host_not_found;
+            for (const auto& entry : resolver.resolve(host, std::to_string(port))) {
+                asio::error_code ignored;
+                socket->close(ignored);
+                std::tie(ec) = co_await socket->async_connect(entry.endpoint());
+                if (!ec) {
+                    break;
+                }
+            }
+            if (ec) {
+                spdlog::error("error connecting to server: {}", ec.message());
+                co_return;
+            }
+            // heartbeats are tiny, don't let Nagle hold them back waiting for a delayed ack
+            socket->set_option(ip::tcp::no_delay(true), ec);
         }
 
         // get audio format
@@ -573,6 +1798,14 @@ asio::awaitable<void> network_manager::client_connect(std::shared_ptr<network_ma
                          (uint32_t)audio_format.sample_rate(), (uint32_t)audio_format.channels(), (uint32_t)audio_format.encoding());
         }
 
+        // read the shared memory ring of a server on the same host
+        if (self->_use_shm) {
+            if (co_await self->client_shm_connect(socket, audio_format)) {
+                co_return;
+            }
+            spdlog::info("no shared memory ring, receiving datagrams");
+        }
+
         // start play
         {
             cmd_t cmd = cmd_t::cmd_start_play;
@@ -584,7 +1817,17 @@ asio::awaitable<void> network_manager::client_connect(std::shared_ptr<network_ma
 
             cmd = cmd_t::cmd_none;
             std::array<uint32_t, 2> buffer = { static_cast<uint32_t>(cmd), udp_id};
-            std::tie(ec, _) = co_await asio::async_read(*socket, asio::buffer(buffer.data(), sizeof(buffer)));
+            if (local) {
+#ifdef linux
+                // the fd of the audio socket comes with the reply
+                std::tie(ec) = co_await socket->async_wait(session_socket::wait_read);
+                if (!ec && receive_fds(socket->native_handle(), buffer.data(), sizeof(buffer), &audio_fd, 1) != 1) {
+                    ec = asio::error::message_size;
+                }
+#endif
+            } else {
+                std::tie(ec, _) = co_await asio::async_read(*socket, asio::buffer(buffer.data(), sizeof(buffer)));
+            }
             if (ec) {
                 spdlog::error("error read cmd_start_play. {}", ec.message());
                 co_return;
@@ -592,6 +1835,11 @@ asio::awaitable<void> network_manager::client_connect(std::shared_ptr<network_ma
             cmd = static_cast<cmd_t>(buffer[0]);
             if (cmd != cmd_t::cmd_start_play) {
                 spdlog::error("read cmd_start_play error, cmd: {}, udp_id: {}", (size_t)cmd, udp_id);
+#ifdef linux
+                if (audio_fd >= 0) {
+                    close(audio_fd);
+                }
+#endif
                 co_return;
             }
 
@@ -599,16 +1847,228 @@ asio::awaitable<void> network_manager::client_connect(std::shared_ptr<network_ma
             spdlog::info("get udp_id successfully, udp_id: {}", std::format("{:08x}", udp_id));
         }
 
+        if (self->_server_config.upstream_port) {
+            // a relay serves the upstream format to its peers
+            self->update_format(audio_format);
+            self->_upstream_subscribed = true;
+            spdlog::info("relay: subscribed to {}:{}", host, port);
+        }
         asio::co_spawn(*self->_ioc, self->client_heartbeat_loop(socket), asio::detached);
-        asio::co_spawn(*self->_ioc, self->client_udp_loop(audio_format, host, port, udp_id), asio::detached);
+        if (local) {
+            asio::co_spawn(*self->_ioc, self->client_local_loop(audio_format, audio_fd, udp_id), asio::detached);
+        } else {
+            asio::co_spawn(*self->_ioc, self->client_udp_loop(audio_format, host, port, udp_id), asio::detached);
+        }
     } catch (std::exception& e) {
         spdlog::error("error connecting to server: {}", e.what());
     }
 }
 
+// Returns false when the server has no ring for this client, then the session
+// goes on with cmd_start_play.
+asio::awaitable<bool> network_manager::client_shm_connect(std::shared_ptr<session_socket> socket, audio_manager::AudioFormat audio_format)
+{
+#ifdef linux
+    // token | Unix socket path
+    std::string reply;
+    {
+        cmd_t cmd = cmd_t::cmd_get_shm;
+        auto [ec, _] = co_await asio::async_write(*socket, asio::buffer(&cmd, sizeof(cmd)));
+        if (ec) {
+            spdlog::error("send cmd_get_shm error, {}", ec.message());
+            co_return false;
+        }
+
+        std::array<uint32_t, 2> buffer {};
+        std::tie(ec, _) = co_await asio::async_read(*socket, asio::buffer(buffer.data(), sizeof(buffer)));
+        if (ec || static_cast<cmd_t>(buffer[0]) != cmd_t::cmd_get_shm) {
+            spdlog::error("read cmd_get_shm error, cmd: {}, {}", buffer[0], ec.message());
+            co_return false;
+        }
+        reply.resize(buffer[1]);
+        std::tie(ec, _) = co_await asio::async_read(*socket, asio::buffer(reply));
+        if (ec) {
+            spdlog::error("read cmd_get_shm error, {}", ec.message());
+            co_return false;
+        }
+    }
+    uint64_t token = 0;
+    if (reply.size() <= sizeof(token)) {
+        co_return false;
+    }
+    std::memcpy(&token, reply.data(), sizeof(token));
+    const auto path = reply.substr(sizeof(token));
+
+    // the memfd of the ring and the eventfd that wakes this client
+    int fds[2] = { -1, -1 };
+    {
+        asio::local::stream_protocol::socket local(*_ioc);
+        asio::error_code ec;
+        co_await local.async_connect(asio::local::stream_protocol::endpoint(path), asio::redirect_error(asio::use_awaitable, ec));
+        if (!ec) {
+            co_await asio::async_write(local, asio::buffer(&token, sizeof(token)), asio::redirect_error(asio::use_awaitable, ec));
+        }
+        if (!ec) {
+            co_await local.async_wait(asio::local::stream_protocol::socket::wait_read, asio::redirect_error(asio::use_awaitable, ec));
+        }
+        char byte = 0;
+        auto received = ec ? 0 : receive_fds(local.native_handle(), &byte, 1, fds, 2);
+        if (received != 2) {
+            spdlog::error("failed to get the shared memory ring from {}, {}", path, ec ? ec.message() : std::strerror(errno));
+            for (size_t i = 0; i < received; ++i) {
+                close(fds[i]);
+            }
+            co_return false;
+        }
+    }
+
+    std::shared_ptr<shm_ring::reader> ring;
+    try {
+        ring = std::make_shared<shm_ring::reader>(fds[0]);
+    } catch (const std::exception& e) {
+        spdlog::error("{}", e.what());
+        close(fds[1]);
+        co_return false;
+    }
+    spdlog::info("reading the shared memory ring of {}", path);
+    asio::co_spawn(*_ioc, client_heartbeat_loop(socket), asio::detached);
+    asio::co_spawn(*_ioc, client_shm_loop(std::move(audio_format), std::move(ring), fds[1]), asio::detached);
+    co_return true;
+#else
+    co_return false;
+#endif
+}
+
+asio::awaitable<void> network_manager::client_shm_loop(audio_manager::AudioFormat audio_format, std::shared_ptr<shm_ring::reader> ring, int event_fd)
+{
+#ifdef linux
+    asio::posix::stream_descriptor event(*_ioc, event_fd);
+
+    std::unique_ptr<packet_trace::writer> recorder;
+    if (!_record_path.empty()) {
+        recorder = open_recorder(audio_format, packet_trace::clock_source::steady);
+    }
+    auto last_flush = std::chrono::steady_clock::now();
+
+    if (!_datagram_handler) {
+        _audio_manager->audio_init(audio_format);
+        _audio_manager->audio_start();
+    }
+    // a copy of the slot owned by the reader
+    const shm_ring::reader::handler_t deliver = [&](const char* data, size_t size) {
+        if (recorder) {
+            recorder->write(std::chrono::steady_clock::now().time_since_epoch(), data, size);
+        }
+        if (_datagram_handler) {
+            _datagram_handler(data, size);
+            return;
+        }
+        _audio_manager->audio_play({ data, size });
+    };
+
+    if (_server_config.upstream_port) {
+        // the relay closes the eventfd when it loses the upstream session
+        _upstream_close = [&event] {
+            asio::error_code ec;
+            event.close(ec);
+        };
+    }
+
+    uint64_t overruns = 0;
+    while (is_running()) {
+        asio::error_code ec;
+        co_await event.async_wait(asio::posix::stream_descriptor::wait_read, asio::redirect_error(asio::use_awaitable, ec));
+        if (ec) {
+            if (ec != asio::error::operation_aborted) {
+                spdlog::error("{} {}", __func__, ec.message());
+            }
+            break;
+        }
+        uint64_t quanta = 0;
+        (void)!::read(event_fd, &quanta, sizeof(quanta));
+
+        tracer::scope trace("client", "receive");
+        ring->read(deliver);
+        if (ring->overruns() != overruns) {
+            spdlog::warn("{} datagram(s) overwritten before they were read", ring->overruns() - overruns);
+            overruns = ring->overruns();
+        }
+        if (recorder && std::chrono::steady_clock::now() - last_flush > 1s) {
+            recorder->flush();
+            last_flush = std::chrono::steady_clock::now();
+        }
+    }
+    _upstream_close = nullptr;
+#else
+    co_return;
+#endif
+}
+
+std::unique_ptr<packet_trace::writer> network_manager::open_recorder(const audio_manager::AudioFormat& audio_format, packet_trace::clock_source clock)
+{
+    try {
+        auto recorder = std::make_unique<packet_trace::writer>(_record_path, audio_format.SerializeAsString(), clock);
+        spdlog::info("recording datagrams to {}", _record_path);
+        return recorder;
+    } catch (const std::exception& e) {
+        spdlog::error("{}", e.what());
+        return nullptr;
+    }
+}
+
+asio::awaitable<void> network_manager::relay_connect(std::shared_ptr<network_manager> self)
+{
+    const auto host = _server_config.upstream_host;
+    const auto port = _server_config.upstream_port;
+    pipeline_timer timer(*_ioc);
+    auto backoff = std::chrono::duration_cast<pipeline_clock::duration>(_relay_min_backoff);
+    while (is_running()) {
+        spdlog::info("relay: connect to upstream server {}:{}", host, port);
+        _upstream_subscribed = false;
+        try {
+            co_await client_connect(self, host, port);
+        } catch (const std::exception& e) {
+            spdlog::error("relay: {}", e.what());
+        }
+        if (_upstream_subscribed) {
+            // the heartbeat loop calls relay_lost when the session ends
+            co_return;
+        }
+        spdlog::warn("relay: failed to subscribe to {}:{}, retrying in {}ms", host, port, std::chrono::duration_cast<std::chrono::milliseconds>(backoff).count());
+        timer.expires_after(backoff);
+        auto [ec] = co_await timer.async_wait();
+        if (ec) {
+            co_return;
+        }
+        backoff = std::min<pipeline_clock::duration>(backoff * 2, _relay_max_backoff);
+    }
+}
+
+void network_manager::set_datagram_handler(datagram_handler handler)
+{
+    _datagram_handler = std::move(handler);
+}
+
+void network_manager::set_record_path(const std::string& path)
+{
+    _record_path = path;
+}
+
+void network_manager::set_net_thread_policy(const thread_util::thread_policy& policy)
+{
+    _net_thread_policy = policy;
+}
+
+void network_manager::set_use_shm(bool use_shm)
+{
+    _use_shm = use_shm;
+}
+
 void network_manager::wait_client()
 {
-    _net_thread.join();
+    if (_net_thread.joinable()) {
+        _net_thread.join();
+    }
 }
 
 void network_manager::stop_client()
@@ -616,7 +2076,9 @@ void network_manager::stop_client()
     if (_ioc) {
         _ioc->stop();
     }
-    _net_thread.join();
+    if (_net_thread.joinable()) {
+        _net_thread.join();
+    }
     _ioc = nullptr;
     spdlog::info("client stopped");
 }
@@ -21,37 +21,151 @@
 #include <vector>
 #include <string>
 #include <map>
+#include <functional>
 
 #include "pre_asio.hpp"
 #include <asio.hpp>
 #include <asio/use_awaitable.hpp>
 
 #include "audio_manager.hpp"
+#include "audio_pipeline.hpp"
+#include "impairment.hpp"
+#include "metrics.hpp"
+#include "packet_trace.hpp"
+#include "pipeline_clock.hpp"
+#include "shm_ring.hpp"
+#include "thread_util.hpp"
+#include "uring_sender.hpp"
+#include "zerocopy_sender.hpp"
 
 class network_manager : public std::enable_shared_from_this<network_manager>
 {
     using default_token = asio::as_tuple_t<asio::use_awaitable_t<>>;
     using tcp_acceptor = default_token::as_default_on_t<asio::ip::tcp::acceptor>;
     using tcp_socket = default_token::as_default_on_t<asio::ip::tcp::socket>;
+    using session_socket = default_token::as_default_on_t<asio::generic::stream_protocol::socket>; // TCP or Unix
     using udp_socket = default_token::as_default_on_t<asio::ip::udp::socket>;
-    using steady_timer = default_token::as_default_on_t<asio::steady_timer>;
+    using pipeline_timer = default_token::as_default_on_t<asio::basic_waitable_timer<pipeline_clock, pipeline_clock::wait_traits>>;
+#ifdef linux
+    using local_acceptor = default_token::as_default_on_t<asio::local::stream_protocol::acceptor>;
+    using local_socket = default_token::as_default_on_t<asio::local::stream_protocol::socket>;
+    using local_datagram_socket = default_token::as_default_on_t<asio::local::datagram_protocol::socket>;
+#endif
+
+    // The send counters of a peer, shared with its sender shard.
+    struct peer_stats_t {
+        metrics::counter bytes_sent;
+        metrics::counter packets_sent;
+        metrics::counter send_errors;
+    };
 
     struct peer_info_t {
         int id = 0;
         asio::ip::udp::endpoint udp_peer;
-        std::chrono::steady_clock::time_point last_tick;
+        pipeline_clock::time_point last_tick;
+        std::shared_ptr<peer_stats_t> stats = std::make_shared<peer_stats_t>();
+        std::unique_ptr<::impairment> impairment;
+        std::unique_ptr<udp_socket> connected_socket; // bound to the server port and connected to udp_peer
+#ifdef linux
+        std::unique_ptr<local_datagram_socket> local_socket; // a Unix session's end of its audio socket pair
+#endif
+        size_t async_sends = 0; // in flight, the synchronous sends wait for them to keep the order
+        size_t shard = 0; // the sender shard that sends to the peer
+    };
+
+    // A peer as its sender shard sees it. The shard owns it, so a shard thread
+    // never touches a peer_info_t and its sockets on _ioc.
+    struct shard_peer_t {
+        int id = 0;
+        asio::ip::udp::endpoint endpoint; // copied, the network thread may fill udp_peer again
+        std::shared_ptr<peer_stats_t> stats;
+        size_t async_sends = 0;
+    };
+
+    // One more socket bound to the server port with SO_REUSEPORT and a thread
+    // that sends the quanta to its share of the peers.
+    struct sender_shard_t {
+        asio::io_context ioc;
+        std::unique_ptr<udp_socket> socket;
+        std::vector<std::shared_ptr<shard_peer_t>> peers; // only touched by the thread
+        std::thread thread;
+    };
+
+    // Accepts on its own listening socket on the server port and hands the
+    // sessions to the network thread.
+    struct acceptor_thread_t {
+        asio::io_context ioc;
+        std::thread thread;
     };
 
-    using playing_peer_list_t = std::map<std::shared_ptr<tcp_socket>, std::shared_ptr<peer_info_t>>;
+    // A session that reads the shared memory ring instead of receiving datagrams.
+    struct shm_session_t {
+        uint64_t token = 0; // fetches the fds once over the Unix socket, 0 when it did
+        int event_fd = -1; // owned by the ring
+        pipeline_clock::time_point last_tick;
+    };
+
+    using playing_peer_list_t = std::map<std::shared_ptr<session_socket>, std::shared_ptr<peer_info_t>>;
+    using shm_session_list_t = std::map<std::shared_ptr<session_socket>, shm_session_t>;
 
+public:
     enum class cmd_t : uint32_t {
         cmd_none = 0,
         cmd_get_format = 1,
         cmd_start_play = 2,
         cmd_heartbeat = 3,
+        cmd_get_shm = 4, // a client on the same host reads the shared memory ring, Linux only
     };
 
-public:
+    enum class send_backend_t : uint8_t {
+        asio,
+        uring, // io_uring on Linux, falls back to asio when it's unavailable
+    };
+
+    // Receives every audio datagram of a client instead of the audio backend.
+    using datagram_handler = std::function<void(const char* data, size_t size)>;
+
+    struct server_config {
+        std::string metrics_host;
+        uint16_t metrics_port = 0; // 0 disables the metrics listener
+        ::impairment::config impairment; // applied to the audio datagrams of every peer, for testing
+
+        // Warn when the network thread falls behind, zero disables a warning.
+        std::chrono::microseconds post_latency_warning { 5000 };
+        std::chrono::microseconds send_latency_warning { 10000 };
+        std::chrono::microseconds loop_lag_warning { 5000 };
+        std::chrono::milliseconds loop_lag_interval { 100 }; // zero disables the probe
+        thread_util::thread_policy net_thread;
+        audio_pipeline::config pipeline; // the stages between the capture and the network thread
+        send_backend_t send_backend = send_backend_t::asio; // how the audio datagrams are sent
+        uring_sender::config uring;
+        // Quanta from this size up go to the peers with MSG_ZEROCOPY and UDP GSO on Linux, 0 disables.
+        size_t zerocopy_min_payload = 0;
+        zerocopy_sender::config zerocopy;
+        // Send to every peer from its own UDP socket on the server port, connected to the peer, so
+        // the kernel doesn't look up the route per datagram. Linux only, the io_uring and zero-copy
+        // sends still go from the server socket.
+        bool connected_peers = false;
+        // Send to the peers without impairment from this many threads, each with its own socket on
+        // the server port, and spread the peers over them by id. 0 sends from the network thread.
+        // Linux only, replaces the io_uring, zero-copy and connected peer sends.
+        size_t sender_threads = 0;
+        thread_util::thread_policy sender_thread;
+        // Accept the TCP connections on this many threads, each with its own listening socket on
+        // the server port, so a storm of connections doesn't queue on one backlog and one thread.
+        // The sessions still run on the network thread. Linux only, 0 accepts on the network thread.
+        size_t accept_threads = 0;
+        // Relay: subscribe to this server as a client and send its audio datagrams to the peers
+        // unchanged, instead of capturing. The peers get its format, the sessions are closed when it
+        // changes so that the clients fetch it again. A lost upstream is reconnected with a backoff
+        // of up to 30s. 0 captures.
+        std::string upstream_host;
+        uint16_t upstream_port = 0;
+        // Hand a shared memory ring with the audio to the clients on the same host that ask for it
+        // with cmd_get_shm, through a Unix socket at this path. Empty disables, Linux only.
+        std::string shm_path;
+        shm_ring::writer::config shm;
+    };
 
     explicit network_manager(std::shared_ptr<audio_manager>& audio_manager);
 
@@ -62,29 +176,80 @@ private:
 
 public:
     void start_server(const std::string& host, uint16_t port, const audio_manager::capture_config& capture_config);
+    void start_server(const std::string& host, uint16_t port, const audio_manager::capture_config& capture_config, const server_config& server_config);
     void stop_server();
     void wait_server();
     void start_client(const std::string& host, uint16_t port);
     void stop_client();
     void wait_client();
+    void set_datagram_handler(datagram_handler handler);
+    // Record every received audio datagram to a packet_trace file, must be set before start_client.
+    void set_record_path(const std::string& path);
+    // Scheduling of the client network thread, must be set before start_client.
+    void set_net_thread_policy(const thread_util::thread_policy& policy);
+    // Read the shared memory ring of a server on the same host instead of receiving datagrams,
+    // must be set before start_client. Falls back to datagrams when the server has no ring.
+    void set_use_shm(bool use_shm);
     bool is_running() const;
+    // Run the handlers that are ready, for tests that drive the pipeline with a manual pipeline_clock.
+    size_t poll();
+    std::chrono::nanoseconds net_thread_cpu_time();
 
 private:
     asio::awaitable<void> accept_tcp_loop(tcp_acceptor acceptor);
-    asio::awaitable<void> read_loop(std::shared_ptr<tcp_socket> peer);
-    asio::awaitable<void> heartbeat_loop(std::shared_ptr<tcp_socket> peer);
-    asio::awaitable<void> accept_udp_loop();
+    asio::awaitable<void> read_loop(std::shared_ptr<session_socket> peer);
+    asio::awaitable<void> heartbeat_loop(std::shared_ptr<session_socket> peer);
+    asio::awaitable<void> accept_udp_loop(udp_socket& socket);
+    asio::awaitable<void> accept_metrics_loop(tcp_acceptor acceptor);
+    asio::awaitable<void> loop_lag_loop();
+    asio::awaitable<void> zerocopy_reap_loop();
+    asio::awaitable<void> metrics_session(std::shared_ptr<tcp_socket> peer);
     asio::awaitable<void> client_connect(std::shared_ptr<network_manager> self, const std::string host, uint16_t port);
-    asio::awaitable<void> client_heartbeat_loop(std::shared_ptr<tcp_socket> socket);
+    asio::awaitable<void> client_heartbeat_loop(std::shared_ptr<session_socket> socket);
     asio::awaitable<void> client_udp_loop(audio_manager::AudioFormat audio_format, const std::string host, uint16_t port, uint32_t id);
+    asio::awaitable<void> client_local_loop(audio_manager::AudioFormat audio_format, int fd, uint32_t id);
+    template <typename Socket>
+    asio::awaitable<void> client_receive_loop(audio_manager::AudioFormat audio_format, Socket& socket, uint32_t id);
+    asio::awaitable<void> relay_connect(std::shared_ptr<network_manager> self);
+    asio::awaitable<bool> client_shm_connect(std::shared_ptr<session_socket> socket, audio_manager::AudioFormat audio_format);
+    asio::awaitable<void> client_shm_loop(audio_manager::AudioFormat audio_format, std::shared_ptr<shm_ring::reader> ring, int event_fd);
+    asio::awaitable<asio::error_code> start_local_audio(std::shared_ptr<session_socket> peer, int id);
+#ifdef linux
+    asio::awaitable<void> accept_local_loop(local_acceptor acceptor);
+    asio::awaitable<void> accept_shm_loop(local_acceptor acceptor);
+    asio::awaitable<void> shm_handoff(std::shared_ptr<local_socket> peer);
+#endif
 
-    playing_peer_list_t::iterator close_session(std::shared_ptr<tcp_socket>& peer);
-    int add_playing_peer(std::shared_ptr<tcp_socket>& peer);
-    playing_peer_list_t::iterator remove_playing_peer(std::shared_ptr<tcp_socket>& peer);
+    playing_peer_list_t::iterator close_session(std::shared_ptr<session_socket>& peer);
+    uint64_t add_shm_session(std::shared_ptr<session_socket>& peer);
+    void start_local_listener(const std::string& path);
+    void start_shm_ring();
+    std::unique_ptr<packet_trace::writer> open_recorder(const audio_manager::AudioFormat& audio_format, packet_trace::clock_source clock);
+    int add_playing_peer(std::shared_ptr<session_socket>& peer);
+    playing_peer_list_t::iterator remove_playing_peer(std::shared_ptr<session_socket>& peer);
     void fill_udp_peer(int id, asio::ip::udp::endpoint udp_peer);
+    void connect_udp_peer(peer_info_t& info);
+    std::string render_metrics();
+    void post_segments(packetizer::segment_list_t seg_list, size_t count);
+    void relay_datagram(const char* data, size_t size);
+    void update_format(const audio_manager::AudioFormat& format);
+    void relay_lost();
+    void start_uring_sender();
+    void start_zerocopy_sender();
+    void start_sender_shards(const asio::ip::udp::endpoint& endpoint);
+    void stop_sender_shards();
+    void start_acceptor_threads(const asio::ip::tcp::endpoint& endpoint);
+    void stop_acceptor_threads();
+    void update_sender_shard(size_t index);
+    template <typename Socket, typename Peer>
+    static void send_datagram(Socket& socket, const typename Socket::endpoint_type* endpoint, const packetizer::segment_t& seg, const std::shared_ptr<Peer>& info, const std::shared_ptr<void>& probe, asio::io_context* home = nullptr);
+    static void count_send(peer_stats_t& stats, size_t size, bool ok, size_t bytes_transferred, size_t packets = 1);
 
 public:
-    void broadcast_audio_data(const char* data, size_t count, int block_align);
+    void broadcast_audio_data(const char* data, size_t count, int block_align, std::shared_ptr<void> owner = nullptr);
+    // Whether the capture should hold its buffer and pass an owner to
+    // broadcast_audio_data, see audio_pipeline::sends_in_place.
+    bool sends_capture_in_place() const;
     
     std::shared_ptr<asio::io_context> _ioc;
 
@@ -92,8 +257,26 @@ private:
     std::shared_ptr<audio_manager> _audio_manager;
     std::thread _net_thread;
     std::unique_ptr<udp_socket> _udp_server;
+    std::unique_ptr<audio_pipeline> _pipeline;
+    std::unique_ptr<uring_sender> _uring_sender; // sends the audio datagrams of _udp_server when set
+    std::unique_ptr<zerocopy_sender> _zerocopy_sender; // sends the large quanta of _udp_server when set
+    std::vector<std::unique_ptr<sender_shard_t>> _sender_shards; // send instead of the network thread when set
+    std::vector<std::unique_ptr<acceptor_thread_t>> _acceptor_threads; // accept instead of the network thread when set
+    std::unique_ptr<shm_ring::writer> _shm_ring; // the audio for the clients on the same host when set
+    std::string _local_path; // the Unix socket of the sessions instead of TCP and UDP when set
+    shm_session_list_t _shm_sessions;
+    datagram_handler _datagram_handler;
+    std::string _record_path;
+    thread_util::thread_policy _net_thread_policy;
+    bool _use_shm = false;
+    server_config _server_config;
     playing_peer_list_t _playing_peer_list;
+    bool _upstream_subscribed = false; // the last relay_connect attempt got a session
+    std::function<void()> _upstream_close; // ends the audio loop of the relay's upstream session
     constexpr static auto _heartbeat_timeout = std::chrono::seconds(5);
+    constexpr static auto _metrics_timeout = std::chrono::seconds(5); // to read the request and write the response
+    constexpr static auto _relay_min_backoff = std::chrono::seconds(1);
+    constexpr static auto _relay_max_backoff = std::chrono::seconds(30);
 };
 
 #endif // !NETWORK_MANAGER_HPP
\ No newline at end of file
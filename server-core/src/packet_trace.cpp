@@ -0,0 +1,100 @@
+/*
+   Copyright 2022-2024 mkckr0 <https://github.com/mkckr0>
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+*/
+
+#include "packet_trace.hpp"
+
+#include <stdexcept>
+
+namespace packet_trace {
+
+namespace {
+
+// the supported platforms are little endian, so the fields are written as is
+template <typename T>
+void put(std::ofstream& file, T value)
+{
+    file.write((const char*)&value, sizeof(value));
+}
+
+template <typename T>
+bool get(std::ifstream& file, T& value)
+{
+    return (bool)file.read((char*)&value, sizeof(value));
+}
+
+} // namespace
+
+writer::writer(const std::string& path, const std::string& format_binary, clock_source clock)
+    : _file(path, std::ios::binary | std::ios::trunc)
+    , _clock(clock)
+{
+    if (!_file) {
+        throw std::runtime_error("can't create " + path);
+    }
+    put(_file, magic);
+    put(_file, version);
+    put(_file, (uint32_t)clock);
+    put(_file, (uint32_t)format_binary.size());
+    _file.write(format_binary.data(), (std::streamsize)format_binary.size());
+}
+
+void writer::write(std::chrono::nanoseconds timestamp, const char* data, size_t size)
+{
+    if (!_started) {
+        _started = true;
+        _first = timestamp;
+    }
+    put(_file, (uint64_t)(timestamp - _first).count());
+    put(_file, (uint32_t)size);
+    _file.write(data, (std::streamsize)size);
+}
+
+void writer::flush()
+{
+    _file.flush();
+}
+
+reader::reader(const std::string& path)
+    : _file(path, std::ios::binary)
+{
+    if (!_file) {
+        throw std::runtime_error("can't open " + path);
+    }
+    uint32_t file_magic = 0, file_version = 0, clock = 0, format_size = 0;
+    if (!get(_file, file_magic) || !get(_file, file_version) || !get(_file, clock) || !get(_file, format_size)
+        || file_magic != magic || file_version != version) {
+        throw std::runtime_error(path + " is not a packet trace");
+    }
+    _clock = (clock_source)clock;
+    _format_binary.resize(format_size);
+    if (!_file.read(_format_binary.data(), format_size)) {
+        throw std::runtime_error(path + " is truncated");
+    }
+}
+
+bool reader::next(record_t& record)
+{
+    uint64_t timestamp = 0;
+    uint32_t size = 0;
+    if (!get(_file, timestamp) || !get(_file, size)) {
+        return false;
+    }
+    record.timestamp = std::chrono::nanoseconds(timestamp);
+    record.payload.resize(size);
+    return (bool)_file.read(record.payload.data(), size);
+}
+
+} // namespace packet_trace
@@ -0,0 +1,84 @@
+/*
+   Copyright 2022-2024 mkckr0 <https://github.com/mkckr0>
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+*/
+
+#ifndef PACKET_TRACE_HPP
+#define PACKET_TRACE_HPP
+
+#include <chrono>
+#include <cstdint>
+#include <fstream>
+#include <string>
+#include <vector>
+
+// Compact recording of the audio datagrams a client received, so that real
+// network conditions can be replayed against the client pipeline.
+//
+// file:   magic "ASPT" | version u32 | clock u32 | format size u32 | AudioFormat (protobuf)
+// record: receive time ns u64, relative to the first record | size u32 | payload
+//
+// All integers are little endian.
+namespace packet_trace {
+
+constexpr uint32_t magic = 0x54505341; // "ASPT"
+constexpr uint32_t version = 1;
+
+enum class clock_source : uint32_t {
+    steady = 0, // std::chrono::steady_clock when the receive completed
+    kernel = 1, // SO_TIMESTAMPNS, taken by the kernel when the datagram arrived
+};
+
+class writer {
+public:
+    // Throws std::runtime_error if the file can't be created.
+    writer(const std::string& path, const std::string& format_binary, clock_source clock);
+
+    clock_source clock() const { return _clock; }
+
+    void write(std::chrono::nanoseconds timestamp, const char* data, size_t size);
+    void flush();
+
+private:
+    std::ofstream _file;
+    clock_source _clock;
+    bool _started = false;
+    std::chrono::nanoseconds _first {};
+};
+
+struct record_t {
+    std::chrono::nanoseconds timestamp {};
+    std::vector<char> payload;
+};
+
+class reader {
+public:
+    // Throws std::runtime_error if the file can't be opened or has a bad header.
+    explicit reader(const std::string& path);
+
+    clock_source clock() const { return _clock; }
+    const std::string& format_binary() const { return _format_binary; }
+
+    // Returns false at the end of the file or on a truncated record.
+    bool next(record_t& record);
+
+private:
+    std::ifstream _file;
+    clock_source _clock = clock_source::steady;
+    std::string _format_binary;
+};
+
+} // namespace packet_trace
+
+#endif // !PACKET_TRACE_HPP
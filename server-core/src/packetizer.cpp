@@ -0,0 +1,52 @@
+/*
+   Copyright 2022-2024 mkckr0 <https://github.com/mkckr0>
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+*/
+
+#include "packetizer.hpp"
+
+#include <algorithm>
+
+namespace packetizer {
+
+int max_segment_size(int block_align, int mtu)
+{
+    int max_seg_size = mtu - ip_header_size - udp_header_size;
+    max_seg_size -= max_seg_size % block_align; // one single sample can't be divided
+    return max_seg_size;
+}
+
+segment_t make_segment(const char* data, size_t count)
+{
+    return std::allocate_shared<segment_buffer_t>(handler_allocator<segment_buffer_t>(), (const uint8_t*)data, (const uint8_t*)data + count);
+}
+
+segment_list_t split(const char* data, size_t count, int block_align, int mtu, const std::shared_ptr<void>& owner)
+{
+    const size_t max_seg_size = (size_t)max_segment_size(block_align, mtu);
+
+    segment_list_t seg_list;
+    for (size_t begin_pos = 0; begin_pos < count;) {
+        const size_t real_seg_size = std::min(count - begin_pos, max_seg_size);
+        if (owner) {
+            seg_list.push_back(std::allocate_shared<segment_buffer_t>(handler_allocator<segment_buffer_t>(), (const uint8_t*)data + begin_pos, real_seg_size, owner));
+        } else {
+            seg_list.push_back(make_segment(data + begin_pos, real_seg_size));
+        }
+        begin_pos += real_seg_size;
+    }
+    return seg_list;
+}
+
+} // namespace packetizer
@@ -0,0 +1,85 @@
+/*
+   Copyright 2022-2024 mkckr0 <https://github.com/mkckr0>
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+*/
+
+#ifndef PACKETIZER_HPP
+#define PACKETIZER_HPP
+
+#include <cstddef>
+#include <cstdint>
+#include <list>
+#include <memory>
+#include <vector>
+
+#include "handler_allocator.hpp"
+
+namespace packetizer {
+
+constexpr int default_mtu = 1492;
+constexpr int ip_header_size = 20;
+constexpr int udp_header_size = 8;
+
+// The payload of one datagram. It owns a copy of the bytes, or only points at
+// bytes of someone else, e.g. a held capture buffer, and keeps their owner
+// until the last send released the segment.
+class segment_buffer_t {
+public:
+    segment_buffer_t(const uint8_t* first, const uint8_t* last)
+        : _bytes(first, last)
+        , _data(_bytes.data())
+        , _size(_bytes.size())
+    {
+    }
+
+    segment_buffer_t(const uint8_t* data, size_t size, std::shared_ptr<void> owner)
+        : _data(data)
+        , _size(size)
+        , _owner(std::move(owner))
+    {
+    }
+
+    segment_buffer_t(const segment_buffer_t&) = delete;
+    segment_buffer_t& operator=(const segment_buffer_t&) = delete;
+
+    const uint8_t* data() const { return _data; }
+    size_t size() const { return _size; }
+
+private:
+    std::vector<uint8_t, handler_allocator<uint8_t>> _bytes;
+    const uint8_t* _data;
+    size_t _size;
+    std::shared_ptr<void> _owner;
+};
+
+// The bytes, the shared state and the list nodes of the segments come from
+// handler_memory, so splitting a quantum doesn't go to the heap once the
+// segments of the earlier quanta came back.
+using segment_t = std::shared_ptr<segment_buffer_t>;
+using segment_list_t = std::list<segment_t, handler_allocator<segment_t>>;
+
+// The largest UDP payload for the mtu. One single sample can't be divided, so
+// it's rounded down to a multiple of block_align.
+int max_segment_size(int block_align, int mtu = default_mtu);
+
+// Copy one datagram into a segment.
+segment_t make_segment(const char* data, size_t count);
+
+// Divide one captured quantum into UDP sized segments. With an owner the
+// segments point into data instead of copying it and keep the owner.
+segment_list_t split(const char* data, size_t count, int block_align, int mtu = default_mtu, const std::shared_ptr<void>& owner = nullptr);
+
+} // namespace packetizer
+
+#endif // !PACKETIZER_HPP
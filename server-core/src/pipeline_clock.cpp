@@ -0,0 +1,131 @@
+/*
+   Copyright 2022-2024 mkckr0 <https://github.com/mkckr0>
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+*/
+
+#include "pipeline_clock.hpp"
+
+#include <atomic>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+
+namespace {
+
+using namespace std::chrono;
+
+std::atomic<pipeline_clock::mode_t> g_mode = pipeline_clock::mode_t::real;
+
+// scaled: now = origin + (steady_clock::now() - real_origin) * speed
+std::atomic<int64_t> g_origin_ns = 0;
+std::atomic<int64_t> g_real_origin_ns = 0;
+std::atomic<double> g_speed = 1.0;
+
+// manual
+std::atomic<int64_t> g_manual_ns = 0;
+std::mutex g_manual_mutex;
+std::condition_variable g_manual_cv;
+
+int64_t steady_ns()
+{
+    return duration_cast<nanoseconds>(steady_clock::now().time_since_epoch()).count();
+}
+
+} // namespace
+
+pipeline_clock::time_point pipeline_clock::now() noexcept
+{
+    switch (g_mode.load(std::memory_order_relaxed)) {
+    case mode_t::scaled: {
+        auto elapsed = (double)(steady_ns() - g_real_origin_ns.load(std::memory_order_relaxed));
+        return time_point(duration(g_origin_ns.load(std::memory_order_relaxed) + (int64_t)(elapsed * g_speed.load(std::memory_order_relaxed))));
+    }
+    case mode_t::manual:
+        return time_point(duration(g_manual_ns.load(std::memory_order_acquire)));
+    default:
+        return time_point(duration(steady_ns()));
+    }
+}
+
+auto pipeline_clock::mode() -> mode_t
+{
+    return g_mode.load(std::memory_order_relaxed);
+}
+
+void pipeline_clock::use_real_time()
+{
+    g_mode = mode_t::real;
+}
+
+void pipeline_clock::use_scaled_time(double speed)
+{
+    auto origin = now().time_since_epoch().count();
+    g_speed = speed > 0 ? speed : 1.0;
+    g_origin_ns = origin;
+    g_real_origin_ns = steady_ns();
+    g_mode = mode_t::scaled;
+}
+
+void pipeline_clock::use_manual_time()
+{
+    g_manual_ns = now().time_since_epoch().count();
+    g_mode = mode_t::manual;
+}
+
+void pipeline_clock::advance(duration d)
+{
+    {
+        std::lock_guard lock(g_manual_mutex);
+        g_manual_ns.fetch_add(d.count(), std::memory_order_release);
+    }
+    g_manual_cv.notify_all();
+}
+
+void pipeline_clock::sleep_until(time_point t)
+{
+    switch (mode()) {
+    case mode_t::manual: {
+        std::unique_lock lock(g_manual_mutex);
+        g_manual_cv.wait(lock, [t] {
+            return now() >= t;
+        });
+        break;
+    }
+    default:
+        std::this_thread::sleep_for(wait_traits::to_wait_duration(t - now()));
+        break;
+    }
+}
+
+auto pipeline_clock::wait_traits::to_wait_duration(const duration& d) -> duration
+{
+    if (d <= duration::zero()) {
+        return duration::zero();
+    }
+    switch (pipeline_clock::mode()) {
+    case mode_t::scaled:
+        return duration((int64_t)((double)d.count() / g_speed.load(std::memory_order_relaxed)));
+    case mode_t::manual:
+        // the time only moves in advance(), so let the reactor check the
+        // timers every time it runs instead of waiting on a real deadline
+        return duration::zero();
+    default:
+        return d;
+    }
+}
+
+auto pipeline_clock::wait_traits::to_wait_duration(const time_point& t) -> duration
+{
+    return to_wait_duration(t - pipeline_clock::now());
+}
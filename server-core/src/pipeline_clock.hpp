@@ -0,0 +1,70 @@
+/*
+   Copyright 2022-2024 mkckr0 <https://github.com/mkckr0>
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+*/
+
+#ifndef PIPELINE_CLOCK_HPP
+#define PIPELINE_CLOCK_HPP
+
+#include <chrono>
+
+// Clock of the timers and the pacing of the whole pipeline. It follows
+// steady_clock unless a test switches it to scaled time, which runs a number
+// of times faster than real time, or to manual time, which only moves in
+// advance(). In manual time network_manager and audio_manager start no
+// threads and the test drives them with poll(), so a session of many hours
+// runs deterministically in seconds.
+//
+// In real time, time points have the same epoch as steady_clock, so they can
+// be compared with steady_clock in another process on the same host.
+struct pipeline_clock {
+    using duration = std::chrono::nanoseconds;
+    using rep = duration::rep;
+    using period = duration::period;
+    using time_point = std::chrono::time_point<pipeline_clock>;
+    static constexpr bool is_steady = true;
+
+    enum class mode_t {
+        real,
+        scaled,
+        manual,
+    };
+
+    static time_point now() noexcept;
+    static mode_t mode();
+    static bool is_manual() { return mode() == mode_t::manual; }
+
+    // Switch the mode before any thread or timer uses the clock. Time
+    // continues from the current value.
+    static void use_real_time();
+    static void use_scaled_time(double speed);
+    static void use_manual_time();
+
+    // Only in manual time.
+    static void advance(duration d);
+
+    // Block the calling thread until now() reaches t.
+    static void sleep_until(time_point t);
+
+    // WaitTraits of asio::basic_waitable_timer, converts the time left on the
+    // pipeline clock to the real time the reactor waits. In manual time it is
+    // always zero, so io_context::poll() after advance() fires every timer
+    // that became due; nothing may block in io_context::run() then.
+    struct wait_traits {
+        static duration to_wait_duration(const duration& d);
+        static duration to_wait_duration(const time_point& t);
+    };
+};
+
+#endif // !PIPELINE_CLOCK_HPP
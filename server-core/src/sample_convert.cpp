@@ -0,0 +1,195 @@
+/*
+   Copyright 2022-2024 mkckr0 <https://github.com/mkckr0>
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+*/
+
+#include "sample_convert.hpp"
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+
+using namespace io::github::mkckr0::audio_share_app::pb;
+
+namespace sample_convert {
+
+namespace {
+
+// The loops below are kept branch free so that the compiler can vectorize them.
+
+void s16_to_f32(const int16_t* src, float* dst, size_t n)
+{
+    for (size_t i = 0; i < n; ++i) {
+        dst[i] = (float)src[i] * (1.0f / 32768.0f);
+    }
+}
+
+void f32_to_s16(const float* src, int16_t* dst, size_t n)
+{
+    for (size_t i = 0; i < n; ++i) {
+        float v = std::clamp(src[i] * 32768.0f, -32768.0f, 32767.0f);
+        dst[i] = (int16_t)v;
+    }
+}
+
+void s32_to_f32(const int32_t* src, float* dst, size_t n)
+{
+    for (size_t i = 0; i < n; ++i) {
+        dst[i] = (float)((double)src[i] * (1.0 / 2147483648.0));
+    }
+}
+
+void f32_to_s32(const float* src, int32_t* dst, size_t n)
+{
+    for (size_t i = 0; i < n; ++i) {
+        double v = std::clamp((double)src[i] * 2147483648.0, -2147483648.0, 2147483647.0);
+        dst[i] = (int32_t)v;
+    }
+}
+
+void s24_to_f32(const uint8_t* src, float* dst, size_t n)
+{
+    for (size_t i = 0; i < n; ++i) {
+        int32_t v = (int32_t)((uint32_t)src[3 * i] << 8 | (uint32_t)src[3 * i + 1] << 16 | (uint32_t)src[3 * i + 2] << 24) >> 8;
+        dst[i] = (float)v * (1.0f / 8388608.0f);
+    }
+}
+
+void f32_to_s24(const float* src, uint8_t* dst, size_t n)
+{
+    for (size_t i = 0; i < n; ++i) {
+        float v = std::clamp(src[i] * 8388608.0f, -8388608.0f, 8388607.0f);
+        auto s = (uint32_t)(int32_t)v;
+        dst[3 * i] = (uint8_t)s;
+        dst[3 * i + 1] = (uint8_t)(s >> 8);
+        dst[3 * i + 2] = (uint8_t)(s >> 16);
+    }
+}
+
+void u8_to_f32(const uint8_t* src, float* dst, size_t n)
+{
+    for (size_t i = 0; i < n; ++i) {
+        dst[i] = ((float)src[i] - 128.0f) * (1.0f / 128.0f);
+    }
+}
+
+void f32_to_u8(const float* src, uint8_t* dst, size_t n)
+{
+    for (size_t i = 0; i < n; ++i) {
+        float v = std::clamp(src[i] * 128.0f + 128.0f, 0.0f, 255.0f);
+        dst[i] = (uint8_t)v;
+    }
+}
+
+void to_f32(encoding_t encoding, const void* src, float* dst, size_t n)
+{
+    switch (encoding) {
+    case AudioFormat_Encoding_ENCODING_PCM_FLOAT:
+        std::memcpy(dst, src, n * sizeof(float));
+        break;
+    case AudioFormat_Encoding_ENCODING_PCM_8BIT:
+        u8_to_f32((const uint8_t*)src, dst, n);
+        break;
+    case AudioFormat_Encoding_ENCODING_PCM_16BIT:
+        s16_to_f32((const int16_t*)src, dst, n);
+        break;
+    case AudioFormat_Encoding_ENCODING_PCM_24BIT:
+        s24_to_f32((const uint8_t*)src, dst, n);
+        break;
+    case AudioFormat_Encoding_ENCODING_PCM_32BIT:
+        s32_to_f32((const int32_t*)src, dst, n);
+        break;
+    default:
+        break;
+    }
+}
+
+void from_f32(encoding_t encoding, const float* src, void* dst, size_t n)
+{
+    switch (encoding) {
+    case AudioFormat_Encoding_ENCODING_PCM_FLOAT:
+        std::memcpy(dst, src, n * sizeof(float));
+        break;
+    case AudioFormat_Encoding_ENCODING_PCM_8BIT:
+        f32_to_u8(src, (uint8_t*)dst, n);
+        break;
+    case AudioFormat_Encoding_ENCODING_PCM_16BIT:
+        f32_to_s16(src, (int16_t*)dst, n);
+        break;
+    case AudioFormat_Encoding_ENCODING_PCM_24BIT:
+        f32_to_s24(src, (uint8_t*)dst, n);
+        break;
+    case AudioFormat_Encoding_ENCODING_PCM_32BIT:
+        f32_to_s32(src, (int32_t*)dst, n);
+        break;
+    default:
+        break;
+    }
+}
+
+} // namespace
+
+int bytes_per_sample(encoding_t encoding)
+{
+    switch (encoding) {
+    case AudioFormat_Encoding_ENCODING_PCM_FLOAT:
+        return 4;
+    case AudioFormat_Encoding_ENCODING_PCM_8BIT:
+        return 1;
+    case AudioFormat_Encoding_ENCODING_PCM_16BIT:
+        return 2;
+    case AudioFormat_Encoding_ENCODING_PCM_24BIT:
+        return 3;
+    case AudioFormat_Encoding_ENCODING_PCM_32BIT:
+        return 4;
+    default:
+        return 0;
+    }
+}
+
+bool convert(encoding_t src_encoding, const void* src, encoding_t dst_encoding, void* dst, size_t samples)
+{
+    const int src_size = bytes_per_sample(src_encoding);
+    const int dst_size = bytes_per_sample(dst_encoding);
+    if (src_size == 0 || dst_size == 0) {
+        return false;
+    }
+
+    if (src_encoding == dst_encoding) {
+        std::memcpy(dst, src, samples * src_size);
+        return true;
+    }
+    if (src_encoding == AudioFormat_Encoding_ENCODING_PCM_FLOAT) {
+        from_f32(dst_encoding, (const float*)src, dst, samples);
+        return true;
+    }
+    if (dst_encoding == AudioFormat_Encoding_ENCODING_PCM_FLOAT) {
+        to_f32(src_encoding, src, (float*)dst, samples);
+        return true;
+    }
+
+    // integer to integer goes through a small float block on the stack
+    constexpr size_t block_size = 256;
+    float block[block_size];
+    auto src_ptr = (const uint8_t*)src;
+    auto dst_ptr = (uint8_t*)dst;
+    for (size_t pos = 0; pos < samples; pos += block_size) {
+        const size_t n = std::min(block_size, samples - pos);
+        to_f32(src_encoding, src_ptr + pos * src_size, block, n);
+        from_f32(dst_encoding, block, dst_ptr + pos * dst_size, n);
+    }
+    return true;
+}
+
+} // namespace sample_convert
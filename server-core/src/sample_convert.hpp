@@ -0,0 +1,38 @@
+/*
+   Copyright 2022-2024 mkckr0 <https://github.com/mkckr0>
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+*/
+
+#ifndef SAMPLE_CONVERT_HPP
+#define SAMPLE_CONVERT_HPP
+
+#include <cstddef>
+
+#include "client.pb.h"
+
+namespace sample_convert {
+
+using encoding_t = io::github::mkckr0::audio_share_app::pb::AudioFormat_Encoding;
+
+// Bytes of one sample of one channel, 0 for an invalid encoding.
+int bytes_per_sample(encoding_t encoding);
+
+// Convert interleaved little endian PCM samples. 8 bit PCM is unsigned, like
+// Android's ENCODING_PCM_8BIT. src and dst must not overlap.
+// Returns false if either encoding is invalid.
+bool convert(encoding_t src_encoding, const void* src, encoding_t dst_encoding, void* dst, size_t samples);
+
+} // namespace sample_convert
+
+#endif // !SAMPLE_CONVERT_HPP
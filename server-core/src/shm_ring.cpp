@@ -0,0 +1,262 @@
+/*
+   Copyright 2022-2024 mkckr0 <https://github.com/mkckr0>
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+*/
+
+#include "shm_ring.hpp"
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <cstring>
+#include <stdexcept>
+#include <system_error>
+
+#ifdef linux
+#include <fcntl.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+namespace {
+
+struct header_t {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t slots;
+    uint32_t slot_size;
+    alignas(64) std::atomic<uint64_t> written; // the sequence number of the last complete datagram
+};
+
+struct slot_t {
+    std::atomic<uint64_t> sequence; // 2n when datagram n is complete, 2n - 1 while it's written
+    uint32_t size;
+    uint32_t reserved;
+};
+
+// the atomics are shared with other processes
+static_assert(std::atomic<uint64_t>::is_always_lock_free);
+
+constexpr size_t header_size = (sizeof(header_t) + 63) / 64 * 64;
+
+size_t slot_stride(size_t slot_size)
+{
+    return (sizeof(slot_t) + slot_size + 63) / 64 * 64;
+}
+
+slot_t* slot_at(const char* map, size_t slots, size_t slot_size, uint64_t sequence)
+{
+    return (slot_t*)(map + header_size + (sequence % slots) * slot_stride(slot_size));
+}
+
+} // namespace
+
+namespace shm_ring {
+
+writer::writer(const config& config)
+    : _slots(std::max<size_t>(config.slots, 1))
+    , _slot_size(config.slot_size)
+{
+#ifdef linux
+    _map_size = header_size + _slots * slot_stride(_slot_size);
+    _fd = memfd_create("audio-share-ring", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+    if (_fd < 0) {
+        throw std::system_error(errno, std::system_category(), "memfd_create");
+    }
+    if (ftruncate(_fd, (off_t)_map_size) != 0) {
+        auto error = errno;
+        close(_fd);
+        throw std::system_error(error, std::system_category(), "ftruncate");
+    }
+    _map = (char*)mmap(nullptr, _map_size, PROT_READ | PROT_WRITE, MAP_SHARED, _fd, 0);
+    if (_map == MAP_FAILED) {
+        auto error = errno;
+        close(_fd);
+        throw std::system_error(error, std::system_category(), "mmap");
+    }
+    // the readers can't resize the ring, and from Linux 5.1 can't map it writable
+    int seals = F_SEAL_SHRINK | F_SEAL_GROW;
+#ifdef F_SEAL_FUTURE_WRITE
+    seals |= F_SEAL_FUTURE_WRITE;
+#endif
+    if (fcntl(_fd, F_ADD_SEALS, seals) != 0) {
+        fcntl(_fd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW);
+    }
+
+    // memfd pages start zeroed, so every slot sequence is 0
+    auto header = new (_map) header_t;
+    header->magic = magic;
+    header->version = version;
+    header->slots = (uint32_t)_slots;
+    header->slot_size = (uint32_t)_slot_size;
+    header->written.store(0, std::memory_order_release);
+#else
+    throw std::system_error(std::make_error_code(std::errc::function_not_supported), "memfd_create");
+#endif
+}
+
+writer::~writer()
+{
+#ifdef linux
+    for (auto event_fd : _readers) {
+        close(event_fd);
+    }
+    if (_map) {
+        munmap(_map, _map_size);
+    }
+    if (_fd >= 0) {
+        close(_fd);
+    }
+#endif
+}
+
+bool writer::write(const void* data, size_t size)
+{
+    if (size > _slot_size) {
+        return false;
+    }
+    auto slot = slot_at(_map, _slots, _slot_size, _next);
+    slot->sequence.store(2 * _next - 1, std::memory_order_relaxed);
+    // the readers see the odd sequence before any of the new payload
+    std::atomic_thread_fence(std::memory_order_release);
+    slot->size = (uint32_t)size;
+    std::memcpy((char*)(slot + 1), data, size);
+    slot->sequence.store(2 * _next, std::memory_order_release);
+    ((header_t*)_map)->written.store(_next, std::memory_order_release);
+    ++_next;
+    return true;
+}
+
+void writer::notify()
+{
+#ifdef linux
+    const uint64_t one = 1;
+    for (auto event_fd : _readers) {
+        // only fails when a reader hasn't read the counter for 2^64 quanta
+        (void)!::write(event_fd, &one, sizeof(one));
+    }
+#endif
+}
+
+int writer::add_reader()
+{
+#ifdef linux
+    int event_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    if (event_fd < 0) {
+        throw std::system_error(errno, std::system_category(), "eventfd");
+    }
+    _readers.push_back(event_fd);
+    return event_fd;
+#else
+    throw std::system_error(std::make_error_code(std::errc::function_not_supported), "eventfd");
+#endif
+}
+
+void writer::remove_reader(int event_fd)
+{
+    auto it = std::find(_readers.begin(), _readers.end(), event_fd);
+    if (it == _readers.end()) {
+        return;
+    }
+    _readers.erase(it);
+#ifdef linux
+    close(event_fd);
+#endif
+}
+
+reader::reader(int fd)
+    : _fd(fd)
+{
+#ifdef linux
+    struct stat st {};
+    if (fstat(fd, &st) != 0) {
+        auto error = errno;
+        close(fd);
+        throw std::system_error(error, std::system_category(), "fstat");
+    }
+    _map_size = (size_t)st.st_size;
+    if (_map_size < header_size) {
+        close(fd);
+        throw std::runtime_error("shared memory ring too small");
+    }
+    _map = (const char*)mmap(nullptr, _map_size, PROT_READ, MAP_SHARED, fd, 0);
+    if (_map == MAP_FAILED) {
+        auto error = errno;
+        _map = nullptr;
+        close(fd);
+        throw std::system_error(error, std::system_category(), "mmap");
+    }
+    auto header = (const header_t*)_map;
+    _slots = header->slots;
+    _slot_size = header->slot_size;
+    if (header->magic != magic || header->version != version || !_slots || header_size + _slots * slot_stride(_slot_size) > _map_size) {
+        munmap((void*)_map, _map_size);
+        close(fd);
+        throw std::runtime_error("not a shared memory ring");
+    }
+    _buffer.resize(_slot_size);
+    // start with the next datagram
+    _next = header->written.load(std::memory_order_acquire) + 1;
+#else
+    throw std::system_error(std::make_error_code(std::errc::function_not_supported), "mmap");
+#endif
+}
+
+reader::~reader()
+{
+#ifdef linux
+    if (_map) {
+        munmap((void*)_map, _map_size);
+    }
+    close(_fd);
+#endif
+}
+
+size_t reader::read(const handler_t& handler)
+{
+    auto written = ((const header_t*)_map)->written.load(std::memory_order_acquire);
+    if (written >= _next + _slots) {
+        // lapped, the oldest slots are gone
+        _overruns += written - _slots + 1 - _next;
+        _next = written - _slots + 1;
+    }
+
+    size_t count = 0;
+    for (; _next <= written; ++_next) {
+        auto slot = slot_at(_map, _slots, _slot_size, _next);
+        if (slot->sequence.load(std::memory_order_acquire) != 2 * _next) {
+            ++_overruns;
+            continue;
+        }
+        const size_t size = slot->size;
+        if (size > _slot_size) {
+            ++_overruns;
+            continue;
+        }
+        std::memcpy(_buffer.data(), slot + 1, size);
+        // the writer may have started on the slot again while it was copied
+        std::atomic_thread_fence(std::memory_order_acquire);
+        if (slot->sequence.load(std::memory_order_relaxed) != 2 * _next) {
+            ++_overruns;
+            continue;
+        }
+        handler(_buffer.data(), size);
+        ++count;
+    }
+    return count;
+}
+
+} // namespace shm_ring
@@ -0,0 +1,115 @@
+/*
+   Copyright 2022-2024 mkckr0 <https://github.com/mkckr0>
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+*/
+
+#ifndef SHM_RING_HPP
+#define SHM_RING_HPP
+
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <vector>
+
+// Ring of audio datagrams in shared memory for the clients on the same host,
+// Linux only. The server copies every datagram once into the next slot of a
+// memfd, and any number of readers in other processes map it and copy the
+// slots out, without a system call per datagram.
+//
+// Nobody waits for anybody: the sequence number of a slot is odd while it's
+// written, so a reader that fell a whole ring behind, or whose slot was
+// written again while it read it, notices and counts an overrun. The writer
+// wakes every reader with its own eventfd once per quantum.
+//
+// header: magic "ASHR" | version u32 | slots u32 | slot size u32 | written u64
+// slot:   sequence u64, 2n when datagram n is complete | size u32 | payload
+namespace shm_ring {
+
+constexpr uint32_t magic = 0x52485341; // "ASHR"
+constexpr uint32_t version = 1;
+
+class writer {
+public:
+    struct config {
+        size_t slots = 512; // a few seconds of audio at 10ms quanta and 1 to 4 datagrams each
+        size_t slot_size = 2048; // the largest datagram
+    };
+
+    // Throws std::system_error when the memfd can't be created.
+    explicit writer(const config& config);
+    ~writer();
+
+    writer(const writer&) = delete;
+    writer& operator=(const writer&) = delete;
+
+    // The methods below are only called by the network thread.
+
+    // Copy a datagram into the next slot. Returns false when it doesn't fit.
+    bool write(const void* data, size_t size);
+    // Wake the readers, once after the datagrams of a quantum.
+    void notify();
+    // A new eventfd that notify writes, owned by the writer until
+    // remove_reader. Throws std::system_error.
+    int add_reader();
+    void remove_reader(int event_fd);
+
+    int fd() const { return _fd; }
+    size_t readers() const { return _readers.size(); }
+
+private:
+    int _fd = -1;
+    size_t _map_size = 0;
+    char* _map = nullptr;
+    size_t _slots = 0;
+    size_t _slot_size = 0;
+    uint64_t _next = 1; // the sequence number of the next datagram
+    std::vector<int> _readers; // eventfds
+};
+
+class reader {
+public:
+    using handler_t = std::function<void(const char* data, size_t size)>;
+
+    // Map the ring of a writer read-only, the reader owns the fd. Throws
+    // std::system_error if it can't be mapped, std::runtime_error if it
+    // isn't a ring.
+    explicit reader(int fd);
+    ~reader();
+
+    reader(const reader&) = delete;
+    reader& operator=(const reader&) = delete;
+
+    // Call handler with every datagram written since the last call. Each one
+    // is copied to a buffer of the reader first, and a datagram the writer
+    // overwrote while it was copied is counted in overruns instead of handed
+    // to the handler. The data is valid until the handler returns. Returns
+    // the number of datagrams read without an overrun.
+    size_t read(const handler_t& handler);
+
+    uint64_t overruns() const { return _overruns; }
+
+private:
+    int _fd = -1;
+    size_t _map_size = 0;
+    const char* _map = nullptr;
+    size_t _slots = 0;
+    size_t _slot_size = 0;
+    uint64_t _next = 1;
+    uint64_t _overruns = 0;
+    std::vector<char> _buffer; // one slot, the copy the handler reads
+};
+
+} // namespace shm_ring
+
+#endif // !SHM_RING_HPP
@@ -0,0 +1,80 @@
+/*
+   Copyright 2022-2024 mkckr0 <https://github.com/mkckr0>
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+*/
+
+#ifndef SPSC_QUEUE_HPP
+#define SPSC_QUEUE_HPP
+
+#include <algorithm>
+#include <atomic>
+#include <bit>
+#include <cstddef>
+#include <memory>
+
+// Bounded lock-free queue for one producer thread and one consumer thread.
+// Neither side ever blocks or allocates, a full queue refuses the push.
+template <typename T>
+class spsc_queue {
+public:
+    // capacity is rounded up to a power of two
+    explicit spsc_queue(size_t capacity)
+        : _capacity(std::bit_ceil(std::max<size_t>(capacity, 1)))
+        , _items(std::make_unique<T[]>(_capacity))
+    {
+    }
+
+    spsc_queue(const spsc_queue&) = delete;
+    spsc_queue& operator=(const spsc_queue&) = delete;
+
+    bool try_push(T item)
+    {
+        auto tail = _tail.load(std::memory_order_relaxed);
+        if (tail - _head.load(std::memory_order_acquire) == _capacity) {
+            return false;
+        }
+        _items[tail & (_capacity - 1)] = std::move(item);
+        _tail.store(tail + 1, std::memory_order_release);
+        return true;
+    }
+
+    bool try_pop(T& item)
+    {
+        auto head = _head.load(std::memory_order_relaxed);
+        if (head == _tail.load(std::memory_order_acquire)) {
+            return false;
+        }
+        item = std::move(_items[head & (_capacity - 1)]);
+        _head.store(head + 1, std::memory_order_release);
+        return true;
+    }
+
+    // Approximate when called from a third thread, e.g. by the metrics exporter.
+    size_t size() const
+    {
+        // head first, the tail can't fall behind a head read earlier
+        auto head = _head.load(std::memory_order_acquire);
+        return _tail.load(std::memory_order_acquire) - head;
+    }
+
+    size_t capacity() const { return _capacity; }
+
+private:
+    const size_t _capacity;
+    std::unique_ptr<T[]> _items;
+    alignas(64) std::atomic<size_t> _head { 0 };
+    alignas(64) std::atomic<size_t> _tail { 0 };
+};
+
+#endif // !SPSC_QUEUE_HPP
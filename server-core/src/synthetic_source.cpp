@@ -0,0 +1,81 @@
+/*
+   Copyright 2022-2024 mkckr0 <https://github.com/mkckr0>
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+*/
+
+#include "synthetic_source.hpp"
+#include "packetizer.hpp"
+#include "sample_convert.hpp"
+#include "tracer.hpp"
+
+#include <cmath>
+#include <cstring>
+#include <numbers>
+
+synthetic_source::synthetic_source(const AudioFormat& format, std::chrono::microseconds period)
+    : _format(format)
+    , _period(period)
+{
+    _block_align = sample_convert::bytes_per_sample(_format.encoding()) * _format.channels();
+    _max_seg_size = packetizer::max_segment_size(_block_align);
+    _frames = (size_t)((int64_t)_format.sample_rate() * _period.count() / 1000000);
+    _signal.resize(_frames * _format.channels());
+    _quantum.resize(_frames * _block_align);
+}
+
+const std::vector<char>& synthetic_source::next_quantum(pipeline_clock::time_point now)
+{
+    // 440Hz at -6dB
+    const int channels = _format.channels();
+    const double step = 2.0 * std::numbers::pi * 440.0 / _format.sample_rate();
+    for (size_t i = 0; i < _frames; ++i) {
+        auto v = (float)(0.5 * std::sin(step * (double)(_frame_pos + i)));
+        for (int c = 0; c < channels; ++c) {
+            _signal[i * channels + c] = v;
+        }
+    }
+    _frame_pos += _frames;
+
+    {
+        tracer::scope trace("capture", "convert");
+        sample_convert::convert(AudioFormat::ENCODING_PCM_FLOAT, _signal.data(), _format.encoding(), _quantum.data(), _signal.size());
+    }
+
+    if (_max_seg_size >= (int)probe_size) {
+        const uint64_t timestamp_ns = std::chrono::duration_cast<std::chrono::nanoseconds>(now.time_since_epoch()).count();
+        for (size_t pos = 0; pos + probe_size <= _quantum.size(); pos += _max_seg_size) {
+            const uint32_t seq = _seq++;
+            char* p = _quantum.data() + pos;
+            std::memcpy(p, &probe_magic, 4);
+            std::memcpy(p + 4, &seq, 4);
+            std::memcpy(p + 8, &timestamp_ns, 8);
+        }
+    }
+    return _quantum;
+}
+
+bool synthetic_source::read_probe(const char* data, size_t size, probe_t& probe)
+{
+    uint32_t magic = 0;
+    if (size < probe_size) {
+        return false;
+    }
+    std::memcpy(&magic, data, 4);
+    if (magic != probe_magic) {
+        return false;
+    }
+    std::memcpy(&probe.seq, data + 4, 4);
+    std::memcpy(&probe.timestamp_ns, data + 8, 8);
+    return true;
+}
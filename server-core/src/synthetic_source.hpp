@@ -0,0 +1,65 @@
+/*
+   Copyright 2022-2024 mkckr0 <https://github.com/mkckr0>
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+*/
+
+#ifndef SYNTHETIC_SOURCE_HPP
+#define SYNTHETIC_SOURCE_HPP
+
+#include <chrono>
+#include <cstdint>
+#include <vector>
+
+#include "client.pb.h"
+#include "pipeline_clock.hpp"
+
+// Generates a sine test signal in place of a captured endpoint. The first
+// bytes of every UDP segment are overwritten by a probe carrying a sequence
+// number and the generation time, so that receivers can measure loss,
+// reordering and latency.
+class synthetic_source {
+public:
+    using AudioFormat = io::github::mkckr0::audio_share_app::pb::AudioFormat;
+
+    struct probe_t {
+        uint32_t seq = 0;
+        uint64_t timestamp_ns = 0; // pipeline_clock, same as steady_clock in real time
+    };
+
+    static constexpr uint32_t probe_magic = 0x52505341; // "ASPR"
+    static constexpr size_t probe_size = 16;
+
+    synthetic_source(const AudioFormat& format, std::chrono::microseconds period);
+
+    int block_align() const { return _block_align; }
+    std::chrono::microseconds period() const { return _period; }
+
+    // Fill the next quantum. The returned buffer stays valid until the next call.
+    const std::vector<char>& next_quantum(pipeline_clock::time_point now);
+
+    static bool read_probe(const char* data, size_t size, probe_t& probe);
+
+private:
+    AudioFormat _format;
+    std::chrono::microseconds _period;
+    int _block_align = 0;
+    int _max_seg_size = 0;
+    size_t _frames = 0;
+    uint64_t _frame_pos = 0;
+    uint32_t _seq = 0;
+    std::vector<float> _signal;
+    std::vector<char> _quantum;
+};
+
+#endif // !SYNTHETIC_SOURCE_HPP
@@ -0,0 +1,230 @@
+/*
+   Copyright 2022-2024 mkckr0 <https://github.com/mkckr0>
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+*/
+
+#include "thread_util.hpp"
+
+#include <algorithm>
+#include <charconv>
+#include <cstring>
+#include <stdexcept>
+
+#include <fmt/format.h>
+#include <fmt/ranges.h>
+#include <spdlog/spdlog.h>
+
+#ifdef _WINDOWS
+#define NOMINMAX
+#include <Windows.h>
+#endif
+
+#ifdef linux
+#include <pthread.h>
+#include <sched.h>
+#include <time.h>
+#endif
+
+namespace thread_util {
+
+#ifdef _WINDOWS
+static std::chrono::nanoseconds cpu_time(HANDLE handle)
+{
+    FILETIME creation_time, exit_time, kernel_time, user_time;
+    if (!GetThreadTimes(handle, &creation_time, &exit_time, &kernel_time, &user_time)) {
+        return {};
+    }
+    auto to_100ns = [](const FILETIME& t) {
+        return (uint64_t)t.dwHighDateTime << 32 | t.dwLowDateTime;
+    };
+    return std::chrono::nanoseconds((to_100ns(kernel_time) + to_100ns(user_time)) * 100);
+}
+#endif
+
+#ifdef linux
+static std::chrono::nanoseconds cpu_time(clockid_t clock_id)
+{
+    struct timespec ts {};
+    if (clock_gettime(clock_id, &ts) != 0) {
+        return {};
+    }
+    return std::chrono::seconds(ts.tv_sec) + std::chrono::nanoseconds(ts.tv_nsec);
+}
+#endif
+
+std::chrono::nanoseconds cpu_time(std::thread& thread)
+{
+    if (!thread.joinable()) {
+        return {};
+    }
+#ifdef _WINDOWS
+    return cpu_time((HANDLE)thread.native_handle());
+#endif
+#ifdef linux
+    clockid_t clock_id;
+    if (pthread_getcpuclockid(thread.native_handle(), &clock_id) != 0) {
+        return {};
+    }
+    return cpu_time(clock_id);
+#endif
+}
+
+std::chrono::nanoseconds current_cpu_time()
+{
+#ifdef _WINDOWS
+    return cpu_time(GetCurrentThread());
+#endif
+#ifdef linux
+    return cpu_time(CLOCK_THREAD_CPUTIME_ID);
+#endif
+}
+
+std::vector<int> thread_policy::parse_cpus(std::string_view spec)
+{
+    auto to_int = [&](std::string_view s) {
+        int value = -1;
+        auto [end, ec] = std::from_chars(s.data(), s.data() + s.size(), value);
+        if (ec != std::errc() || end != s.data() + s.size() || value < 0) {
+            throw std::invalid_argument("bad cpu list: " + std::string(spec));
+        }
+        return value;
+    };
+
+    std::vector<int> cpus;
+    while (!spec.empty()) {
+        auto comma = spec.find(',');
+        auto item = spec.substr(0, comma);
+        spec = comma == std::string_view::npos ? std::string_view() : spec.substr(comma + 1);
+
+        auto dash = item.find('-');
+        if (dash == std::string_view::npos) {
+            cpus.push_back(to_int(item));
+            continue;
+        }
+        auto first = to_int(item.substr(0, dash));
+        auto last = to_int(item.substr(dash + 1));
+        if (first > last) {
+            throw std::invalid_argument("bad cpu range: " + std::string(item));
+        }
+        for (int cpu = first; cpu <= last; ++cpu) {
+            cpus.push_back(cpu);
+        }
+    }
+    std::sort(cpus.begin(), cpus.end());
+    cpus.erase(std::unique(cpus.begin(), cpus.end()), cpus.end());
+    return cpus;
+}
+
+void set_affinity(std::thread::native_handle_type thread, const std::vector<int>& cpus, const char* name)
+{
+    if (cpus.empty()) {
+        return;
+    }
+#ifdef _WINDOWS
+    DWORD_PTR mask = 0;
+    for (int cpu : cpus) {
+        if (cpu < (int)sizeof(mask) * 8) {
+            mask |= (DWORD_PTR)1 << cpu;
+        }
+    }
+    if (!SetThreadAffinityMask((HANDLE)thread, mask)) {
+        spdlog::warn("failed to pin the {} thread to cpus {}, error {}", name, fmt::join(cpus, ","), GetLastError());
+    }
+#endif
+#ifdef linux
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    for (int cpu : cpus) {
+        if (cpu < CPU_SETSIZE) {
+            CPU_SET(cpu, &set);
+        }
+    }
+    if (int err = pthread_setaffinity_np(thread, sizeof(set), &set)) {
+        spdlog::warn("failed to pin the {} thread to cpus {}: {}", name, fmt::join(cpus, ","), std::strerror(err));
+    }
+#endif
+}
+
+void apply(const thread_policy& policy, const char* name)
+{
+#ifdef _WINDOWS
+    set_affinity(GetCurrentThread(), policy.cpus, name);
+    if (policy.realtime_priority > 0 && !SetThreadPriority(GetCurrentThread(), THREAD_PRIORITY_TIME_CRITICAL)) {
+        spdlog::warn("failed to raise the {} thread priority, error {}", name, GetLastError());
+    }
+#endif
+#ifdef linux
+    set_affinity(pthread_self(), policy.cpus, name);
+    if (policy.realtime_priority > 0) {
+        sched_param param {};
+        param.sched_priority = std::clamp(policy.realtime_priority, sched_get_priority_min(SCHED_FIFO), sched_get_priority_max(SCHED_FIFO));
+        if (int err = pthread_setschedparam(pthread_self(), SCHED_FIFO, &param)) {
+            spdlog::warn("failed to set SCHED_FIFO priority {} for the {} thread: {}. It needs CAP_SYS_NICE or an rtprio limit, "
+                         "e.g. \"@audio - rtprio 95\" in /etc/security/limits.conf",
+                param.sched_priority, name, std::strerror(err));
+        }
+    }
+#endif
+    spdlog::info("{} thread: {}", name, describe_current());
+}
+
+std::string describe(std::thread::native_handle_type thread)
+{
+#ifdef _WINDOWS
+    DWORD_PTR process_mask = 0, system_mask = 0;
+    GetProcessAffinityMask(GetCurrentProcess(), &process_mask, &system_mask);
+    // SetThreadAffinityMask returns the previous mask, set it back unchanged
+    auto mask = SetThreadAffinityMask((HANDLE)thread, process_mask);
+    if (mask) {
+        SetThreadAffinityMask((HANDLE)thread, mask);
+    }
+    std::vector<int> cpus;
+    for (int cpu = 0; cpu < (int)sizeof(mask) * 8; ++cpu) {
+        if (mask & ((DWORD_PTR)1 << cpu)) {
+            cpus.push_back(cpu);
+        }
+    }
+    return fmt::format("priority {}, cpus {}", GetThreadPriority((HANDLE)thread), fmt::join(cpus, ","));
+#endif
+#ifdef linux
+    int policy = 0;
+    sched_param param {};
+    pthread_getschedparam(thread, &policy, &param);
+    const char* policy_name = policy == SCHED_FIFO ? "SCHED_FIFO" : policy == SCHED_RR ? "SCHED_RR" : "SCHED_OTHER";
+
+    std::vector<int> cpus;
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    if (pthread_getaffinity_np(thread, sizeof(set), &set) == 0) {
+        for (int cpu = 0; cpu < CPU_SETSIZE; ++cpu) {
+            if (CPU_ISSET(cpu, &set)) {
+                cpus.push_back(cpu);
+            }
+        }
+    }
+    return fmt::format("{} priority {}, cpus {}", policy_name, param.sched_priority, fmt::join(cpus, ","));
+#endif
+}
+
+std::string describe_current()
+{
+#ifdef _WINDOWS
+    return describe(GetCurrentThread());
+#endif
+#ifdef linux
+    return describe(pthread_self());
+#endif
+}
+
+} // namespace thread_util
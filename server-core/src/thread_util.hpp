@@ -0,0 +1,64 @@
+/*
+   Copyright 2022-2024 mkckr0 <https://github.com/mkckr0>
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+*/
+
+#ifndef THREAD_UTIL_HPP
+#define THREAD_UTIL_HPP
+
+#include <chrono>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <vector>
+
+namespace thread_util {
+
+// Scheduling of a pipeline thread. The defaults leave the thread as created.
+struct thread_policy {
+    std::vector<int> cpus; // empty keeps the inherited affinity
+    // 1-99 requests SCHED_FIFO with this priority on Linux and a time critical
+    // thread priority on Windows, 0 keeps the default policy
+    int realtime_priority = 0;
+
+    // Parse a CPU list like "2", "2,3" or "0-3,6".
+    // Throws std::invalid_argument on malformed input.
+    static std::vector<int> parse_cpus(std::string_view spec);
+};
+
+// Apply the policy to the calling thread, then log the policy and the CPUs the
+// thread really got. Failures are logged and the thread keeps running. Only
+// for threads the server owns.
+void apply(const thread_policy& policy, const char* name);
+
+// Pin a thread of the process to cpus, e.g. one owned by a library whose
+// scheduling is up to the library. Failures are logged, empty cpus keep the
+// affinity.
+void set_affinity(std::thread::native_handle_type thread, const std::vector<int>& cpus, const char* name);
+
+// The scheduling policy and the CPUs of a thread, for the log.
+std::string describe(std::thread::native_handle_type thread);
+
+// The scheduling policy and the CPUs of the calling thread, for the log.
+std::string describe_current();
+
+// CPU time consumed by a running thread. Returns 0 if it's unavailable.
+std::chrono::nanoseconds cpu_time(std::thread& thread);
+
+// CPU time consumed by the calling thread.
+std::chrono::nanoseconds current_cpu_time();
+
+} // namespace thread_util
+
+#endif // !THREAD_UTIL_HPP
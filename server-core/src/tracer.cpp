@@ -0,0 +1,266 @@
+/*
+   Copyright 2022-2024 mkckr0 <https://github.com/mkckr0>
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+*/
+
+#include "tracer.hpp"
+
+#include <algorithm>
+#include <fstream>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+#include <fmt/format.h>
+
+#ifdef _WINDOWS
+#define NOMINMAX
+#include <Windows.h>
+#endif
+
+#ifdef linux
+#include <unistd.h>
+#endif
+
+namespace tracer {
+
+std::atomic_bool g_enabled = false;
+
+namespace {
+
+enum class phase_t : uint8_t {
+    complete,
+    async,
+    instant,
+};
+
+struct event_t {
+    const char* category;
+    const char* name;
+    int64_t begin_ns;
+    int64_t end_ns;
+    uint64_t id;
+    phase_t phase;
+};
+
+// Written only by its thread. head counts every event ever written, the slot
+// of an event is its index modulo the capacity.
+struct thread_buffer {
+    thread_buffer(size_t capacity, uint32_t tid, uint64_t generation)
+        : events(std::make_unique<event_t[]>(capacity))
+        , capacity(capacity)
+        , tid(tid)
+        , generation(generation)
+    {
+    }
+
+    std::unique_ptr<event_t[]> events;
+    const size_t capacity;
+    const uint32_t tid;
+    const uint64_t generation;
+    std::atomic<uint64_t> head { 0 };
+    std::atomic<const char*> name { nullptr };
+};
+
+std::mutex g_mutex;
+std::vector<std::shared_ptr<thread_buffer>> g_buffers;
+size_t g_capacity = 0;
+uint32_t g_next_tid = 1;
+std::atomic<uint64_t> g_generation = 0;
+std::atomic<uint64_t> g_next_id = 1;
+
+thread_local std::shared_ptr<thread_buffer> t_buffer;
+thread_local const char* t_name = nullptr;
+
+thread_buffer& current_buffer()
+{
+    // start() drops the buffers by moving to a new generation
+    if (!t_buffer || t_buffer->generation != g_generation.load(std::memory_order_acquire)) {
+        std::lock_guard lock(g_mutex);
+        t_buffer = std::make_shared<thread_buffer>(g_capacity, g_next_tid++, g_generation.load(std::memory_order_relaxed));
+        t_buffer->name = t_name;
+        g_buffers.push_back(t_buffer);
+    }
+    return *t_buffer;
+}
+
+void push(const event_t& event)
+{
+    if (!enabled()) {
+        return;
+    }
+    auto& buffer = current_buffer();
+    auto head = buffer.head.load(std::memory_order_relaxed);
+    buffer.events[head % buffer.capacity] = event;
+    buffer.head.store(head + 1, std::memory_order_release);
+}
+
+int64_t to_ns(pipeline_clock::time_point t)
+{
+    return t.time_since_epoch().count();
+}
+
+unsigned long process_id()
+{
+#ifdef _WINDOWS
+    return GetCurrentProcessId();
+#endif
+#ifdef linux
+    return (unsigned long)getpid();
+#endif
+}
+
+void append_escaped(std::string& out, const char* s)
+{
+    for (; *s; ++s) {
+        if (*s == '"' || *s == '\\') {
+            out += '\\';
+        }
+        out += *s;
+    }
+}
+
+void append_event(std::string& out, unsigned long pid, uint32_t tid, const event_t& e)
+{
+    auto common = [&](char ph, int64_t ts_ns) {
+        out += fmt::format(R"({{"ph":"{}","cat":")", ph);
+        append_escaped(out, e.category);
+        out += R"(","name":")";
+        append_escaped(out, e.name);
+        out += fmt::format(R"(","pid":{},"tid":{},"ts":{:.3f})", pid, tid, (double)ts_ns / 1000.0);
+    };
+
+    switch (e.phase) {
+    case phase_t::complete:
+        common('X', e.begin_ns);
+        out += fmt::format(R"(,"dur":{:.3f}}},)", (double)(e.end_ns - e.begin_ns) / 1000.0);
+        break;
+    case phase_t::async:
+        common('b', e.begin_ns);
+        out += fmt::format(R"(,"id":"0x{:x}"}},)", e.id);
+        common('e', e.end_ns);
+        out += fmt::format(R"(,"id":"0x{:x}"}},)", e.id);
+        break;
+    case phase_t::instant:
+        common('i', e.begin_ns);
+        out += R"(,"s":"t"},)";
+        break;
+    }
+    out += '\n';
+}
+
+} // namespace
+
+void start(size_t events_per_thread)
+{
+    std::lock_guard lock(g_mutex);
+    g_buffers.clear();
+    g_capacity = events_per_thread ? events_per_thread : 1;
+    g_generation.fetch_add(1, std::memory_order_release);
+    g_enabled = true;
+}
+
+void stop()
+{
+    g_enabled = false;
+}
+
+std::string to_json()
+{
+    stop();
+
+    std::vector<std::shared_ptr<thread_buffer>> buffers;
+    {
+        std::lock_guard lock(g_mutex);
+        buffers = g_buffers;
+    }
+
+    const auto pid = process_id();
+    std::string out = "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n";
+    std::vector<event_t> events;
+    for (auto& buffer : buffers) {
+        if (auto name = buffer->name.load()) {
+            out += fmt::format(R"({{"ph":"M","name":"thread_name","pid":{},"tid":{},"args":{{"name":")", pid, buffer->tid);
+            append_escaped(out, name);
+            out += "\"}},\n";
+        }
+
+        // a thread that recorded its last event just before stop() may still
+        // overwrite the oldest slots, those are dropped after the copy
+        auto head = buffer->head.load(std::memory_order_acquire);
+        auto first = head > buffer->capacity ? head - buffer->capacity : 0;
+        events.clear();
+        for (auto i = first; i < head; ++i) {
+            events.push_back(buffer->events[i % buffer->capacity]);
+        }
+        auto overwritten = buffer->head.load(std::memory_order_acquire);
+        overwritten = overwritten > buffer->capacity ? overwritten - buffer->capacity : 0;
+        for (auto i = std::max(first, overwritten); i < head; ++i) {
+            append_event(out, pid, buffer->tid, events[i - first]);
+        }
+    }
+
+    // every event ends with a comma, close the array with the process name
+    out += R"({"ph":"M","name":"process_name","pid":)" + std::to_string(pid) + R"(,"args":{"name":"audio-share"}}]})";
+    out += '\n';
+    return out;
+}
+
+bool write(const std::string& path)
+{
+    std::ofstream file(path, std::ios::binary | std::ios::trunc);
+    if (!file) {
+        return false;
+    }
+    file << to_json();
+    return (bool)file;
+}
+
+void set_thread_name(const char* name)
+{
+    if (t_name) {
+        return;
+    }
+    t_name = name;
+    if (t_buffer) {
+        t_buffer->name = name;
+    }
+}
+
+const char* thread_name()
+{
+    return t_name;
+}
+
+uint64_t next_id()
+{
+    return g_next_id.fetch_add(1, std::memory_order_relaxed);
+}
+
+void complete(const char* category, const char* name, pipeline_clock::time_point begin, pipeline_clock::time_point end)
+{
+    push({ category, name, to_ns(begin), to_ns(end), 0, phase_t::complete });
+}
+
+void async(const char* category, const char* name, uint64_t id, pipeline_clock::time_point begin, pipeline_clock::time_point end)
+{
+    push({ category, name, to_ns(begin), to_ns(end), id, phase_t::async });
+}
+
+void instant(const char* category, const char* name, pipeline_clock::time_point time)
+{
+    push({ category, name, to_ns(time), to_ns(time), 0, phase_t::instant });
+}
+
+} // namespace tracer
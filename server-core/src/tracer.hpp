@@ -0,0 +1,96 @@
+/*
+   Copyright 2022-2024 mkckr0 <https://github.com/mkckr0>
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+*/
+
+#ifndef TRACER_HPP
+#define TRACER_HPP
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+#include "pipeline_clock.hpp"
+
+// Records the stages of every audio quantum (capture, conversion,
+// packetization, the post to the io_context, the sends and the client side)
+// and exports them in the Chrome trace event format, which Perfetto and
+// chrome://tracing open.
+//
+// Every thread writes to its own ring buffer without locks, so only the
+// newest events_per_thread events of each thread are kept. When tracing is
+// off, recording an event costs a relaxed load. Names and categories must be
+// string literals, the buffers only keep the pointers.
+namespace tracer {
+
+extern std::atomic_bool g_enabled;
+
+inline bool enabled() { return g_enabled.load(std::memory_order_relaxed); }
+
+// Drop the recorded events and start recording.
+void start(size_t events_per_thread = 1 << 16);
+void stop();
+
+// Stop and write the recorded events as Chrome trace JSON. Events that a
+// thread is still writing while this runs are skipped.
+std::string to_json();
+bool write(const std::string& path);
+
+// Name of the calling thread in the trace, the first call wins.
+void set_thread_name(const char* name);
+// Name of the calling thread, nullptr if it was never set.
+const char* thread_name();
+
+// An id that pairs the async events of one quantum across threads.
+uint64_t next_id();
+
+// A span on the calling thread.
+void complete(const char* category, const char* name, pipeline_clock::time_point begin, pipeline_clock::time_point end);
+// A span that may begin on another thread or in another process, e.g. from
+// the post on the capture thread to the handler on the network thread.
+void async(const char* category, const char* name, uint64_t id, pipeline_clock::time_point begin, pipeline_clock::time_point end);
+void instant(const char* category, const char* name, pipeline_clock::time_point time);
+
+// Records a complete event from construction to destruction.
+class scope {
+public:
+    scope(const char* category, const char* name)
+        : _category(category)
+        , _name(enabled() ? name : nullptr)
+    {
+        if (_name) {
+            _begin = pipeline_clock::now();
+        }
+    }
+
+    ~scope()
+    {
+        if (_name) {
+            complete(_category, _name, _begin, pipeline_clock::now());
+        }
+    }
+
+    scope(const scope&) = delete;
+    scope& operator=(const scope&) = delete;
+
+private:
+    const char* _category;
+    const char* _name;
+    pipeline_clock::time_point _begin;
+};
+
+} // namespace tracer
+
+#endif // !TRACER_HPP
@@ -0,0 +1,430 @@
+/*
+   Copyright 2022-2024 mkckr0 <https://github.com/mkckr0>
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+*/
+
+#include "uring_sender.hpp"
+#include "metrics.hpp"
+#include "tracer.hpp"
+
+#include <algorithm>
+#include <bit>
+#include <cerrno>
+#include <cstring>
+#include <system_error>
+
+#include <spdlog/spdlog.h>
+
+#ifdef linux
+#include <linux/io_uring.h>
+#include <netinet/in.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <unistd.h>
+#endif
+
+#ifdef linux
+
+namespace {
+
+// user_data of the nop that stops the reaper
+constexpr uint64_t stop_user_data = ~(uint64_t)0;
+
+int io_uring_setup(unsigned entries, io_uring_params* params)
+{
+    return (int)syscall(__NR_io_uring_setup, entries, params);
+}
+
+int io_uring_enter(int fd, unsigned to_submit, unsigned min_complete, unsigned flags)
+{
+    return (int)syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, nullptr, 0);
+}
+
+int io_uring_register(int fd, unsigned opcode, const void* arg, unsigned nr_args)
+{
+    return (int)syscall(__NR_io_uring_register, fd, opcode, arg, nr_args);
+}
+
+template <typename T>
+std::atomic_ref<T> shared(T* value)
+{
+    return std::atomic_ref<T>(*value);
+}
+
+} // namespace
+
+// The rings shared with the kernel, see io_uring_setup(2).
+struct uring_sender::ring_t {
+    int fd = -1;
+    io_uring_params params {};
+    void* sq_ptr = MAP_FAILED;
+    size_t sq_size = 0;
+    void* cq_ptr = MAP_FAILED;
+    size_t cq_size = 0;
+    io_uring_sqe* sqes = (io_uring_sqe*)MAP_FAILED;
+    size_t sqes_size = 0;
+
+    unsigned* sq_tail = nullptr;
+    unsigned* sq_mask = nullptr;
+    unsigned* cq_head = nullptr;
+    unsigned* cq_tail = nullptr;
+    unsigned* cq_mask = nullptr;
+    io_uring_cqe* cqes = nullptr;
+
+    explicit ring_t(unsigned entries)
+    {
+        fd = io_uring_setup(entries, &params);
+        if (fd < 0) {
+            throw std::system_error(errno, std::system_category(), "io_uring_setup");
+        }
+
+        sq_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+        cq_size = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+        const bool single_mmap = params.features & IORING_FEAT_SINGLE_MMAP;
+        if (single_mmap) {
+            sq_size = cq_size = std::max(sq_size, cq_size);
+        }
+        sq_ptr = mmap(nullptr, sq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+        if (sq_ptr == MAP_FAILED) {
+            throw std::system_error(errno, std::system_category(), "mmap sq ring");
+        }
+        if (single_mmap) {
+            cq_ptr = sq_ptr;
+        } else {
+            cq_ptr = mmap(nullptr, cq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+            if (cq_ptr == MAP_FAILED) {
+                throw std::system_error(errno, std::system_category(), "mmap cq ring");
+            }
+        }
+        sqes_size = params.sq_entries * sizeof(io_uring_sqe);
+        sqes = (io_uring_sqe*)mmap(nullptr, sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+        if (sqes == MAP_FAILED) {
+            throw std::system_error(errno, std::system_category(), "mmap sqes");
+        }
+
+        auto sq = (char*)sq_ptr;
+        sq_tail = (unsigned*)(sq + params.sq_off.tail);
+        sq_mask = (unsigned*)(sq + params.sq_off.ring_mask);
+        // the sqe at index i always goes to slot i
+        auto sq_array = (unsigned*)(sq + params.sq_off.array);
+        for (unsigned i = 0; i < params.sq_entries; ++i) {
+            sq_array[i] = i;
+        }
+
+        auto cq = (char*)cq_ptr;
+        cq_head = (unsigned*)(cq + params.cq_off.head);
+        cq_tail = (unsigned*)(cq + params.cq_off.tail);
+        cq_mask = (unsigned*)(cq + params.cq_off.ring_mask);
+        cqes = (io_uring_cqe*)(cq + params.cq_off.cqes);
+    }
+
+    ~ring_t()
+    {
+        if (sqes != MAP_FAILED) {
+            munmap(sqes, sqes_size);
+        }
+        if (cq_ptr != MAP_FAILED && cq_ptr != sq_ptr) {
+            munmap(cq_ptr, cq_size);
+        }
+        if (sq_ptr != MAP_FAILED) {
+            munmap(sq_ptr, sq_size);
+        }
+        if (fd >= 0) {
+            close(fd);
+        }
+    }
+
+    // Only called by one thread at a time. Returns nullptr when queued sqes fill the ring.
+    io_uring_sqe* next_sqe(unsigned queued)
+    {
+        if (queued == params.sq_entries) {
+            return nullptr;
+        }
+        auto tail = shared(sq_tail).load(std::memory_order_relaxed);
+        auto sqe = &sqes[tail & *sq_mask];
+        std::memset(sqe, 0, sizeof(*sqe));
+        return sqe;
+    }
+
+    void commit_sqe()
+    {
+        auto tail = shared(sq_tail).load(std::memory_order_relaxed);
+        shared(sq_tail).store(tail + 1, std::memory_order_release);
+    }
+};
+
+// One sendmsg in flight. The kernel reads msg, iov and addr when it issues the
+// send, so they live here until the completion.
+struct uring_sender::op_t {
+    msghdr msg {};
+    iovec iov {};
+    sockaddr_storage addr {};
+    uint32_t buffer = 0;
+    std::shared_ptr<void> context;
+};
+
+#else
+
+struct uring_sender::ring_t {
+};
+
+struct uring_sender::op_t {
+    uint32_t buffer = 0;
+    std::shared_ptr<void> context;
+};
+
+#endif // linux
+
+bool uring_sender::supported()
+{
+#ifdef linux
+    try {
+        ring_t ring(2);
+        constexpr unsigned op_count = 256;
+        std::vector<char> storage(sizeof(io_uring_probe) + op_count * sizeof(io_uring_probe_op));
+        auto probe = (io_uring_probe*)storage.data();
+        if (io_uring_register(ring.fd, IORING_REGISTER_PROBE, probe, op_count) < 0) {
+            return false;
+        }
+        auto has = [probe](unsigned op) {
+            return op <= probe->last_op && (probe->ops[op].flags & IO_URING_OP_SUPPORTED);
+        };
+        return has(IORING_OP_SENDMSG) && has(IORING_OP_NOP);
+    } catch (const std::system_error&) {
+        return false;
+    }
+#else
+    return false;
+#endif
+}
+
+uring_sender::uring_sender(int fd, const config& config, completion_fn on_complete, reaped_fn on_reaped)
+    : _config(config)
+    , _on_complete(std::move(on_complete))
+    , _on_reaped(std::move(on_reaped))
+    , _reaped_ops(2 * std::bit_ceil(std::max(config.entries, 1u)))
+{
+#ifdef linux
+    _ring = std::make_unique<ring_t>(std::max(_config.entries, 1u));
+
+    if (io_uring_register(_ring->fd, IORING_REGISTER_FILES, &fd, 1) < 0) {
+        throw std::system_error(errno, std::system_category(), "io_uring register the socket");
+    }
+
+    _config.buffers = std::max<size_t>(_config.buffers, 1);
+    _buffers = std::make_unique<buffer_t[]>(_config.buffers);
+    _free_buffers.reserve(_config.buffers);
+    for (size_t i = _config.buffers; i > 0; --i) {
+        _free_buffers.push_back((uint32_t)(i - 1));
+    }
+
+    // the completion queue holds every send in flight, so it never overflows
+    const auto op_count = _ring->params.cq_entries;
+    _ops = std::make_unique<op_t[]>(op_count);
+    _free_ops.reserve(op_count);
+    for (uint32_t i = op_count; i > 0; --i) {
+        _free_ops.push_back(i - 1);
+    }
+
+    _reaper = std::thread([this] {
+        reaper_loop();
+    });
+    spdlog::info("io_uring sender: {} entries, {} datagrams in flight", _ring->params.sq_entries, _config.buffers);
+#else
+    throw std::system_error(std::make_error_code(std::errc::function_not_supported), "io_uring");
+#endif
+}
+
+uring_sender::~uring_sender()
+{
+#ifdef linux
+    if (!_reaper.joinable()) {
+        return;
+    }
+    // a draining nop completes after every send before it, then the reaper exits
+    if (_ring->next_sqe(_queued) == nullptr) {
+        submit();
+    }
+    auto sqe = _ring->next_sqe(_queued);
+    sqe->opcode = IORING_OP_NOP;
+    sqe->flags = IOSQE_IO_DRAIN;
+    sqe->user_data = stop_user_data;
+    _ring->commit_sqe();
+    ++_queued;
+    submit();
+    _reaper.join();
+#endif
+}
+
+int uring_sender::acquire(const void* data, size_t size, std::shared_ptr<void> owner, std::shared_ptr<void> probe)
+{
+    if (_free_buffers.empty()) {
+        reclaim();
+        if (_free_buffers.empty()) {
+            return -1;
+        }
+    }
+    auto buffer = _free_buffers.back();
+    _free_buffers.pop_back();
+    auto& b = _buffers[buffer];
+    b.data = data;
+    b.size = size;
+    b.owner = std::move(owner);
+    b.probe = std::move(probe);
+    b.refs = 1;
+    return (int)buffer;
+}
+
+bool uring_sender::send_to(int buffer, const void* addr, uint32_t addr_len, std::shared_ptr<void> context)
+{
+#ifdef linux
+    if (addr_len > sizeof(sockaddr_storage)) {
+        return false;
+    }
+    auto sqe = _ring->next_sqe(_queued);
+    if (sqe == nullptr) {
+        submit();
+        sqe = _ring->next_sqe(_queued);
+        if (sqe == nullptr) {
+            return false;
+        }
+    }
+    if (_free_ops.empty()) {
+        reclaim();
+        if (_free_ops.empty()) {
+            return false;
+        }
+    }
+    auto index = _free_ops.back();
+    _free_ops.pop_back();
+
+    auto& b = _buffers[buffer];
+    ++b.refs;
+    auto& op = _ops[index];
+    op.buffer = (uint32_t)buffer;
+    op.context = std::move(context);
+    std::memcpy(&op.addr, addr, addr_len);
+    // the kernel reads the datagram where it is, the owner keeps it valid
+    op.iov = { const_cast<void*>(b.data), b.size };
+    op.msg = {};
+    op.msg.msg_name = &op.addr;
+    op.msg.msg_namelen = addr_len;
+    op.msg.msg_iov = &op.iov;
+    op.msg.msg_iovlen = 1;
+
+    sqe->opcode = IORING_OP_SENDMSG;
+    sqe->flags = IOSQE_FIXED_FILE;
+    sqe->fd = 0; // the index of the registered socket
+    sqe->addr = (uint64_t)(uintptr_t)&op.msg;
+    sqe->len = 1;
+    sqe->user_data = index;
+    _ring->commit_sqe();
+    ++_queued;
+    return true;
+#else
+    return false;
+#endif
+}
+
+void uring_sender::release(int buffer)
+{
+    unref((uint32_t)buffer);
+}
+
+void uring_sender::submit()
+{
+#ifdef linux
+    reclaim();
+    while (_queued) {
+        auto n = io_uring_enter(_ring->fd, _queued, 0, 0);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            // the sends stay queued for the next submit
+            spdlog::trace("io_uring_enter: {}", std::strerror(errno));
+            return;
+        }
+        _queued -= (unsigned)n;
+        metrics::get().uring_submits.inc();
+    }
+#endif
+}
+
+void uring_sender::reclaim()
+{
+    uint32_t index;
+    while (_reaped_ops.try_pop(index)) {
+        auto& op = _ops[index];
+        op.context = nullptr;
+        unref(op.buffer);
+        _free_ops.push_back(index);
+    }
+}
+
+void uring_sender::unref(uint32_t buffer)
+{
+    auto& b = _buffers[buffer];
+    if (--b.refs != 0) {
+        return;
+    }
+    b.data = nullptr;
+    b.owner = nullptr;
+    b.probe = nullptr;
+    _free_buffers.push_back(buffer);
+}
+
+void uring_sender::reaper_loop()
+{
+#ifdef linux
+    tracer::set_thread_name("uring reaper");
+    thread_util::apply(_config.reaper_thread, "uring reaper");
+
+    auto& ring = *_ring;
+    while (true) {
+        auto head = shared(ring.cq_head).load(std::memory_order_relaxed);
+        auto tail = shared(ring.cq_tail).load(std::memory_order_acquire);
+        if (head == tail) {
+            if (io_uring_enter(ring.fd, 0, 1, IORING_ENTER_GETEVENTS) < 0 && errno != EINTR) {
+                spdlog::error("io_uring_enter: {}, no more send completions", std::strerror(errno));
+                return;
+            }
+            continue;
+        }
+
+        bool stopped = false;
+        for (; head != tail; ++head) {
+            const auto& cqe = ring.cqes[head & *ring.cq_mask];
+            if (cqe.user_data == stop_user_data) {
+                stopped = true;
+                continue;
+            }
+            auto index = (uint32_t)cqe.user_data;
+            auto& op = _ops[index];
+            _on_complete(op.context.get(), op.iov.iov_len, cqe.res);
+            // the network thread releases the context and the datagram
+            _reaped_ops.try_push(index);
+        }
+        shared(ring.cq_head).store(head, std::memory_order_release);
+        if (stopped) {
+            return;
+        }
+        if (_on_reaped) {
+            _on_reaped();
+        }
+    }
+#endif
+}
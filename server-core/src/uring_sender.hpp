@@ -0,0 +1,111 @@
+/*
+   Copyright 2022-2024 mkckr0 <https://github.com/mkckr0>
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+*/
+
+#ifndef URING_SENDER_HPP
+#define URING_SENDER_HPP
+
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <thread>
+#include <vector>
+
+#include "spsc_queue.hpp"
+#include "thread_util.hpp"
+
+// Sends the datagrams of one UDP socket through io_uring, Linux only.
+//
+// The network thread pins every datagram in a slot of a fixed pool by
+// holding its owner, queues one send per destination that reads the
+// datagram where it is, and submits all the sends of a quantum with a single
+// system call. Nothing is copied. The socket is a registered file. A reaper
+// thread waits for the completions, so the network thread never blocks on
+// them, and hands the finished sends back through a lock-free queue. The
+// network thread releases their contexts and owners, so a peer or a segment
+// is never destroyed on the reaper thread.
+class uring_sender {
+public:
+    struct config {
+        unsigned entries = 256; // submission queue size, a bigger quantum is submitted in parts
+        size_t buffers = 256; // datagrams in flight
+        thread_util::thread_policy reaper_thread;
+    };
+
+    // Called on the reaper thread for every send. result is the number of
+    // bytes sent or a negative errno.
+    using completion_fn = std::function<void(void* context, size_t size, int result)>;
+    // Called on the reaper thread after it handed sends back, the owner then
+    // lets the network thread call reclaim().
+    using reaped_fn = std::function<void()>;
+
+    // Whether the kernel has io_uring with the operations the sender uses.
+    static bool supported();
+
+    // Throws std::system_error when the ring can't be set up.
+    uring_sender(int fd, const config& config, completion_fn on_complete, reaped_fn on_reaped = nullptr);
+    ~uring_sender();
+
+    uring_sender(const uring_sender&) = delete;
+    uring_sender& operator=(const uring_sender&) = delete;
+
+    // The methods below are only called by the network thread.
+
+    // Pin a datagram in a free slot. owner keeps data valid and is held,
+    // together with probe, until the last send of the datagram completed.
+    // Returns -1 when every slot is in flight.
+    int acquire(const void* data, size_t size, std::shared_ptr<void> owner, std::shared_ptr<void> probe = nullptr);
+    // Queue a send of the buffer to a sockaddr. context is passed to the
+    // completion and kept alive until then. Returns false when too many sends
+    // are in flight.
+    bool send_to(int buffer, const void* addr, uint32_t addr_len, std::shared_ptr<void> context);
+    // Drop the reference of acquire.
+    void release(int buffer);
+    // Submit the queued sends.
+    void submit();
+    // Release the contexts and buffers of the completed sends. acquire,
+    // send_to and submit also do it.
+    void reclaim();
+
+private:
+    struct ring_t;
+    struct op_t;
+
+    struct buffer_t {
+        uint32_t refs = 0;
+        const void* data = nullptr;
+        size_t size = 0;
+        std::shared_ptr<void> owner;
+        std::shared_ptr<void> probe;
+    };
+
+    void unref(uint32_t buffer);
+    void reaper_loop();
+
+    config _config;
+    completion_fn _on_complete;
+    reaped_fn _on_reaped;
+    std::unique_ptr<ring_t> _ring;
+    std::unique_ptr<buffer_t[]> _buffers;
+    std::unique_ptr<op_t[]> _ops;
+    std::vector<uint32_t> _free_buffers;
+    std::vector<uint32_t> _free_ops;
+    spsc_queue<uint32_t> _reaped_ops; // completed by the reaper thread, not reclaimed yet
+    unsigned _queued = 0; // sends not submitted yet
+    std::thread _reaper;
+};
+
+#endif // !URING_SENDER_HPP
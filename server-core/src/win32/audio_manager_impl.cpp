@@ -19,6 +19,8 @@
 #include "audio_manager.hpp"
 #include "client.pb.h"
 #include "network_manager.hpp"
+#include "metrics.hpp"
+#include "tracer.hpp"
 
 #include <spdlog/spdlog.h>
 #include <wil/com.h>
@@ -116,6 +118,8 @@ audio_manager_impl::~audio_manager_impl()
 
 void audio_manager::do_loopback_recording(std::shared_ptr<network_manager> network_manager, const capture_config& config)
 {
+    tracer::set_thread_name("capture");
+    thread_util::apply(config.thread, "capture");
     spdlog::info("endpoint_id: {}", config.endpoint_id);
 
     HRESULT hr;
@@ -269,6 +273,7 @@ void audio_manager::do_loopback_recording(std::shared_ptr<network_manager> netwo
             continue;
         }
 
+        tracer::scope trace("capture", "capture");
         BYTE* pData {};
         UINT32 numFramesAvailable {};
         DWORD dwFlags {};
@@ -276,6 +281,10 @@ void audio_manager::do_loopback_recording(std::shared_ptr<network_manager> netwo
         hr = pCaptureClient->GetBuffer(&pData, &numFramesAvailable, &dwFlags, nullptr, nullptr);
         exit_on_failed(hr, "pCaptureClient->GetBuffer");
 
+        if (dwFlags & AUDCLNT_BUFFERFLAGS_DATA_DISCONTINUITY) {
+            metrics::get().capture_xruns.inc();
+        }
+
         int bytes_per_frame = pCaptureFormat->nBlockAlign;
         size_t count = numFramesAvailable * bytes_per_frame;
 
@@ -384,7 +393,7 @@ static void set_format(std::shared_ptr<AudioFormat>& _format, PWAVEFORMATEX pFor
     spdlog::info("AudioFormat:\n{}", _format->DebugString());
 }
 
-void audio_manager::audio_init(AudioFormat& format) {
+void audio_manager::do_audio_init(AudioFormat& format) {
     HRESULT hr;
     auto pEnumerator = wil::CoCreateInstance<MMDeviceEnumerator, IMMDeviceEnumerator>();
 
@@ -450,15 +459,19 @@ void audio_manager::audio_init(AudioFormat& format) {
     spdlog::info("AudioClient bufferFrameCount: {}, bufferFrameBytes: {}", bufferFrameCount, bufferFrameCount * nBlockAlign);
 }
 
-void audio_manager::audio_start()
+void audio_manager::do_audio_start()
 {
     auto hr = pAudioClient->Start();
     exit_on_failed(hr, "AudioClient start");
     _ring_buffer.resize(_buffer_capacity);
 
     auto task = [this]() {
+        tracer::set_thread_name("playout");
+        thread_util::apply(_playout_policy, "playout");
+        // reused, it only grows to the capacity of the ring buffer once
+        std::vector<char> buffer;
+        buffer.reserve(_buffer_capacity);
         while (_running) {
-            std::vector<char> buffer;
             {
                 std::unique_lock<std::mutex> lock(_buffer_mutex);
                 buffer.resize(0);
@@ -491,7 +504,8 @@ void audio_manager::audio_start()
                 _read_pos = (_read_pos + available_data) % _buffer_capacity;
             }
             size_t n = buffer.size();
-            
+            tracer::scope trace("client", "playout");
+
             HRESULT hr;
             BYTE* pData;
             UINT32 numFramesAvailable;
@@ -534,7 +548,7 @@ void audio_manager::audio_start()
     }
 }
 
-void audio_manager::audio_play(const std::vector<char>& buffer)
+void audio_manager::do_audio_play(std::span<const char> buffer)
 {
     std::lock_guard<std::mutex> lock(_buffer_mutex);
 
@@ -566,7 +580,7 @@ void audio_manager::audio_play(const std::vector<char>& buffer)
     _buffer_cv.notify_one();
 }
 
-void audio_manager::audio_stop()
+void audio_manager::do_audio_stop()
 {
     _running = false;
 }
@@ -0,0 +1,137 @@
+/*
+   Copyright 2022-2024 mkckr0 <https://github.com/mkckr0>
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+*/
+
+#include "worker_pool.hpp"
+#include "tracer.hpp"
+
+#include <algorithm>
+
+worker_pool::worker_pool(size_t threads, const thread_util::thread_policy& policy, size_t tasks_per_worker)
+{
+    for (size_t i = 0; i < threads; ++i) {
+        _workers.push_back(std::make_unique<worker_t>(std::max<size_t>(tasks_per_worker, 1)));
+    }
+    // start after every deque exists, workers steal from each other
+    for (size_t i = 0; i < threads; ++i) {
+        _workers[i]->thread = std::thread([this, i, policy] {
+            worker_loop(i, policy);
+        });
+    }
+}
+
+worker_pool::~worker_pool()
+{
+    _stopped = true;
+    for (auto& worker : _workers) {
+        worker->ready.release();
+    }
+    for (auto& worker : _workers) {
+        worker->thread.join();
+    }
+}
+
+void worker_pool::parallel_for(size_t n, const std::function<void(size_t index)>& fn)
+{
+    if (n == 0) {
+        return;
+    }
+    std::latch done((std::ptrdiff_t)n);
+    // keep the first task for this thread, spread the others round robin
+    const auto next = _workers.empty() ? 0 : _next.fetch_add(n, std::memory_order_relaxed);
+    for (size_t i = 1; i < n; ++i) {
+        task_t task { &fn, i, &done };
+        if (_workers.empty()) {
+            run(task);
+            continue;
+        }
+        auto& worker = *_workers[(next + i) % _workers.size()];
+        if (push(worker, task)) {
+            worker.ready.release();
+        } else {
+            run(task);
+        }
+    }
+    run(task_t { &fn, 0, &done });
+
+    // help with what is still queued, then block until the tasks in flight finished
+    task_t task;
+    while (!done.try_wait() && steal(_workers.size(), task)) {
+        run(task);
+    }
+    done.wait();
+}
+
+bool worker_pool::push(worker_t& worker, const task_t& task)
+{
+    std::lock_guard lock(worker.mutex);
+    if (worker.count == worker.tasks.size()) {
+        return false;
+    }
+    worker.tasks[(worker.head + worker.count) % worker.tasks.size()] = task;
+    ++worker.count;
+    return true;
+}
+
+bool worker_pool::pop_newest(worker_t& worker, task_t& task)
+{
+    std::lock_guard lock(worker.mutex);
+    if (worker.count == 0) {
+        return false;
+    }
+    --worker.count;
+    task = worker.tasks[(worker.head + worker.count) % worker.tasks.size()];
+    return true;
+}
+
+bool worker_pool::steal(size_t thief, task_t& task)
+{
+    for (size_t i = 1; i <= _workers.size(); ++i) {
+        auto& victim = *_workers[(thief + i) % _workers.size()];
+        std::lock_guard lock(victim.mutex);
+        if (victim.count == 0) {
+            continue;
+        }
+        task = victim.tasks[victim.head];
+        victim.head = (victim.head + 1) % victim.tasks.size();
+        --victim.count;
+        return true;
+    }
+    return false;
+}
+
+void worker_pool::run(const task_t& task)
+{
+    (*task.fn)(task.index);
+    task.done->count_down();
+}
+
+void worker_pool::worker_loop(size_t index, thread_util::thread_policy policy)
+{
+    tracer::set_thread_name("worker");
+    thread_util::apply(policy, "worker");
+
+    auto& self = *_workers[index];
+    task_t task;
+    while (true) {
+        self.ready.acquire();
+        if (_stopped) {
+            return;
+        }
+        while (pop_newest(self, task) || steal(index, task)) {
+            run(task);
+        }
+    }
+}
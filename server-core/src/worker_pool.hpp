@@ -0,0 +1,85 @@
+/*
+   Copyright 2022-2024 mkckr0 <https://github.com/mkckr0>
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+*/
+
+#ifndef WORKER_POOL_HPP
+#define WORKER_POOL_HPP
+
+#include <atomic>
+#include <cstddef>
+#include <functional>
+#include <latch>
+#include <memory>
+#include <mutex>
+#include <semaphore>
+#include <thread>
+#include <vector>
+
+#include "thread_util.hpp"
+
+// Work-stealing pool for short CPU bound tasks, e.g. encoding one quantum
+// into several streams or formats. Every worker has its own bounded deque: it
+// takes its newest task and steals the oldest task of another worker when its
+// own deque is empty. Tasks are fixed size records in preallocated deques, so
+// submitting never allocates.
+class worker_pool {
+public:
+    explicit worker_pool(size_t threads, const thread_util::thread_policy& policy = {}, size_t tasks_per_worker = 64);
+    ~worker_pool();
+
+    worker_pool(const worker_pool&) = delete;
+    worker_pool& operator=(const worker_pool&) = delete;
+
+    // Run fn(0) ... fn(n - 1) in parallel and return when all of them
+    // finished, so results written by index are in order. The calling thread
+    // runs tasks too, and runs the ones that don't fit in the deques itself.
+    // Once nothing is left to steal it blocks until the tasks in flight finished.
+    void parallel_for(size_t n, const std::function<void(size_t index)>& fn);
+
+    size_t size() const { return _workers.size(); }
+
+private:
+    struct task_t {
+        const std::function<void(size_t)>* fn = nullptr;
+        size_t index = 0;
+        std::latch* done = nullptr;
+    };
+
+    struct worker_t {
+        explicit worker_t(size_t capacity)
+            : tasks(capacity)
+        {
+        }
+
+        std::mutex mutex; // held for a few instructions, never while a task runs
+        std::vector<task_t> tasks; // ring, head is the oldest task
+        size_t head = 0;
+        size_t count = 0;
+        std::counting_semaphore<> ready { 0 };
+        std::thread thread;
+    };
+
+    bool push(worker_t& worker, const task_t& task);
+    bool pop_newest(worker_t& worker, task_t& task);
+    bool steal(size_t thief, task_t& task);
+    void run(const task_t& task);
+    void worker_loop(size_t index, thread_util::thread_policy policy);
+
+    std::vector<std::unique_ptr<worker_t>> _workers;
+    std::atomic<size_t> _next { 0 };
+    std::atomic_bool _stopped = false;
+};
+
+#endif // !WORKER_POOL_HPP
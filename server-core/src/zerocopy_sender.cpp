@@ -0,0 +1,239 @@
+/*
+   Copyright 2022-2024 mkckr0 <https://github.com/mkckr0>
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+*/
+
+#include "zerocopy_sender.hpp"
+#include "metrics.hpp"
+
+#include <algorithm>
+#include <bit>
+#include <cerrno>
+#include <cstring>
+#include <system_error>
+
+#include <spdlog/spdlog.h>
+
+#ifdef linux
+#include <linux/errqueue.h>
+#include <netinet/in.h>
+#include <netinet/udp.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#endif
+
+#ifdef linux
+namespace {
+
+// the kernel limits of one UDP GSO send. A zero-copy send also pins every
+// page it reads as one fragment of the skb, and MAX_SKB_FRAGS is 17.
+constexpr size_t max_gso_segments = 64;
+constexpr size_t max_udp_payload = 65507;
+constexpr size_t max_fragments = 16;
+constexpr uintptr_t page_size = 4096; // larger pages only make this count high
+
+size_t pages_spanned(const void* data, size_t size)
+{
+    auto begin = (uintptr_t)data;
+    return (begin + size - 1) / page_size - begin / page_size + 1;
+}
+
+ssize_t send_zerocopy(int fd, iovec* iov, size_t iov_count, uint16_t gso_size, const void* addr, uint32_t addr_len)
+{
+    msghdr msg {};
+    msg.msg_name = (void*)addr;
+    msg.msg_namelen = addr_len;
+    msg.msg_iov = iov;
+    msg.msg_iovlen = iov_count;
+
+    alignas(cmsghdr) char control[CMSG_SPACE(sizeof(uint16_t))] {};
+    if (gso_size) {
+        msg.msg_control = control;
+        msg.msg_controllen = sizeof(control);
+        auto cmsg = CMSG_FIRSTHDR(&msg);
+        cmsg->cmsg_level = SOL_UDP;
+        cmsg->cmsg_type = UDP_SEGMENT;
+        cmsg->cmsg_len = CMSG_LEN(sizeof(gso_size));
+        std::memcpy(CMSG_DATA(cmsg), &gso_size, sizeof(gso_size));
+    }
+    return sendmsg(fd, &msg, MSG_ZEROCOPY | MSG_DONTWAIT);
+}
+
+} // namespace
+#endif // linux
+
+zerocopy_sender::zerocopy_sender(int fd, const config& config)
+    : _fd(fd)
+    , _drain_timeout(config.drain_timeout)
+    , _pending(std::bit_ceil(std::max<size_t>(config.max_pending, 1)))
+{
+#ifdef linux
+    int on = 1;
+    if (setsockopt(fd, SOL_SOCKET, SO_ZEROCOPY, &on, sizeof(on)) != 0) {
+        throw std::system_error(errno, std::system_category(), "SO_ZEROCOPY");
+    }
+    if (config.gso) {
+        int gso_size = 0;
+        socklen_t size = sizeof(gso_size);
+        _gso = getsockopt(fd, SOL_UDP, UDP_SEGMENT, &gso_size, &size) == 0;
+    }
+    spdlog::info("zero-copy sends enabled, UDP GSO {}", _gso ? "on" : "off");
+#else
+    throw std::system_error(std::make_error_code(std::errc::function_not_supported), "MSG_ZEROCOPY");
+#endif
+}
+
+zerocopy_sender::~zerocopy_sender()
+{
+#ifdef linux
+    // the kernel reads the segments until their notification arrived
+    const auto deadline = std::chrono::steady_clock::now() + _drain_timeout;
+    reap();
+    while (_pending_count) {
+        auto left = std::chrono::duration_cast<std::chrono::milliseconds>(deadline - std::chrono::steady_clock::now());
+        if (left.count() <= 0) {
+            break;
+        }
+        // the error queue reports POLLERR
+        pollfd fd { _fd, 0, 0 };
+        if (poll(&fd, 1, (int)left.count()) < 0 && errno != EINTR) {
+            break;
+        }
+        reap();
+    }
+    if (_pending_count) {
+        spdlog::warn("{} zero-copy sends weren't notified, their segments are never freed", _pending_count);
+        auto& m = metrics::get();
+        for (auto& pending : _pending) {
+            if (pending.owner) {
+                m.send_queue_bytes.sub((int64_t)pending.bytes);
+            }
+        }
+        m.zerocopy_pending.sub((int64_t)_pending_count);
+        // leaked on purpose, the kernel may still read them
+        new std::vector<pending_t>(std::move(_pending));
+    }
+#endif
+}
+
+size_t zerocopy_sender::send(const packetizer::segment_list_t& segments, const void* addr, uint32_t addr_len, const std::shared_ptr<void>& owner, size_t& bytes_sent)
+{
+    bytes_sent = 0;
+#ifdef linux
+    auto& m = metrics::get();
+    const auto mask = _pending.size() - 1;
+    size_t sent = 0;
+    auto it = segments.begin();
+    while (it != segments.end()) {
+        if (_pending[_next_id & mask].owner && (reap() == 0 || _pending[_next_id & mask].owner)) {
+            break;
+        }
+
+        // a GSO send takes segments of the size of the first one, the last may be shorter
+        iovec iov[max_gso_segments];
+        size_t count = 0;
+        size_t total = 0;
+        size_t fragments = 0;
+        const size_t gso_size = (*it)->size();
+        auto end = it;
+        do {
+            const auto size = (*end)->size();
+            const auto pages = pages_spanned((*end)->data(), size);
+            if (count && (size > gso_size || total + size > max_udp_payload || fragments + pages > max_fragments)) {
+                break;
+            }
+            iov[count++] = { const_cast<uint8_t*>((*end)->data()), size };
+            total += size;
+            fragments += pages;
+            ++end;
+            if (size < gso_size) {
+                break;
+            }
+        } while (_gso && end != segments.end() && count < max_gso_segments);
+
+        auto n = send_zerocopy(_fd, iov, count, count > 1 ? (uint16_t)gso_size : 0, addr, addr_len);
+        if (n < 0 && count > 1 && errno == EIO) {
+            // the route can't offload the checksum that GSO needs
+            _gso = false;
+            spdlog::info("UDP GSO isn't available on the route, zero-copy sends go one segment at a time");
+            continue;
+        }
+        if (n < 0) {
+            break;
+        }
+        _pending[_next_id & mask] = { owner, (size_t)n };
+        ++_next_id;
+        ++_pending_count;
+        m.zerocopy_pending.add(1);
+        m.send_queue_bytes.add((int64_t)n);
+        m.zerocopy_sends.inc();
+        sent += count;
+        bytes_sent += (size_t)n;
+        it = end;
+    }
+    return sent;
+#else
+    return 0;
+#endif
+}
+
+size_t zerocopy_sender::reap()
+{
+    size_t completed = 0;
+#ifdef linux
+    auto& m = metrics::get();
+    const auto mask = _pending.size() - 1;
+    while (true) {
+        alignas(cmsghdr) char control[CMSG_SPACE(sizeof(sock_extended_err) + sizeof(sockaddr_in6))];
+        msghdr msg {};
+        msg.msg_control = control;
+        msg.msg_controllen = sizeof(control);
+        if (recvmsg(_fd, &msg, MSG_ERRQUEUE | MSG_DONTWAIT) < 0) {
+            break;
+        }
+
+        for (auto cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+            const bool recverr = (cmsg->cmsg_level == SOL_IP && cmsg->cmsg_type == IP_RECVERR)
+                || (cmsg->cmsg_level == SOL_IPV6 && cmsg->cmsg_type == IPV6_RECVERR);
+            if (!recverr) {
+                continue;
+            }
+            sock_extended_err err;
+            std::memcpy(&err, CMSG_DATA(cmsg), sizeof(err));
+            if (err.ee_origin != SO_EE_ORIGIN_ZEROCOPY) {
+                continue;
+            }
+
+            // the sends ee_info to ee_data completed, the range may wrap around
+            const uint32_t count = err.ee_data - err.ee_info + 1;
+            if (err.ee_code & SO_EE_CODE_ZEROCOPY_COPIED) {
+                // e.g. loopback or a device without scatter-gather
+                m.zerocopy_copied.inc(count);
+            }
+            for (uint32_t i = 0; i < count; ++i) {
+                auto& pending = _pending[(err.ee_info + i) & mask];
+                if (pending.owner) {
+                    pending.owner = nullptr;
+                    --_pending_count;
+                    m.zerocopy_pending.sub(1);
+                    m.send_queue_bytes.sub((int64_t)pending.bytes);
+                    ++completed;
+                }
+            }
+        }
+    }
+#endif
+    return completed;
+}
@@ -0,0 +1,80 @@
+/*
+   Copyright 2022-2024 mkckr0 <https://github.com/mkckr0>
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+*/
+
+#ifndef ZEROCOPY_SENDER_HPP
+#define ZEROCOPY_SENDER_HPP
+
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <vector>
+
+#include "packetizer.hpp"
+
+// Sends the segments of a quantum with MSG_ZEROCOPY from one UDP socket,
+// Linux only. The kernel reads the segments in place instead of copying them
+// once per peer, and equal sized segments to one peer go out in a single UDP
+// GSO send when the kernel supports it.
+//
+// The kernel may still read the memory after sendmsg returned, so the sender
+// keeps an owner of the segments per send until the completion notification
+// for it arrives on the error queue of the socket, and counts its bytes in
+// the send_queue_bytes metric until then. The destructor waits for the
+// notifications. Only called by the network thread.
+class zerocopy_sender {
+public:
+    struct config {
+        bool gso = true; // one sendmsg per peer and quantum with UDP_SEGMENT
+        size_t max_pending = 1024; // sends whose notification hasn't arrived yet
+        std::chrono::milliseconds drain_timeout { 1000 }; // how long the destructor waits for the notifications
+    };
+
+    // Enables SO_ZEROCOPY on the socket. Throws std::system_error when the
+    // kernel doesn't support it.
+    zerocopy_sender(int fd, const config& config);
+    ~zerocopy_sender();
+
+    zerocopy_sender(const zerocopy_sender&) = delete;
+    zerocopy_sender& operator=(const zerocopy_sender&) = delete;
+
+    // Send the segments to a sockaddr, owner must not be null. Returns how
+    // many of the segments the kernel took, the caller sends the others with
+    // copies, e.g. when too many sends are pending or the socket buffer is full.
+    size_t send(const packetizer::segment_list_t& segments, const void* addr, uint32_t addr_len, const std::shared_ptr<void>& owner, size_t& bytes_sent);
+
+    // Read the completion notifications from the error queue and release the
+    // owners of the completed sends. Returns the number of sends completed.
+    size_t reap();
+
+    bool gso() const { return _gso; }
+    size_t pending() const { return _pending_count; }
+
+private:
+    struct pending_t {
+        std::shared_ptr<void> owner;
+        size_t bytes = 0;
+    };
+
+    int _fd;
+    bool _gso = false;
+    std::chrono::milliseconds _drain_timeout;
+    uint32_t _next_id = 0; // the kernel numbers the successful sends from 0
+    std::vector<pending_t> _pending; // by id modulo the size, a power of two
+    size_t _pending_count = 0;
+};
+
+#endif // !ZEROCOPY_SENDER_HPP
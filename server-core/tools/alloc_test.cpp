@@ -0,0 +1,336 @@
+/*
+   Copyright 2022-2024 mkckr0 <https://github.com/mkckr0>
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+*/
+
+// Zero allocation test. The global operator new of this program counts the
+// allocations of every thread. A server with a synthetic source and N clients
+// run in process over 127.0.0.1 like in as-loopback-bench; after the warm-up
+// every thread except this one is on the audio path (capture, the server's
+// network thread, the clients' network threads), so any allocation they make
+// during the measured duration is a failure. The first client goes through
+// audio_manager::audio_play to a null playout, the others count the datagrams
+// in a handler.
+//
+// Only operator new is hooked. malloc calls from C libraries are not counted.
+// Prints JSON and exits with 1 if an audio thread allocated.
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <cstdlib>
+#include <iostream>
+#include <memory>
+#include <new>
+#include <thread>
+#include <vector>
+
+#include <cxxopts.hpp>
+#include <fmt/format.h>
+#include <spdlog/spdlog.h>
+
+#include "audio_manager.hpp"
+#include "metrics.hpp"
+#include "network_manager.hpp"
+#include "tracer.hpp"
+
+#ifdef _WINDOWS
+#include <malloc.h>
+#endif
+
+using namespace std::chrono_literals;
+
+namespace {
+
+// One slot per thread, claimed by the first allocation of the thread. The
+// slots are static so that counting never allocates.
+struct alloc_slot {
+    std::atomic<uint64_t> count { 0 };
+    std::atomic<uint64_t> bytes { 0 };
+    std::atomic<const char*> name { nullptr };
+};
+
+constexpr size_t max_threads = 256;
+std::array<alloc_slot, max_threads> g_slots;
+std::atomic<size_t> g_slot_count = 0;
+alloc_slot g_overflow; // threads beyond max_threads share it
+
+thread_local alloc_slot* t_slot = nullptr;
+
+alloc_slot& current_slot()
+{
+    if (!t_slot) {
+        auto i = g_slot_count.fetch_add(1, std::memory_order_relaxed);
+        t_slot = i < max_threads ? &g_slots[i] : &g_overflow;
+    }
+    return *t_slot;
+}
+
+void count_allocation(size_t size)
+{
+    auto& slot = current_slot();
+    slot.count.fetch_add(1, std::memory_order_relaxed);
+    slot.bytes.fetch_add(size, std::memory_order_relaxed);
+    // threads name themselves after their first allocation
+    if (!slot.name.load(std::memory_order_relaxed)) {
+        slot.name.store(tracer::thread_name(), std::memory_order_relaxed);
+    }
+}
+
+void* allocate(size_t size)
+{
+    count_allocation(size);
+    return std::malloc(size ? size : 1);
+}
+
+void* allocate_aligned(size_t size, std::align_val_t align)
+{
+    count_allocation(size);
+    auto alignment = (size_t)align;
+#ifdef _WINDOWS
+    return _aligned_malloc(size ? size : 1, alignment);
+#else
+    // aligned_alloc wants a multiple of the alignment
+    return std::aligned_alloc(alignment, (std::max(size, (size_t)1) + alignment - 1) / alignment * alignment);
+#endif
+}
+
+void deallocate_aligned(void* p)
+{
+#ifdef _WINDOWS
+    _aligned_free(p);
+#else
+    std::free(p);
+#endif
+}
+
+struct snapshot_t {
+    uint64_t count = 0;
+    uint64_t bytes = 0;
+};
+
+std::vector<snapshot_t> take_snapshot()
+{
+    std::vector<snapshot_t> snapshot(max_threads);
+    for (size_t i = 0; i < max_threads; ++i) {
+        snapshot[i].count = g_slots[i].count.load(std::memory_order_relaxed);
+        snapshot[i].bytes = g_slots[i].bytes.load(std::memory_order_relaxed);
+    }
+    return snapshot;
+}
+
+} // namespace
+
+void* operator new(size_t size)
+{
+    if (auto p = allocate(size)) {
+        return p;
+    }
+    throw std::bad_alloc();
+}
+
+void* operator new[](size_t size)
+{
+    return operator new(size);
+}
+
+void* operator new(size_t size, const std::nothrow_t&) noexcept
+{
+    return allocate(size);
+}
+
+void* operator new[](size_t size, const std::nothrow_t&) noexcept
+{
+    return allocate(size);
+}
+
+void* operator new(size_t size, std::align_val_t align)
+{
+    if (auto p = allocate_aligned(size, align)) {
+        return p;
+    }
+    throw std::bad_alloc();
+}
+
+void* operator new[](size_t size, std::align_val_t align)
+{
+    return operator new(size, align);
+}
+
+void* operator new(size_t size, std::align_val_t align, const std::nothrow_t&) noexcept
+{
+    return allocate_aligned(size, align);
+}
+
+void* operator new[](size_t size, std::align_val_t align, const std::nothrow_t&) noexcept
+{
+    return allocate_aligned(size, align);
+}
+
+void operator delete(void* p) noexcept { std::free(p); }
+void operator delete[](void* p) noexcept { std::free(p); }
+void operator delete(void* p, size_t) noexcept { std::free(p); }
+void operator delete[](void* p, size_t) noexcept { std::free(p); }
+void operator delete(void* p, const std::nothrow_t&) noexcept { std::free(p); }
+void operator delete[](void* p, const std::nothrow_t&) noexcept { std::free(p); }
+void operator delete(void* p, std::align_val_t) noexcept { deallocate_aligned(p); }
+void operator delete[](void* p, std::align_val_t) noexcept { deallocate_aligned(p); }
+void operator delete(void* p, size_t, std::align_val_t) noexcept { deallocate_aligned(p); }
+void operator delete[](void* p, size_t, std::align_val_t) noexcept { deallocate_aligned(p); }
+void operator delete(void* p, std::align_val_t, const std::nothrow_t&) noexcept { deallocate_aligned(p); }
+void operator delete[](void* p, std::align_val_t, const std::nothrow_t&) noexcept { deallocate_aligned(p); }
+
+int main(int argc, char* argv[])
+{
+    cxxopts::Options options("as-alloc-test", "Run a server and N clients in process and fail if the audio threads allocate after the warm-up");
+
+    // clang-format off
+    options.add_options()
+        ("h,help", "Print usage")
+        ("clients", "Number of clients", cxxopts::value<int>()->default_value("2"), "[n]")
+        ("duration", "Checked duration in seconds", cxxopts::value<int>()->default_value("10"), "[seconds]")
+        ("warmup", "Warm-up before checking in seconds, longer than the 3s heartbeat so that its first send is done", cxxopts::value<int>()->default_value("5"), "[seconds]")
+        ("port", "Server port", cxxopts::value<uint16_t>()->default_value("65533"), "[port]")
+        ("encoding", "Synthetic source encoding", cxxopts::value<audio_manager::encoding_t>()->default_value("f32"), "[encoding]")
+        ("channels", "Synthetic source channels", cxxopts::value<int>()->default_value("2"), "[channels]")
+        ("sample-rate", "Synthetic source sample rate(Hz)", cxxopts::value<int>()->default_value("48000"), "[sample_rate]")
+        ("period", "Synthetic source quantum in microseconds", cxxopts::value<int>()->default_value("10000"), "[us]")
+        ("sender-threads", "Server sender threads, Linux only, 0 sends from the network thread", cxxopts::value<int>()->default_value("0"), "[n]")
+        ("V,verbose", "Set log level to \"trace\"")
+        ;
+    // clang-format on
+
+    cxxopts::ParseResult result;
+    try {
+        result = options.parse(argc, argv);
+    } catch (const cxxopts::exceptions::exception& e) {
+        std::cerr << e.what() << '\n'
+                  << options.help();
+        return EXIT_FAILURE;
+    }
+    if (result.count("help")) {
+        std::cout << options.help();
+        return EXIT_SUCCESS;
+    }
+    spdlog::set_level(result.count("verbose") ? spdlog::level::trace : spdlog::level::warn);
+    tracer::set_thread_name("main");
+    current_slot(); // claim slot 0 for this thread
+
+    const int client_count = std::max(1, result["clients"].as<int>());
+    const auto duration = std::chrono::seconds(result["duration"].as<int>());
+    const auto warmup = std::chrono::seconds(result["warmup"].as<int>());
+    const auto port = result["port"].as<uint16_t>();
+
+    audio_manager::capture_config capture_config;
+    capture_config.synthetic = true;
+    capture_config.encoding = result["encoding"].as<audio_manager::encoding_t>();
+    capture_config.channels = result["channels"].as<int>();
+    capture_config.sample_rate = result["sample-rate"].as<int>();
+    capture_config.synthetic_period = std::chrono::microseconds(result["period"].as<int>());
+
+    // the metrics listener and the loop lag probe are not on the audio path
+    network_manager::server_config server_config;
+    server_config.loop_lag_interval = {};
+    server_config.sender_threads = (size_t)std::max(0, result["sender-threads"].as<int>());
+
+    auto server_audio = std::make_shared<audio_manager>();
+    auto server = std::make_shared<network_manager>(server_audio);
+    server->start_server("127.0.0.1", port, capture_config, server_config);
+
+    // the receive -> play path of a real client, without an output device
+    auto player_audio = std::make_shared<audio_manager>();
+    player_audio->set_null_playout(true);
+    auto client_audio = std::make_shared<audio_manager>();
+    std::vector<std::shared_ptr<network_manager>> clients;
+    auto received = std::make_unique<std::atomic<uint64_t>[]>(client_count);
+    for (int i = 0; i < client_count; ++i) {
+        auto client = std::make_shared<network_manager>(i == 0 ? player_audio : client_audio);
+        if (i != 0) {
+            client->set_datagram_handler([counter = &received[i]](const char*, size_t) {
+                counter->fetch_add(1, std::memory_order_relaxed);
+            });
+        }
+        client->start_client("127.0.0.1", port);
+        clients.push_back(client);
+    }
+
+    std::this_thread::sleep_for(warmup);
+
+    const auto quanta_begin = metrics::get().capture_quanta.value();
+    const auto played_begin = player_audio->played_bytes();
+    std::vector<uint64_t> received_begin(client_count);
+    for (int i = 0; i < client_count; ++i) {
+        received_begin[i] = received[i].load(std::memory_order_relaxed);
+    }
+    const auto before = take_snapshot();
+
+    std::this_thread::sleep_for(duration);
+
+    const auto after = take_snapshot();
+    const auto quanta = metrics::get().capture_quanta.value() - quanta_begin;
+    const auto played = player_audio->played_bytes() - played_begin;
+    uint64_t datagrams = 0;
+    int silent_clients = played == 0;
+    for (int i = 1; i < client_count; ++i) {
+        const auto n = received[i].load(std::memory_order_relaxed) - received_begin[i];
+        datagrams += n;
+        silent_clients += n == 0;
+    }
+
+    for (auto& client : clients) {
+        client->stop_client();
+    }
+    server->stop_server();
+
+    std::vector<std::string> failures;
+    std::string threads_json;
+    const auto slot_count = std::min(g_slot_count.load(), max_threads);
+    for (size_t i = 0; i < slot_count; ++i) {
+        const auto count = after[i].count - before[i].count;
+        const auto bytes = after[i].bytes - before[i].bytes;
+        const char* name = g_slots[i].name.load(std::memory_order_relaxed);
+        threads_json += fmt::format(R"({}{{"name": "{}", "allocations": {}, "bytes": {}}})",
+            i ? ", " : "", name ? name : "unnamed", count, bytes);
+        if (&g_slots[i] != t_slot && count) {
+            failures.push_back(fmt::format("{} thread allocated {} times, {} bytes", name ? name : "unnamed", count, bytes));
+        }
+    }
+    if (g_overflow.count.load()) {
+        failures.push_back(fmt::format("more than {} threads, the rest were not checked", max_threads));
+    }
+    if (quanta == 0 || (datagrams == 0 && played == 0)) {
+        failures.push_back(fmt::format("no audio flowed: {} quanta, {} datagrams, {} bytes played", quanta, datagrams, played));
+    } else if (silent_clients) {
+        failures.push_back(fmt::format("{} of {} clients received no audio", silent_clients, client_count));
+    }
+
+    std::string failures_json;
+    for (size_t i = 0; i < failures.size(); ++i) {
+        failures_json += fmt::format(R"({}"{}")", i ? ", " : "", failures[i]);
+    }
+
+    fmt::print(R"({{
+  "clients": {},
+  "duration_s": {},
+  "quanta": {},
+  "datagrams": {},
+  "played_bytes": {},
+  "threads": [{}],
+  "failures": [{}]
+}}
+)",
+        client_count, duration.count(), quanta, datagrams, played, threads_json, failures_json);
+
+    return failures.empty() ? EXIT_SUCCESS : EXIT_FAILURE;
+}
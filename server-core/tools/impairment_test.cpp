@@ -0,0 +1,194 @@
+/*
+   Copyright 2022-2024 mkckr0 <https://github.com/mkckr0>
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+*/
+
+// Impairment test. Checks the spec parser, that malformed specs are rejected,
+// and that the decisions of impairment::process only depend on the config and
+// the stream id, so a run can be reproduced from its seed. Prints every
+// failed check and exits with 1 if there was one.
+
+#include <cmath>
+#include <iostream>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include <fmt/format.h>
+
+#include "impairment.hpp"
+
+using namespace std::chrono_literals;
+
+namespace {
+
+int g_failures = 0;
+
+void check(bool ok, std::string_view what)
+{
+    if (!ok) {
+        std::cerr << "FAILED: " << what << "\n";
+        ++g_failures;
+    }
+}
+
+// what process decided for one datagram
+struct decision {
+    size_t copies;
+    std::chrono::microseconds delay0;
+    std::chrono::microseconds delay1;
+    bool queue_dropped;
+    bool reordered;
+
+    bool operator==(const decision&) const = default;
+};
+
+// a quantum of 4 datagrams every 10ms, 3.84 mbit/s
+std::vector<decision> run(const impairment::config& config, uint64_t stream_id, size_t count)
+{
+    impairment impair(config, stream_id);
+    std::vector<decision> decisions;
+    auto now = pipeline_clock::time_point();
+    for (size_t i = 0; i < count; ++i) {
+        if (i % 4 == 0) {
+            now += 10ms;
+        }
+        auto v = impair.process(now, 1200);
+        decisions.push_back({ v.copies, v.delay[0], v.delay[1], v.queue_dropped, v.reordered });
+    }
+    return decisions;
+}
+
+void test_parse()
+{
+    auto c = impairment::config::parse("loss=1%, burst=0.5%:30%:80%,delay=20ms,jitter=500us,reorder=1%:15ms,duplicate=0.001,rate=2mbit,limit=1s,seed=7");
+    check(std::abs(c.loss - 0.01) < 1e-12, "parse loss");
+    check(std::abs(c.burst_enter - 0.005) < 1e-12, "parse burst enter");
+    check(std::abs(c.burst_exit - 0.3) < 1e-12, "parse burst exit");
+    check(std::abs(c.burst_loss - 0.8) < 1e-12, "parse burst loss");
+    check(c.delay == 20ms, "parse delay");
+    check(c.jitter == 500us, "parse jitter");
+    check(std::abs(c.reorder - 0.01) < 1e-12, "parse reorder");
+    check(c.reorder_gap == 15ms, "parse reorder gap");
+    check(std::abs(c.duplicate - 0.001) < 1e-12, "parse duplicate");
+    check(c.rate == 2000000, "parse rate");
+    check(c.queue_limit == 1s, "parse limit");
+    check(c.seed == 7, "parse seed");
+    check(c.enabled(), "parsed config is enabled");
+
+    // defaults
+    auto d = impairment::config::parse("burst=1%:50%,delay=5,reorder=2%");
+    check(d.burst_loss == 1, "burst loss defaults to 1");
+    check(d.delay == 5ms, "plain durations are milliseconds");
+    check(d.reorder_gap == impairment::config().reorder_gap, "reorder gap keeps its default");
+    check(!impairment::config::parse("").enabled(), "empty spec is disabled");
+    check(!impairment::config::parse("seed=3").enabled(), "a seed alone is disabled");
+}
+
+void test_malformed()
+{
+    const char* specs[] = {
+        "loss",
+        "loss=",
+        "loss=abc",
+        "loss=150%",
+        "loss=-1%",
+        "loss=1%%",
+        "delay=5h",
+        "rate=2mbyte",
+        "burst=1%",
+        "burst=1%:2%:3%:4%",
+        "reorder=1%:5ms:1",
+        "seed=x",
+        "seed=1.5",
+        "bandwidth=1mbit",
+    };
+    for (auto spec : specs) {
+        bool rejected = false;
+        try {
+            impairment::config::parse(spec);
+        } catch (const std::invalid_argument&) {
+            rejected = true;
+        }
+        check(rejected, fmt::format("reject \"{}\"", spec));
+    }
+}
+
+void test_reproducible()
+{
+    auto config = impairment::config::parse("loss=5%,burst=1%:20%:70%,delay=20ms,jitter=5ms,reorder=2%:15ms,duplicate=1%,rate=3mbit,limit=50ms,seed=42");
+    const size_t count = 20000;
+    auto a = run(config, 1, count);
+    auto b = run(config, 1, count);
+    check(a == b, "same seed and stream give the same decisions");
+
+    auto other_stream = run(config, 2, count);
+    check(a != other_stream, "another stream gets its own sequence");
+    config.seed = 43;
+    auto other_seed = run(config, 1, count);
+    check(a != other_seed, "another seed gives another sequence");
+
+    // every kind of decision shows up, so the comparison above covers them
+    size_t dropped = 0, duplicated = 0, reordered = 0, queue_dropped = 0;
+    for (auto& d : a) {
+        dropped += d.copies == 0;
+        duplicated += d.copies == 2;
+        reordered += d.reordered;
+        queue_dropped += d.queue_dropped;
+    }
+    check(dropped > 0 && duplicated > 0 && reordered > 0 && queue_dropped > 0, fmt::format("all decisions occur, dropped {} duplicated {} reordered {} queue dropped {}", dropped, duplicated, reordered, queue_dropped));
+}
+
+void test_distribution()
+{
+    const size_t count = 100000;
+    auto loss = run(impairment::config::parse("loss=10%,seed=5"), 1, count);
+    size_t dropped = 0;
+    for (auto& d : loss) {
+        dropped += d.copies == 0;
+    }
+    auto rate = (double)dropped / count;
+    check(rate > 0.09 && rate < 0.11, fmt::format("loss=10% drops {:.3f}", rate));
+
+    auto jitter = run(impairment::config::parse("delay=20ms,jitter=5ms,seed=5"), 1, count);
+    bool in_range = true;
+    for (auto& d : jitter) {
+        in_range = in_range && d.copies == 1 && d.delay0 >= 15ms && d.delay0 <= 25ms;
+    }
+    check(in_range, "jitter stays within delay +- jitter");
+
+    auto none = run(impairment::config(), 1, count);
+    bool clean = true;
+    for (auto& d : none) {
+        clean = clean && d.copies == 1 && d.delay0 == 0us && !d.reordered && !d.queue_dropped;
+    }
+    check(clean, "the default config passes every datagram unchanged");
+}
+
+} // namespace
+
+int main()
+{
+    test_parse();
+    test_malformed();
+    test_reproducible();
+    test_distribution();
+    if (g_failures) {
+        std::cerr << g_failures << " check(s) failed\n";
+        return 1;
+    }
+    std::cout << "all checks passed\n";
+    return 0;
+}
@@ -0,0 +1,483 @@
+/*
+   Copyright 2022-2024 mkckr0 <https://github.com/mkckr0>
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+*/
+
+// Load generator with thousands of lightweight simulated receivers.
+//
+// Every session speaks the real protocol (TCP handshake, heartbeats, UDP
+// registration) but only counts and discards the audio, so thousands of them
+// can be multiplexed onto a few threads. The number of sessions is ramped in
+// steps and every step prints one JSON line, including the server's CPU and
+// memory when --server-pid is given. Run the server with --synthetic to also
+// get latency and jitter from the probes. A large --step, e.g. 500, is a
+// connection storm, and handshakes_per_s compares servers with and without
+// --accept-threads.
+
+#include <array>
+#include <iostream>
+#include <memory>
+#include <thread>
+#include <vector>
+
+#include <cxxopts.hpp>
+#include <fmt/format.h>
+#include <spdlog/spdlog.h>
+
+#include "pre_asio.hpp"
+#include <asio.hpp>
+
+#include "metrics.hpp"
+#include "network_manager.hpp"
+#include "synthetic_source.hpp"
+#include "thread_util.hpp"
+
+#ifdef linux
+#include <sys/resource.h>
+#include <unistd.h>
+#include <fstream>
+#include <sstream>
+#endif
+
+namespace ip = asio::ip;
+using namespace std::chrono_literals;
+
+namespace {
+
+using default_token = asio::as_tuple_t<asio::use_awaitable_t<>>;
+using tcp_socket = default_token::as_default_on_t<ip::tcp::socket>;
+using udp_socket = default_token::as_default_on_t<ip::udp::socket>;
+using steady_timer = default_token::as_default_on_t<asio::steady_timer>;
+using cmd_t = network_manager::cmd_t;
+
+// One per io thread. Written by that thread only.
+struct thread_stats {
+    metrics::counter established;
+    metrics::gauge last_established; // steady_clock ns
+    metrics::counter failed;
+    metrics::counter closed;
+    metrics::counter packets;
+    metrics::counter bytes;
+    metrics::histogram handshake; // us
+    metrics::histogram interarrival; // us
+    metrics::histogram jitter; // us, RFC 3550 interarrival jitter estimate
+    metrics::histogram latency; // us, needs a server running with --synthetic
+};
+
+struct session_t {
+    session_t(const asio::any_io_executor& ex)
+        : tcp(ex)
+        , udp(ex)
+    {
+    }
+
+    tcp_socket tcp;
+    udp_socket udp;
+    std::array<char, 4096> buffer {};
+    std::chrono::steady_clock::time_point last_arrival;
+    int64_t last_transit_us = 0;
+    double jitter_us = 0;
+    bool has_probe = false;
+};
+
+asio::awaitable<void> heartbeat_loop(std::shared_ptr<session_t> session)
+{
+    steady_timer timer(session->tcp.get_executor());
+    while (true) {
+        auto cmd = cmd_t::cmd_heartbeat;
+        auto [ec, _] = co_await asio::async_write(session->tcp, asio::buffer(&cmd, sizeof(cmd)));
+        if (ec) {
+            break;
+        }
+        timer.expires_after(3s);
+        std::tie(ec) = co_await timer.async_wait();
+        if (ec || !session->tcp.is_open()) {
+            break;
+        }
+    }
+}
+
+asio::awaitable<void> tcp_read_loop(std::shared_ptr<session_t> session, thread_stats& stats)
+{
+    while (true) {
+        cmd_t cmd = cmd_t::cmd_none;
+        auto [ec, _] = co_await asio::async_read(session->tcp, asio::buffer(&cmd, sizeof(cmd)));
+        if (ec) {
+            break;
+        }
+    }
+    // the server closed the session, stop receiving audio too
+    asio::error_code ec;
+    session->tcp.close(ec);
+    session->udp.close(ec);
+    stats.closed.inc();
+}
+
+asio::awaitable<void> run_session(ip::tcp::endpoint endpoint, thread_stats& stats)
+{
+    auto session = std::make_shared<session_t>(co_await asio::this_coro::executor);
+    auto begin = std::chrono::steady_clock::now();
+
+    auto fail = [&](std::string_view what, const asio::error_code& ec) {
+        spdlog::debug("session {} failed: {}", what, ec.message());
+        stats.failed.inc();
+    };
+
+    {
+        auto [ec] = co_await session->tcp.async_connect(endpoint);
+        if (ec) {
+            fail("connect", ec);
+            co_return;
+        }
+        session->tcp.set_option(ip::tcp::no_delay(true), ec);
+    }
+
+    // get format
+    {
+        auto cmd = cmd_t::cmd_get_format;
+        auto [ec, _] = co_await asio::async_write(session->tcp, asio::buffer(&cmd, sizeof(cmd)));
+        std::array<uint32_t, 2> header {};
+        if (!ec) {
+            std::tie(ec, _) = co_await asio::async_read(session->tcp, asio::buffer(header));
+        }
+        if (!ec && (header[0] != (uint32_t)cmd_t::cmd_get_format || header[1] > session->buffer.size())) {
+            ec = asio::error::invalid_argument;
+        }
+        if (!ec) {
+            std::tie(ec, _) = co_await asio::async_read(session->tcp, asio::buffer(session->buffer.data(), header[1]));
+        }
+        if (ec) {
+            fail("cmd_get_format", ec);
+            co_return;
+        }
+    }
+
+    // start play
+    uint32_t id = 0;
+    {
+        auto cmd = cmd_t::cmd_start_play;
+        auto [ec, _] = co_await asio::async_write(session->tcp, asio::buffer(&cmd, sizeof(cmd)));
+        std::array<uint32_t, 2> header {};
+        if (!ec) {
+            std::tie(ec, _) = co_await asio::async_read(session->tcp, asio::buffer(header));
+        }
+        if (!ec && header[0] != (uint32_t)cmd_t::cmd_start_play) {
+            ec = asio::error::invalid_argument;
+        }
+        if (ec) {
+            fail("cmd_start_play", ec);
+            co_return;
+        }
+        id = header[1];
+    }
+
+    // udp registration
+    {
+        asio::error_code ec;
+        session->udp.open(ip::udp::v4(), ec);
+        if (!ec) {
+            std::tie(ec) = co_await session->udp.async_connect(ip::udp::endpoint(endpoint.address(), endpoint.port()));
+        }
+        if (!ec) {
+            size_t _;
+            std::tie(ec, _) = co_await session->udp.async_send(asio::buffer(&id, sizeof(id)));
+        }
+        if (ec) {
+            fail("udp registration", ec);
+            co_return;
+        }
+    }
+
+    auto established = std::chrono::steady_clock::now();
+    stats.handshake.observe(established - begin);
+    stats.established.inc();
+    stats.last_established.set(established.time_since_epoch().count());
+
+    auto ex = session->tcp.get_executor();
+    asio::co_spawn(ex, heartbeat_loop(session), asio::detached);
+    asio::co_spawn(ex, tcp_read_loop(session, stats), asio::detached);
+
+    while (true) {
+        auto [ec, n] = co_await session->udp.async_receive(asio::buffer(session->buffer));
+        if (ec) {
+            break;
+        }
+        auto now = std::chrono::steady_clock::now();
+        stats.packets.inc();
+        stats.bytes.inc(n);
+        if (session->last_arrival.time_since_epoch().count()) {
+            stats.interarrival.observe(now - session->last_arrival);
+        }
+        session->last_arrival = now;
+
+        // same host, so steady_clock of the server is comparable
+        synthetic_source::probe_t probe;
+        if (synthetic_source::read_probe(session->buffer.data(), n, probe)) {
+            auto sent = std::chrono::steady_clock::time_point(std::chrono::nanoseconds(probe.timestamp_ns));
+            auto transit_us = std::chrono::duration_cast<std::chrono::microseconds>(now - sent).count();
+            stats.latency.observe(transit_us > 0 ? (uint64_t)transit_us : 0);
+            if (session->has_probe) {
+                auto d = std::abs(transit_us - session->last_transit_us);
+                session->jitter_us += ((double)d - session->jitter_us) / 16.0;
+                stats.jitter.observe((uint64_t)session->jitter_us);
+            }
+            session->has_probe = true;
+            session->last_transit_us = transit_us;
+        }
+    }
+}
+
+struct histogram_snapshot {
+    std::array<uint64_t, metrics::histogram::bucket_count> buckets {};
+    uint64_t count = 0;
+
+    void add(const metrics::histogram& h)
+    {
+        for (size_t i = 0; i < buckets.size(); ++i) {
+            buckets[i] += h.bucket(i);
+            count += h.bucket(i);
+        }
+        count += h.overflow();
+    }
+
+    histogram_snapshot operator-(const histogram_snapshot& other) const
+    {
+        histogram_snapshot r;
+        for (size_t i = 0; i < buckets.size(); ++i) {
+            r.buckets[i] = buckets[i] - other.buckets[i];
+        }
+        r.count = count - other.count;
+        return r;
+    }
+
+    // upper bound of the bucket that holds the percentile
+    uint64_t percentile(double p) const
+    {
+        if (count == 0) {
+            return 0;
+        }
+        auto rank = (uint64_t)(p * (double)count);
+        uint64_t cumulative = 0;
+        for (size_t i = 0; i < buckets.size(); ++i) {
+            cumulative += buckets[i];
+            if (cumulative > rank) {
+                return uint64_t(1) << i;
+            }
+        }
+        // in the overflow, above the last bound
+        return uint64_t(1) << buckets.size();
+    }
+};
+
+struct snapshot_t {
+    uint64_t established = 0;
+    int64_t last_established = 0;
+    uint64_t failed = 0;
+    uint64_t closed = 0;
+    uint64_t packets = 0;
+    uint64_t bytes = 0;
+    histogram_snapshot handshake;
+    histogram_snapshot interarrival;
+    histogram_snapshot jitter;
+    histogram_snapshot latency;
+};
+
+snapshot_t take_snapshot(const std::vector<std::unique_ptr<thread_stats>>& stats)
+{
+    snapshot_t s;
+    for (auto& t : stats) {
+        s.established += t->established.value();
+        s.last_established = std::max(s.last_established, t->last_established.value());
+        s.failed += t->failed.value();
+        s.closed += t->closed.value();
+        s.packets += t->packets.value();
+        s.bytes += t->bytes.value();
+        s.handshake.add(t->handshake);
+        s.interarrival.add(t->interarrival);
+        s.jitter.add(t->jitter);
+        s.latency.add(t->latency);
+    }
+    return s;
+}
+
+struct process_usage {
+    double cpu_s = 0;
+    uint64_t rss_bytes = 0;
+};
+
+process_usage read_process_usage(int pid)
+{
+    process_usage usage;
+#ifdef linux
+    std::ifstream stat_file(fmt::format("/proc/{}/stat", pid));
+    std::string stat((std::istreambuf_iterator<char>(stat_file)), std::istreambuf_iterator<char>());
+    auto pos = stat.rfind(')');
+    if (pos != std::string::npos) {
+        // fields after the command name start at field 3 (state), utime and stime are 14 and 15
+        std::istringstream ss(stat.substr(pos + 2));
+        std::string field;
+        uint64_t utime = 0, stime = 0;
+        for (int i = 3; i <= 15 && ss >> field; ++i) {
+            if (i == 14) {
+                utime = std::stoull(field);
+            } else if (i == 15) {
+                stime = std::stoull(field);
+            }
+        }
+        usage.cpu_s = (double)(utime + stime) / (double)sysconf(_SC_CLK_TCK);
+    }
+    std::ifstream statm_file(fmt::format("/proc/{}/statm", pid));
+    uint64_t size = 0, resident = 0;
+    if (statm_file >> size >> resident) {
+        usage.rss_bytes = resident * (uint64_t)sysconf(_SC_PAGESIZE);
+    }
+#endif
+    return usage;
+}
+
+void raise_fd_limit()
+{
+#ifdef linux
+    struct rlimit limit {};
+    if (getrlimit(RLIMIT_NOFILE, &limit) == 0 && limit.rlim_cur < limit.rlim_max) {
+        limit.rlim_cur = limit.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &limit);
+    }
+#endif
+}
+
+} // namespace
+
+int main(int argc, char* argv[])
+{
+    cxxopts::Options options("as-load-generator", "Ramp up simulated receivers against a running server and print one JSON line per step");
+
+    // clang-format off
+    options.add_options()
+        ("h,help", "Print usage")
+        ("connect", "Server address", cxxopts::value<std::string>()->default_value("127.0.0.1:65530"), "[host][:<port>]")
+        ("sessions", "Total number of sessions", cxxopts::value<int>()->default_value("1000"), "[n]")
+        ("step", "Sessions added per step", cxxopts::value<int>()->default_value("100"), "[n]")
+        ("step-duration", "Seconds to measure after each step", cxxopts::value<int>()->default_value("5"), "[seconds]")
+        ("threads", "Number of io threads", cxxopts::value<int>()->default_value("2"), "[n]")
+        ("server-pid", "Report CPU and memory of this process", cxxopts::value<int>()->default_value("0"), "[pid]")
+        ("V,verbose", "Log failed sessions")
+        ;
+    // clang-format on
+
+    cxxopts::ParseResult result;
+    try {
+        result = options.parse(argc, argv);
+    } catch (const cxxopts::exceptions::exception& e) {
+        std::cerr << e.what() << '\n'
+                  << options.help();
+        return EXIT_FAILURE;
+    }
+    if (result.count("help")) {
+        std::cout << options.help();
+        return EXIT_SUCCESS;
+    }
+    spdlog::set_level(result.count("verbose") ? spdlog::level::debug : spdlog::level::warn);
+
+    auto address = result["connect"].as<std::string>();
+    auto pos = address.find(':');
+    ip::tcp::endpoint endpoint {
+        ip::make_address(address.substr(0, pos)),
+        pos == std::string::npos ? (uint16_t)65530 : (uint16_t)std::stoi(address.substr(pos + 1)),
+    };
+    const int total_sessions = result["sessions"].as<int>();
+    const int step = std::max(1, result["step"].as<int>());
+    const auto step_duration = std::chrono::seconds(result["step-duration"].as<int>());
+    const int thread_count = std::max(1, result["threads"].as<int>());
+    const int server_pid = result["server-pid"].as<int>();
+
+    raise_fd_limit();
+
+    std::vector<std::unique_ptr<asio::io_context>> contexts;
+    std::vector<asio::executor_work_guard<asio::io_context::executor_type>> work_guards;
+    std::vector<std::unique_ptr<thread_stats>> stats;
+    std::vector<std::thread> threads;
+    for (int i = 0; i < thread_count; ++i) {
+        auto& ioc = contexts.emplace_back(std::make_unique<asio::io_context>(1));
+        work_guards.push_back(asio::make_work_guard(*ioc));
+        stats.push_back(std::make_unique<thread_stats>());
+    }
+    for (auto& ioc : contexts) {
+        threads.emplace_back([ioc = ioc.get()] {
+            ioc->run();
+        });
+    }
+
+    int sessions = 0;
+    auto last = take_snapshot(stats);
+    auto last_server = read_process_usage(server_pid);
+    std::chrono::nanoseconds last_cpu {};
+    for (auto& t : threads) {
+        last_cpu += thread_util::cpu_time(t);
+    }
+
+    while (sessions < total_sessions) {
+        const int target = std::min(total_sessions, sessions + step);
+        const auto step_begin = std::chrono::steady_clock::now().time_since_epoch().count();
+        for (; sessions < target; ++sessions) {
+            auto index = sessions % thread_count;
+            asio::co_spawn(*contexts[index], run_session(endpoint, *stats[index]), asio::detached);
+        }
+
+        std::this_thread::sleep_for(step_duration);
+
+        auto now = take_snapshot(stats);
+        auto server = read_process_usage(server_pid);
+        std::chrono::nanoseconds cpu {};
+        for (auto& t : threads) {
+            cpu += thread_util::cpu_time(t);
+        }
+        const double seconds = std::chrono::duration<double>(step_duration).count();
+        auto interarrival = now.interarrival - last.interarrival;
+        auto jitter = now.jitter - last.jitter;
+        auto latency = now.latency - last.latency;
+        // from the start of the step to its last handshake
+        double handshakes_per_s = 0;
+        if (now.established > last.established && now.last_established > step_begin) {
+            handshakes_per_s = (double)(now.established - last.established) / ((double)(now.last_established - step_begin) / 1e9);
+        }
+
+        fmt::print(R"({{"sessions": {}, "established": {}, "failed": {}, "closed": {}, )"
+                   R"("rx_packets_per_s": {:.1f}, "rx_bytes_per_s": {:.1f}, "handshakes_per_s": {:.1f}, )"
+                   R"("handshake_us": {{"p50": {}, "p99": {}}}, "interarrival_us": {{"p50": {}, "p99": {}, "p999": {}}}, )"
+                   R"("jitter_us": {{"p50": {}, "p99": {}}}, "latency_us": {{"p50": {}, "p99": {}}}, )"
+                   R"("server": {{"cpu_percent": {:.2f}, "rss_bytes": {}}}, "generator_cpu_percent": {:.2f}}})"
+                   "\n",
+            sessions, now.established, now.failed, now.closed,
+            (double)(now.packets - last.packets) / seconds, (double)(now.bytes - last.bytes) / seconds, handshakes_per_s,
+            now.handshake.percentile(0.5), now.handshake.percentile(0.99),
+            interarrival.percentile(0.5), interarrival.percentile(0.99), interarrival.percentile(0.999),
+            jitter.percentile(0.5), jitter.percentile(0.99), latency.percentile(0.5), latency.percentile(0.99),
+            (server.cpu_s - last_server.cpu_s) / seconds * 100.0, server.rss_bytes,
+            std::chrono::duration<double>(cpu - last_cpu).count() / seconds * 100.0);
+        std::fflush(stdout);
+
+        last = now;
+        last_server = server;
+        last_cpu = cpu;
+    }
+
+    for (auto& ioc : contexts) {
+        ioc->stop();
+    }
+    for (auto& t : threads) {
+        t.join();
+    }
+    return EXIT_SUCCESS;
+}
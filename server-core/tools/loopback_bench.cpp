@@ -0,0 +1,283 @@
+/*
+   Copyright 2022-2024 mkckr0 <https://github.com/mkckr0>
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+*/
+
+// End to end benchmark: one server with a synthetic capture source and N
+// clients in the same process, all over 127.0.0.1 or a Unix socket. The real
+// network_manager server and client code paths are used, only the audio
+// backends are replaced.
+
+#include <algorithm>
+#include <atomic>
+#include <ctime>
+#include <iostream>
+#include <memory>
+#include <thread>
+#include <vector>
+
+#include <cxxopts.hpp>
+#include <fmt/format.h>
+#include <spdlog/spdlog.h>
+
+#include "audio_manager.hpp"
+#include "metrics.hpp"
+#include "network_manager.hpp"
+#include "synthetic_source.hpp"
+#include "tracer.hpp"
+
+using namespace std::chrono_literals;
+
+namespace {
+
+std::atomic_bool g_measuring = false;
+
+// Only touched by the client's network thread while the benchmark runs.
+struct client_stats {
+    uint64_t packets = 0;
+    uint64_t bytes = 0;
+    uint64_t reordered = 0;
+    uint64_t duplicates = 0;
+    bool started = false;
+    uint32_t first_seq = 0;
+    uint32_t max_seq = 0;
+    std::vector<uint8_t> seen; // indexed by seq - first_seq
+    std::vector<uint32_t> latency_us;
+
+    void on_datagram(const char* data, size_t size)
+    {
+        if (!g_measuring.load(std::memory_order_relaxed)) {
+            return;
+        }
+        auto now = std::chrono::steady_clock::now();
+
+        ++packets;
+        bytes += size;
+
+        synthetic_source::probe_t probe;
+        if (!synthetic_source::read_probe(data, size, probe)) {
+            return;
+        }
+        auto sent = std::chrono::steady_clock::time_point(std::chrono::nanoseconds(probe.timestamp_ns));
+        latency_us.push_back((uint32_t)std::chrono::duration_cast<std::chrono::microseconds>(now - sent).count());
+
+        if (!started) {
+            started = true;
+            first_seq = max_seq = probe.seq;
+        }
+        if (probe.seq < first_seq) {
+            ++reordered;
+            return;
+        }
+        size_t index = probe.seq - first_seq;
+        if (index >= seen.size()) {
+            seen.resize(index + 1);
+        }
+        if (seen[index]) {
+            ++duplicates;
+            return;
+        }
+        seen[index] = 1;
+        if (probe.seq < max_seq) {
+            ++reordered;
+        }
+        max_seq = std::max(max_seq, probe.seq);
+    }
+
+    uint64_t lost() const
+    {
+        if (!started) {
+            return 0;
+        }
+        auto received = (uint64_t)std::count(seen.begin(), seen.end(), 1);
+        return (uint64_t)(max_seq - first_seq + 1) - received;
+    }
+};
+
+uint32_t percentile(std::vector<uint32_t>& sorted, double p)
+{
+    if (sorted.empty()) {
+        return 0;
+    }
+    auto index = (size_t)(p * (double)(sorted.size() - 1));
+    return sorted[index];
+}
+
+double seconds(std::chrono::nanoseconds d)
+{
+    return std::chrono::duration<double>(d).count();
+}
+
+} // namespace
+
+int main(int argc, char* argv[])
+{
+    cxxopts::Options options("as-loopback-bench", "Run a server and N clients in process over 127.0.0.1 or a Unix socket and report a JSON summary");
+
+    // clang-format off
+    options.add_options()
+        ("h,help", "Print usage")
+        ("clients", "Number of clients", cxxopts::value<int>()->default_value("4"), "[n]")
+        ("duration", "Measured duration in seconds", cxxopts::value<int>()->default_value("10"), "[seconds]")
+        ("warmup", "Warm-up before measuring in seconds", cxxopts::value<int>()->default_value("1"), "[seconds]")
+        ("port", "Server port", cxxopts::value<uint16_t>()->default_value("65531"), "[port]")
+        ("unix", "Run the sessions and the audio over a Unix socket at this path instead of 127.0.0.1, Linux only", cxxopts::value<std::string>()->implicit_value("/tmp/as-loopback-bench.sock"), "[path]")
+        ("encoding", "Synthetic source encoding", cxxopts::value<audio_manager::encoding_t>()->default_value("f32"), "[encoding]")
+        ("channels", "Synthetic source channels", cxxopts::value<int>()->default_value("2"), "[channels]")
+        ("sample-rate", "Synthetic source sample rate(Hz)", cxxopts::value<int>()->default_value("48000"), "[sample_rate]")
+        ("period", "Synthetic source quantum in microseconds", cxxopts::value<int>()->default_value("10000"), "[us]")
+        ("impair", "Impair the server's audio datagrams, see as-cmd --help", cxxopts::value<std::string>(), "[spec]")
+        ("trace", "Write a Chrome trace of the measured duration, open it in https://ui.perfetto.dev", cxxopts::value<std::string>(), "[file]")
+        ("V,verbose", "Set log level to \"trace\"")
+        ;
+    // clang-format on
+
+    cxxopts::ParseResult result;
+    try {
+        result = options.parse(argc, argv);
+    } catch (const cxxopts::exceptions::exception& e) {
+        std::cerr << e.what() << '\n'
+                  << options.help();
+        return EXIT_FAILURE;
+    }
+    if (result.count("help")) {
+        std::cout << options.help();
+        return EXIT_SUCCESS;
+    }
+    spdlog::set_level(result.count("verbose") ? spdlog::level::trace : spdlog::level::warn);
+
+    const int client_count = result["clients"].as<int>();
+    const auto duration = std::chrono::seconds(result["duration"].as<int>());
+    const auto warmup = std::chrono::seconds(result["warmup"].as<int>());
+    const auto port = result["port"].as<uint16_t>();
+    const std::string host = result.count("unix") ? "unix:" + result["unix"].as<std::string>() : "127.0.0.1";
+
+    audio_manager::capture_config capture_config;
+    capture_config.synthetic = true;
+    capture_config.encoding = result["encoding"].as<audio_manager::encoding_t>();
+    capture_config.channels = result["channels"].as<int>();
+    capture_config.sample_rate = result["sample-rate"].as<int>();
+    capture_config.synthetic_period = std::chrono::microseconds(result["period"].as<int>());
+
+    network_manager::server_config server_config;
+    if (result.count("impair")) {
+        try {
+            server_config.impairment = impairment::config::parse(result["impair"].as<std::string>());
+        } catch (const std::invalid_argument& e) {
+            std::cerr << e.what() << '\n';
+            return EXIT_FAILURE;
+        }
+    }
+
+    auto server_audio = std::make_shared<audio_manager>();
+    auto server = std::make_shared<network_manager>(server_audio);
+    server->start_server(host, port, capture_config, server_config);
+
+    // the clients never touch their audio backend, so they can share one
+    auto client_audio = std::make_shared<audio_manager>();
+    std::vector<std::shared_ptr<network_manager>> clients;
+    std::vector<std::unique_ptr<client_stats>> stats;
+    const auto expected_packets = (size_t)(duration / capture_config.synthetic_period + 1) * 8;
+    for (int i = 0; i < client_count; ++i) {
+        auto& s = stats.emplace_back(std::make_unique<client_stats>());
+        s->latency_us.reserve(expected_packets);
+        s->seen.reserve(expected_packets);
+
+        auto client = std::make_shared<network_manager>(client_audio);
+        client->set_datagram_handler([s = s.get()](const char* data, size_t size) {
+            s->on_datagram(data, size);
+        });
+        client->start_client(host, port);
+        clients.push_back(client);
+    }
+
+    std::this_thread::sleep_for(warmup);
+
+    auto server_net_cpu = server->net_thread_cpu_time();
+    auto server_capture_cpu = server_audio->record_thread_cpu_time();
+    std::vector<std::chrono::nanoseconds> client_cpu;
+    for (auto& client : clients) {
+        client_cpu.push_back(client->net_thread_cpu_time());
+    }
+    auto process_cpu = std::clock();
+    auto udp_bytes_sent = metrics::get().udp_bytes_sent.value();
+    if (result.count("trace")) {
+        tracer::start();
+    }
+    auto begin = std::chrono::steady_clock::now();
+    g_measuring = true;
+
+    std::this_thread::sleep_for(duration);
+
+    g_measuring = false;
+    auto elapsed = std::chrono::steady_clock::now() - begin;
+    if (result.count("trace") && !tracer::write(result["trace"].as<std::string>())) {
+        spdlog::error("failed to write the trace to {}", result["trace"].as<std::string>());
+    }
+    process_cpu = std::clock() - process_cpu;
+    udp_bytes_sent = metrics::get().udp_bytes_sent.value() - udp_bytes_sent;
+    server_net_cpu = server->net_thread_cpu_time() - server_net_cpu;
+    server_capture_cpu = server_audio->record_thread_cpu_time() - server_capture_cpu;
+    for (size_t i = 0; i < clients.size(); ++i) {
+        client_cpu[i] = clients[i]->net_thread_cpu_time() - client_cpu[i];
+    }
+
+    for (auto& client : clients) {
+        client->stop_client();
+    }
+    server->stop_server();
+
+    uint64_t total_bytes = 0;
+    std::string clients_json;
+    for (size_t i = 0; i < stats.size(); ++i) {
+        auto& s = *stats[i];
+        total_bytes += s.bytes;
+        std::sort(s.latency_us.begin(), s.latency_us.end());
+        if (i) {
+            clients_json += ",\n";
+        }
+        clients_json += fmt::format(
+            R"(    {{"id": {}, "packets": {}, "bytes": {}, "lost": {}, "reordered": {}, "duplicates": {}, )"
+            R"("latency_us": {{"p50": {}, "p90": {}, "p99": {}, "p999": {}, "max": {}}}, "cpu_s": {:.6f}}})",
+            i, s.packets, s.bytes, s.lost(), s.reordered, s.duplicates,
+            percentile(s.latency_us, 0.5), percentile(s.latency_us, 0.9), percentile(s.latency_us, 0.99), percentile(s.latency_us, 0.999),
+            s.latency_us.empty() ? 0 : s.latency_us.back(), seconds(client_cpu[i]));
+    }
+
+    audio_manager::AudioFormat format;
+    format.ParseFromString(server_audio->get_format_binary());
+
+    const double elapsed_s = std::chrono::duration<double>(elapsed).count();
+    fmt::print(R"({{
+  "clients": {},
+  "transport": "{}",
+  "duration_s": {:.3f},
+  "format": {{"encoding": "{}", "channels": {}, "sample_rate": {}, "period_us": {}}},
+  "throughput_bytes_per_s": {:.1f},
+  "server": {{"udp_bytes_sent": {}, "net_cpu_s": {:.6f}, "capture_cpu_s": {:.6f}}},
+  "process_cpu_s": {:.6f},
+  "per_client": [
+{}
+  ]
+}}
+)",
+        client_count, result.count("unix") ? "unix" : "udp", elapsed_s,
+        audio_manager::AudioFormat::Encoding_Name(format.encoding()), format.channels(), format.sample_rate(), capture_config.synthetic_period.count(),
+        (double)total_bytes / elapsed_s,
+        udp_bytes_sent, seconds(server_net_cpu), seconds(server_capture_cpu),
+        (double)process_cpu / CLOCKS_PER_SEC,
+        clients_json);
+
+    return EXIT_SUCCESS;
+}
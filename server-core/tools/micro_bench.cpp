@@ -0,0 +1,570 @@
+/*
+   Copyright 2022-2024 mkckr0 <https://github.com/mkckr0>
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+*/
+
+// Microbenchmarks for the server hot path.
+//
+// Run with --benchmark_format=json (or --benchmark_out=<file>
+// --benchmark_out_format=json) to get machine readable results that can be
+// compared between runs.
+
+#include <benchmark/benchmark.h>
+
+#include <algorithm>
+#include <atomic>
+#include <barrier>
+#include <cmath>
+#include <cstring>
+#include <map>
+#include <memory>
+#include <random>
+#include <thread>
+#include <vector>
+
+#include "pre_asio.hpp"
+#include <asio.hpp>
+
+#include "audio_pipeline.hpp"
+#include "client.pb.h"
+#include "packetizer.hpp"
+#include "sample_convert.hpp"
+#include "shm_ring.hpp"
+#include "uring_sender.hpp"
+
+#ifdef linux
+#include <sys/socket.h>
+#include <unistd.h>
+#endif
+
+namespace ip = asio::ip;
+using namespace io::github::mkckr0::audio_share_app::pb;
+
+namespace {
+
+// 10ms at 48kHz, the usual capture quantum
+constexpr int quantum_frames = 480;
+
+std::vector<char> make_quantum(int block_align)
+{
+    std::vector<char> data(quantum_frames * block_align);
+    std::mt19937 rng(1);
+    for (auto& c : data) {
+        c = (char)rng();
+    }
+    return data;
+}
+
+void BM_split_segments(benchmark::State& state)
+{
+    const int block_align = (int)state.range(0);
+    const int mtu = (int)state.range(1);
+    auto data = make_quantum(block_align);
+
+    size_t segments = 0;
+    for (auto _ : state) {
+        auto seg_list = packetizer::split(data.data(), data.size(), block_align, mtu);
+        segments = seg_list.size();
+        benchmark::DoNotOptimize(seg_list);
+    }
+    state.SetBytesProcessed((int64_t)state.iterations() * (int64_t)data.size());
+    state.counters["segments"] = (double)segments;
+}
+// block_align: s16 stereo, f32 stereo, s24 5.1, s32 7.1
+BENCHMARK(BM_split_segments)->ArgsProduct({ { 4, 8, 18, 32 }, { 576, 1492, 9000 } })->ArgNames({ "block_align", "mtu" });
+
+// The segments point into the quantum and keep its owner, like the segments
+// of a held PipeWire buffer, instead of copying it.
+void BM_split_in_place(benchmark::State& state)
+{
+    const int block_align = (int)state.range(0);
+    auto data = make_quantum(block_align);
+    auto owner = std::make_shared<int>(0);
+
+    size_t segments = 0;
+    for (auto _ : state) {
+        auto seg_list = packetizer::split(data.data(), data.size(), block_align, packetizer::default_mtu, owner);
+        segments = seg_list.size();
+        benchmark::DoNotOptimize(seg_list);
+    }
+    state.SetBytesProcessed((int64_t)state.iterations() * (int64_t)data.size());
+    state.counters["segments"] = (double)segments;
+}
+BENCHMARK(BM_split_in_place)->Arg(4)->Arg(8)->Arg(18)->Arg(32)->ArgName("block_align");
+
+// One server socket and peers receivers on loopback. The receivers are never
+// read, the kernel drops what doesn't fit.
+struct loopback_fan_out {
+    explicit loopback_fan_out(int peers, bool reuse_port = false)
+        : server(ioc, ip::udp::v4())
+    {
+#ifdef linux
+        // lets BM_fan_out_connected bind a socket per peer to the port
+        int on = 1;
+        if (reuse_port) {
+            setsockopt(server.native_handle(), SOL_SOCKET, SO_REUSEPORT, &on, sizeof(on));
+        }
+#endif
+        server.bind(ip::udp::endpoint(ip::address_v4::loopback(), 0));
+        for (int i = 0; i < peers; ++i) {
+            auto& socket = receivers.emplace_back(ioc, ip::udp::endpoint(ip::address_v4::loopback(), 0));
+            endpoints.push_back(socket.local_endpoint());
+        }
+    }
+
+    asio::io_context ioc;
+    ip::udp::socket server;
+    std::vector<ip::udp::socket> receivers;
+    std::vector<ip::udp::endpoint> endpoints;
+};
+
+// Same send pattern as network_manager::broadcast_audio_data: one async_send_to
+// per segment and peer from a single socket, then wait for every completion.
+void BM_fan_out_loopback(benchmark::State& state)
+{
+    const int peers = (int)state.range(0);
+    constexpr int block_align = 8;
+    auto data = make_quantum(block_align);
+    loopback_fan_out fan_out(peers);
+
+    size_t errors = 0;
+    for (auto _ : state) {
+        auto seg_list = packetizer::split(data.data(), data.size(), block_align);
+        for (const auto& seg : seg_list) {
+            for (const auto& endpoint : fan_out.endpoints) {
+                fan_out.server.async_send_to(asio::buffer(seg->data(), seg->size()), endpoint, [seg, &errors](const asio::error_code& ec, std::size_t) {
+                    errors += ec ? 1 : 0;
+                });
+            }
+        }
+        fan_out.ioc.restart();
+        fan_out.ioc.run();
+    }
+    state.SetBytesProcessed((int64_t)state.iterations() * (int64_t)data.size() * peers);
+    state.counters["errors"] = (double)errors;
+}
+BENCHMARK(BM_fan_out_loopback)->RangeMultiplier(4)->Range(1, 256)->ArgName("peers")->UseRealTime();
+
+// The fast path of network_manager: a synchronous send_to on the non-blocking
+// socket, async_send_to only when it would block.
+void BM_fan_out_nonblocking(benchmark::State& state)
+{
+    const int peers = (int)state.range(0);
+    constexpr int block_align = 8;
+    auto data = make_quantum(block_align);
+    loopback_fan_out fan_out(peers);
+    fan_out.server.non_blocking(true);
+
+    size_t errors = 0;
+    size_t would_block = 0;
+    for (auto _ : state) {
+        auto seg_list = packetizer::split(data.data(), data.size(), block_align);
+        for (const auto& seg : seg_list) {
+            for (const auto& endpoint : fan_out.endpoints) {
+                asio::error_code ec;
+                fan_out.server.send_to(asio::buffer(seg->data(), seg->size()), endpoint, 0, ec);
+                if (ec != asio::error::would_block) {
+                    errors += ec ? 1 : 0;
+                    continue;
+                }
+                ++would_block;
+                fan_out.server.async_send_to(asio::buffer(seg->data(), seg->size()), endpoint, [seg, &errors](const asio::error_code& ec, std::size_t) {
+                    errors += ec ? 1 : 0;
+                });
+            }
+        }
+        fan_out.ioc.restart();
+        fan_out.ioc.run();
+    }
+    state.SetBytesProcessed((int64_t)state.iterations() * (int64_t)data.size() * peers);
+    state.counters["errors"] = (double)errors;
+    state.counters["would_block"] = (double)would_block;
+}
+BENCHMARK(BM_fan_out_nonblocking)->RangeMultiplier(4)->Range(1, 256)->ArgName("peers")->UseRealTime();
+
+#ifdef linux
+// The same fan-out with one sendmmsg call for all the datagrams of a quantum.
+void BM_fan_out_sendmmsg(benchmark::State& state)
+{
+    const int peers = (int)state.range(0);
+    constexpr int block_align = 8;
+    auto data = make_quantum(block_align);
+    loopback_fan_out fan_out(peers);
+    const int fd = fan_out.server.native_handle();
+
+    std::vector<mmsghdr> msgs;
+    std::vector<iovec> iovs;
+    size_t errors = 0;
+    for (auto _ : state) {
+        auto seg_list = packetizer::split(data.data(), data.size(), block_align);
+        msgs.clear();
+        iovs.clear();
+        iovs.reserve(seg_list.size());
+        for (const auto& seg : seg_list) {
+            iovs.push_back({ const_cast<uint8_t*>(seg->data()), seg->size() });
+            for (auto& endpoint : fan_out.endpoints) {
+                mmsghdr msg {};
+                msg.msg_hdr.msg_name = endpoint.data();
+                msg.msg_hdr.msg_namelen = (socklen_t)endpoint.size();
+                msg.msg_hdr.msg_iov = &iovs.back();
+                msg.msg_hdr.msg_iovlen = 1;
+                msgs.push_back(msg);
+            }
+        }
+        // the kernel takes at most UIO_MAXIOV messages per call
+        for (size_t i = 0; i < msgs.size();) {
+            auto n = sendmmsg(fd, msgs.data() + i, (unsigned)std::min<size_t>(msgs.size() - i, 1024), 0);
+            if (n < 0) {
+                errors += msgs.size() - i;
+                break;
+            }
+            i += n;
+        }
+    }
+    state.SetBytesProcessed((int64_t)state.iterations() * (int64_t)data.size() * peers);
+    state.counters["errors"] = (double)errors;
+}
+BENCHMARK(BM_fan_out_sendmmsg)->RangeMultiplier(4)->Range(1, 256)->ArgName("peers")->UseRealTime();
+
+// The fan-out of BM_fan_out_loopback with connected_peers: one socket per
+// peer on the server port, connected to it, sends without a destination.
+void BM_fan_out_connected(benchmark::State& state)
+{
+    const int peers = (int)state.range(0);
+    constexpr int block_align = 8;
+    auto data = make_quantum(block_align);
+    loopback_fan_out fan_out(peers, true);
+
+    std::vector<ip::udp::socket> sockets;
+    for (const auto& endpoint : fan_out.endpoints) {
+        auto& socket = sockets.emplace_back(fan_out.ioc, ip::udp::v4());
+        int on = 1;
+        setsockopt(socket.native_handle(), SOL_SOCKET, SO_REUSEPORT, &on, sizeof(on));
+        socket.bind(fan_out.server.local_endpoint());
+        socket.connect(endpoint);
+    }
+
+    size_t errors = 0;
+    for (auto _ : state) {
+        auto seg_list = packetizer::split(data.data(), data.size(), block_align);
+        for (const auto& seg : seg_list) {
+            for (auto& socket : sockets) {
+                socket.async_send(asio::buffer(seg->data(), seg->size()), [seg, &errors](const asio::error_code& ec, std::size_t) {
+                    errors += ec ? 1 : 0;
+                });
+            }
+        }
+        fan_out.ioc.restart();
+        fan_out.ioc.run();
+    }
+    state.SetBytesProcessed((int64_t)state.iterations() * (int64_t)data.size() * peers);
+    state.counters["errors"] = (double)errors;
+}
+BENCHMARK(BM_fan_out_connected)->RangeMultiplier(4)->Range(1, 256)->ArgName("peers")->UseRealTime();
+
+// The fan-out of the sender threads: every thread sends to its share of 256
+// peers, from the one server socket or from its own socket on the port.
+void BM_fan_out_threads(benchmark::State& state)
+{
+    const int threads = (int)state.range(0);
+    const bool shared_socket = state.range(1) != 0;
+    constexpr int peers = 256;
+    constexpr int block_align = 8;
+    auto data = make_quantum(block_align);
+    auto seg_list = packetizer::split(data.data(), data.size(), block_align);
+    loopback_fan_out fan_out(peers, true);
+
+    std::vector<ip::udp::socket> sockets;
+    for (int i = 0; i < threads; ++i) {
+        auto& socket = sockets.emplace_back(fan_out.ioc, ip::udp::v4());
+        int on = 1;
+        setsockopt(socket.native_handle(), SOL_SOCKET, SO_REUSEPORT, &on, sizeof(on));
+        socket.bind(fan_out.server.local_endpoint());
+    }
+
+    std::atomic<size_t> errors = 0;
+    std::atomic_bool stopped = false;
+    std::barrier start(threads + 1);
+    std::barrier done(threads + 1);
+    std::vector<std::thread> workers;
+    for (int t = 0; t < threads; ++t) {
+        workers.emplace_back([&, t] {
+            auto& socket = shared_socket ? fan_out.server : sockets[t];
+            while (true) {
+                start.arrive_and_wait();
+                if (stopped) {
+                    return;
+                }
+                size_t failed = 0;
+                for (const auto& seg : seg_list) {
+                    for (size_t i = t; i < fan_out.endpoints.size(); i += threads) {
+                        asio::error_code ec;
+                        socket.send_to(asio::buffer(seg->data(), seg->size()), fan_out.endpoints[i], 0, ec);
+                        failed += ec ? 1 : 0;
+                    }
+                }
+                errors += failed;
+                done.arrive_and_wait();
+            }
+        });
+    }
+
+    for (auto _ : state) {
+        start.arrive_and_wait();
+        done.arrive_and_wait();
+    }
+    stopped = true;
+    start.arrive_and_wait();
+    for (auto& worker : workers) {
+        worker.join();
+    }
+    state.SetBytesProcessed((int64_t)state.iterations() * (int64_t)data.size() * peers);
+    state.counters["errors"] = (double)errors;
+}
+BENCHMARK(BM_fan_out_threads)->ArgsProduct({ { 1, 2, 4 }, { 1, 0 } })->ArgNames({ "threads", "shared_socket" })->UseRealTime();
+
+// The same fan-out through uring_sender: one submission per quantum, then
+// wait until the reaper thread saw every completion.
+void BM_fan_out_uring(benchmark::State& state)
+{
+    if (!uring_sender::supported()) {
+        state.SkipWithError("io_uring isn't available");
+        return;
+    }
+    const int peers = (int)state.range(0);
+    constexpr int block_align = 8;
+    auto data = make_quantum(block_align);
+    loopback_fan_out fan_out(peers);
+
+    std::atomic<size_t> completed { 0 };
+    std::atomic<size_t> errors { 0 };
+    uring_sender::config config;
+    config.entries = 1024; // a quantum to 256 peers is 768 sends
+    uring_sender sender(fan_out.server.native_handle(), config, [&](void*, size_t, int result) {
+        if (result < 0) {
+            errors.fetch_add(1, std::memory_order_relaxed);
+        }
+        completed.fetch_add(1, std::memory_order_release);
+    });
+
+    size_t queued = 0;
+    for (auto _ : state) {
+        auto seg_list = packetizer::split(data.data(), data.size(), block_align);
+        for (const auto& seg : seg_list) {
+            int buffer = sender.acquire(seg->data(), seg->size(), seg);
+            if (buffer < 0) {
+                state.SkipWithError("no free buffer");
+                return;
+            }
+            for (const auto& endpoint : fan_out.endpoints) {
+                if (sender.send_to(buffer, endpoint.data(), (uint32_t)endpoint.size(), nullptr)) {
+                    ++queued;
+                } else {
+                    errors.fetch_add(1, std::memory_order_relaxed);
+                }
+            }
+            sender.release(buffer);
+        }
+        sender.submit();
+        while (completed.load(std::memory_order_acquire) != queued) {
+            std::this_thread::yield();
+        }
+    }
+    state.SetBytesProcessed((int64_t)state.iterations() * (int64_t)data.size() * peers);
+    state.counters["errors"] = (double)errors.load();
+}
+BENCHMARK(BM_fan_out_uring)->RangeMultiplier(4)->Range(1, 256)->ArgName("peers")->UseRealTime();
+
+// A quantum to readers on the same host over loopback UDP: a send per segment
+// and reader, then every reader receives its datagrams. Compare with BM_local_shm.
+void BM_local_udp(benchmark::State& state)
+{
+    const int readers = (int)state.range(0);
+    constexpr int block_align = 8;
+    auto data = make_quantum(block_align);
+    auto seg_list = packetizer::split(data.data(), data.size(), block_align);
+    loopback_fan_out fan_out(readers);
+    for (auto& receiver : fan_out.receivers) {
+        receiver.non_blocking(true);
+    }
+
+    std::array<char, 4096> buffer;
+    size_t lost = 0;
+    for (auto _ : state) {
+        for (const auto& seg : seg_list) {
+            for (const auto& endpoint : fan_out.endpoints) {
+                asio::error_code ec;
+                fan_out.server.send_to(asio::buffer(seg->data(), seg->size()), endpoint, 0, ec);
+            }
+        }
+        for (auto& receiver : fan_out.receivers) {
+            for (size_t i = 0; i < seg_list.size(); ++i) {
+                asio::error_code ec;
+                receiver.receive(asio::buffer(buffer), 0, ec);
+                lost += ec ? 1 : 0;
+            }
+        }
+    }
+    state.SetBytesProcessed((int64_t)state.iterations() * (int64_t)data.size() * readers);
+    state.counters["lost"] = (double)lost;
+}
+BENCHMARK(BM_local_udp)->RangeMultiplier(2)->Range(1, 16)->ArgName("readers")->UseRealTime();
+
+// The same through the shared memory ring: one copy into the ring and an
+// eventfd write per reader, then every reader reads the segments in place.
+void BM_local_shm(benchmark::State& state)
+{
+    const int readers = (int)state.range(0);
+    constexpr int block_align = 8;
+    auto data = make_quantum(block_align);
+    auto seg_list = packetizer::split(data.data(), data.size(), block_align);
+    shm_ring::writer writer({});
+    std::vector<std::unique_ptr<shm_ring::reader>> rings;
+    std::vector<int> events;
+    for (int i = 0; i < readers; ++i) {
+        events.push_back(writer.add_reader());
+        rings.push_back(std::make_unique<shm_ring::reader>(dup(writer.fd())));
+    }
+
+    uint64_t checksum = 0;
+    const shm_ring::reader::handler_t consume = [&checksum](const char* data, size_t size) {
+        checksum += (unsigned char)data[0] + (unsigned char)data[size - 1];
+    };
+    for (auto _ : state) {
+        for (const auto& seg : seg_list) {
+            writer.write(seg->data(), seg->size());
+        }
+        writer.notify();
+        for (int i = 0; i < readers; ++i) {
+            uint64_t quanta = 0;
+            benchmark::DoNotOptimize(read(events[i], &quanta, sizeof(quanta)));
+            rings[i]->read(consume);
+        }
+    }
+    benchmark::DoNotOptimize(checksum);
+    uint64_t overruns = 0;
+    for (auto& ring : rings) {
+        overruns += ring->overruns();
+    }
+    state.SetBytesProcessed((int64_t)state.iterations() * (int64_t)data.size() * readers);
+    state.counters["lost"] = (double)overruns;
+}
+BENCHMARK(BM_local_shm)->RangeMultiplier(2)->Range(1, 16)->ArgName("readers")->UseRealTime();
+#endif // linux
+
+void BM_convert(benchmark::State& state)
+{
+    const auto src_encoding = (AudioFormat_Encoding)state.range(0);
+    const auto dst_encoding = (AudioFormat_Encoding)state.range(1);
+    constexpr size_t samples = quantum_frames * 2;
+
+    std::vector<float> f32(samples);
+    for (size_t i = 0; i < samples; ++i) {
+        f32[i] = 0.5f * std::sin((float)i * 0.01f);
+    }
+    std::vector<uint8_t> src(samples * sample_convert::bytes_per_sample(src_encoding));
+    std::vector<uint8_t> dst(samples * sample_convert::bytes_per_sample(dst_encoding));
+    sample_convert::convert(AudioFormat_Encoding_ENCODING_PCM_FLOAT, f32.data(), src_encoding, src.data(), samples);
+
+    for (auto _ : state) {
+        sample_convert::convert(src_encoding, src.data(), dst_encoding, dst.data(), samples);
+        benchmark::DoNotOptimize(dst.data());
+        benchmark::ClobberMemory();
+    }
+    state.SetItemsProcessed((int64_t)state.iterations() * (int64_t)samples);
+    state.SetLabel(AudioFormat_Encoding_Name(src_encoding) + " -> " + AudioFormat_Encoding_Name(dst_encoding));
+}
+BENCHMARK(BM_convert)
+    ->Args({ AudioFormat_Encoding_ENCODING_PCM_FLOAT, AudioFormat_Encoding_ENCODING_PCM_16BIT })
+    ->Args({ AudioFormat_Encoding_ENCODING_PCM_16BIT, AudioFormat_Encoding_ENCODING_PCM_FLOAT })
+    ->Args({ AudioFormat_Encoding_ENCODING_PCM_FLOAT, AudioFormat_Encoding_ENCODING_PCM_24BIT })
+    ->Args({ AudioFormat_Encoding_ENCODING_PCM_24BIT, AudioFormat_Encoding_ENCODING_PCM_FLOAT })
+    ->Args({ AudioFormat_Encoding_ENCODING_PCM_FLOAT, AudioFormat_Encoding_ENCODING_PCM_32BIT })
+    ->Args({ AudioFormat_Encoding_ENCODING_PCM_32BIT, AudioFormat_Encoding_ENCODING_PCM_16BIT })
+    ->Args({ AudioFormat_Encoding_ENCODING_PCM_8BIT, AudioFormat_Encoding_ENCODING_PCM_16BIT })
+    ->ArgNames({ "src", "dst" });
+
+// A quantum through the inline pipeline with one encoder per variant, each
+// converting the f32 quantum to s16, on a worker pool of the given size.
+void BM_encode_variants(benchmark::State& state)
+{
+    const auto variants = (size_t)state.range(0);
+    const auto workers = (size_t)state.range(1);
+    constexpr int channels = 2;
+    constexpr size_t samples = quantum_frames * channels;
+    auto data = make_quantum(channels * 4);
+    for (size_t i = 0; i < samples; ++i) {
+        float v = 0.5f * std::sin((float)i * 0.01f);
+        std::memcpy(data.data() + i * 4, &v, 4);
+    }
+
+    audio_pipeline::config config;
+    config.encode_workers = workers;
+    for (size_t i = 0; i < variants; ++i) {
+        config.encoders.push_back([](const audio_pipeline::quantum_t& quantum, audio_pipeline::variant_t& variant) {
+            const size_t samples = quantum.size / 4;
+            variant.data.resize(samples * 2);
+            sample_convert::convert(AudioFormat_Encoding_ENCODING_PCM_FLOAT, quantum.bytes(), AudioFormat_Encoding_ENCODING_PCM_16BIT, variant.data.data(), samples);
+            variant.size = samples * 2;
+            variant.block_align = channels * 2;
+        });
+    }
+    size_t segments = 0;
+    audio_pipeline pipeline(config, [&segments](audio_pipeline::quantum_t& quantum) {
+        segments = quantum.segments.size();
+        for (auto& variant : quantum.variants) {
+            segments += variant.segments.size();
+        }
+    });
+
+    for (auto _ : state) {
+        pipeline.push(data.data(), data.size(), channels * 4);
+    }
+    state.SetItemsProcessed((int64_t)state.iterations() * (int64_t)(samples * variants));
+    state.counters["segments"] = (double)segments;
+}
+BENCHMARK(BM_encode_variants)->ArgsProduct({ { 1, 4, 16 }, { 0, 2, 4 } })->ArgNames({ "variants", "workers" })->UseRealTime();
+
+// Same container and lookup as network_manager::fill_udp_peer.
+void BM_peer_lookup(benchmark::State& state)
+{
+    struct peer_info_t {
+        int id = 0;
+        ip::udp::endpoint udp_peer;
+    };
+    using playing_peer_list_t = std::map<std::shared_ptr<int>, std::shared_ptr<peer_info_t>>;
+
+    const int peers = (int)state.range(0);
+    playing_peer_list_t playing_peer_list;
+    for (int i = 1; i <= peers; ++i) {
+        auto info = std::make_shared<peer_info_t>();
+        info->id = i;
+        playing_peer_list[std::make_shared<int>(i)] = info;
+    }
+
+    std::mt19937 rng(1);
+    std::uniform_int_distribution<int> dist(1, peers);
+    for (auto _ : state) {
+        int id = dist(rng);
+        auto it = std::find_if(playing_peer_list.begin(), playing_peer_list.end(), [id](const playing_peer_list_t::value_type& e) {
+            return e.second->id == id;
+        });
+        benchmark::DoNotOptimize(it);
+    }
+}
+BENCHMARK(BM_peer_lookup)->RangeMultiplier(4)->Range(1, 4096)->ArgName("peers");
+
+} // namespace
+
+BENCHMARK_MAIN();
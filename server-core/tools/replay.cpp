@@ -0,0 +1,267 @@
+/*
+   Copyright 2022-2024 mkckr0 <https://github.com/mkckr0>
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+*/
+
+// Replays a packet trace recorded with `as-cmd --connect --record` into a model
+// of the client playout buffer and prints underruns and buffering latency as
+// JSON. The model follows the ring buffer of the Windows client: datagrams are
+// appended in arrival order, the device drains it at the sample rate, playback
+// starts once --prefill is buffered, and audio beyond --capacity overwrites
+// the oldest. Only the recorded timestamps are used, so the result is the
+// same whether the trace is replayed at the original pace or as fast as
+// possible, and two traces or two buffer settings can be compared directly.
+
+#include <algorithm>
+#include <iostream>
+#include <thread>
+#include <vector>
+
+#include <cxxopts.hpp>
+#include <fmt/format.h>
+#include <spdlog/spdlog.h>
+
+#include "audio_manager.hpp"
+#include "packet_trace.hpp"
+#include "sample_convert.hpp"
+#include "synthetic_source.hpp"
+
+using namespace std::chrono_literals;
+
+namespace {
+
+using ns = std::chrono::nanoseconds;
+
+struct playout_model {
+    ns prefill;
+    ns capacity;
+
+    bool playing = false;
+    bool starving = false;
+    ns level {};
+    ns last_arrival {};
+
+    uint64_t underruns = 0;
+    ns starved {};
+    ns overflowed {};
+    std::vector<uint32_t> latency_us; // buffered audio after each arrival, i.e. how long the newest sample waits
+
+    void on_arrival(ns timestamp, ns audio)
+    {
+        if (playing) {
+            auto drained = timestamp - last_arrival;
+            if (drained > level) {
+                if (!starving) {
+                    ++underruns;
+                }
+                starving = true;
+                starved += drained - level;
+                level = {};
+            } else {
+                level -= drained;
+            }
+        }
+        last_arrival = timestamp;
+
+        level += audio;
+        starving = false;
+        if (level > capacity) {
+            overflowed += level - capacity;
+            level = capacity;
+        }
+        if (!playing && level >= prefill) {
+            playing = true;
+        }
+        if (playing) {
+            latency_us.push_back((uint32_t)std::chrono::duration_cast<std::chrono::microseconds>(level).count());
+        }
+    }
+};
+
+struct probe_stats {
+    uint64_t probes = 0;
+    uint64_t reordered = 0;
+    bool started = false;
+    uint32_t first_seq = 0;
+    uint32_t max_seq = 0;
+
+    void on_datagram(const char* data, size_t size)
+    {
+        synthetic_source::probe_t probe;
+        if (!synthetic_source::read_probe(data, size, probe)) {
+            return;
+        }
+        ++probes;
+        if (!started) {
+            started = true;
+            first_seq = max_seq = probe.seq;
+            return;
+        }
+        if (probe.seq < max_seq) {
+            ++reordered;
+        }
+        max_seq = std::max(max_seq, probe.seq);
+    }
+
+    // duplicates are counted as received, so this is a lower bound
+    uint64_t lost() const
+    {
+        if (!started) {
+            return 0;
+        }
+        auto expected = (uint64_t)(max_seq - first_seq + 1);
+        return expected > probes ? expected - probes : 0;
+    }
+};
+
+uint32_t percentile(std::vector<uint32_t>& sorted, double p)
+{
+    if (sorted.empty()) {
+        return 0;
+    }
+    auto index = (size_t)(p * (double)(sorted.size() - 1));
+    return sorted[index];
+}
+
+double ms(ns d)
+{
+    return std::chrono::duration<double, std::milli>(d).count();
+}
+
+} // namespace
+
+int main(int argc, char* argv[])
+{
+    cxxopts::Options options("as-replay", "Replay a recorded packet trace against a model of the client playout buffer and report a JSON summary");
+
+    // clang-format off
+    options.add_options()
+        ("h,help", "Print usage")
+        ("file", "Packet trace recorded with as-cmd --connect --record", cxxopts::value<std::string>(), "[file]")
+        ("prefill", "Audio buffered before playback starts in milliseconds", cxxopts::value<int>()->default_value("0"), "[ms]")
+        ("capacity", "Playout buffer capacity in milliseconds. If set \"0\", will use the 1 MiB of the Windows client", cxxopts::value<int>()->default_value("0"), "[ms]")
+        ("realtime", "Replay at the original pace instead of as fast as possible")
+        ("play", "Also play the datagrams through the audio backend, implies --realtime")
+        ("V,verbose", "Set log level to \"trace\"")
+        ;
+    // clang-format on
+    options.parse_positional({ "file" });
+
+    cxxopts::ParseResult result;
+    try {
+        result = options.parse(argc, argv);
+    } catch (const cxxopts::exceptions::exception& e) {
+        std::cerr << e.what() << '\n'
+                  << options.help();
+        return EXIT_FAILURE;
+    }
+    if (result.count("help") || !result.count("file")) {
+        std::cout << options.help();
+        return result.count("help") ? EXIT_SUCCESS : EXIT_FAILURE;
+    }
+    spdlog::set_level(result.count("verbose") ? spdlog::level::trace : spdlog::level::warn);
+
+    const auto path = result["file"].as<std::string>();
+    const bool play = result.count("play");
+    const bool realtime = play || result.count("realtime");
+
+    try {
+        packet_trace::reader reader(path);
+
+        audio_manager::AudioFormat format;
+        if (!format.ParseFromString(reader.format_binary())) {
+            std::cerr << path << " has a bad audio format\n";
+            return EXIT_FAILURE;
+        }
+        const auto bytes_per_second = (int64_t)sample_convert::bytes_per_sample(format.encoding()) * format.channels() * format.sample_rate();
+        if (bytes_per_second <= 0) {
+            std::cerr << path << " has an unsupported audio format\n";
+            return EXIT_FAILURE;
+        }
+        auto to_duration = [bytes_per_second](int64_t bytes) {
+            return ns(bytes * 1000000000 / bytes_per_second);
+        };
+
+        playout_model model;
+        model.prefill = std::chrono::milliseconds(result["prefill"].as<int>());
+        auto capacity_ms = result["capacity"].as<int>();
+        model.capacity = capacity_ms > 0 ? ns(std::chrono::milliseconds(capacity_ms)) : to_duration(1024 * 1024);
+
+        std::shared_ptr<audio_manager> player;
+        if (play) {
+            player = std::make_shared<audio_manager>();
+            player->audio_init(format);
+            player->audio_start();
+        }
+
+        probe_stats probes;
+        uint64_t packets = 0;
+        uint64_t bytes = 0;
+        std::vector<uint32_t> interarrival_us;
+        packet_trace::record_t record;
+        ns last {};
+        auto begin = std::chrono::steady_clock::now();
+        while (reader.next(record)) {
+            if (realtime) {
+                std::this_thread::sleep_until(begin + record.timestamp);
+            }
+            if (player) {
+                player->audio_play(record.payload);
+            }
+
+            if (packets) {
+                interarrival_us.push_back((uint32_t)std::chrono::duration_cast<std::chrono::microseconds>(record.timestamp - last).count());
+            }
+            last = record.timestamp;
+            ++packets;
+            bytes += record.payload.size();
+            probes.on_datagram(record.payload.data(), record.payload.size());
+            model.on_arrival(record.timestamp, to_duration((int64_t)record.payload.size()));
+        }
+
+        if (player) {
+            player->audio_stop();
+        }
+
+        std::sort(model.latency_us.begin(), model.latency_us.end());
+        std::sort(interarrival_us.begin(), interarrival_us.end());
+        fmt::print(R"({{
+  "file": "{}",
+  "clock": "{}",
+  "format": {{"encoding": {}, "channels": {}, "sample_rate": {}}},
+  "packets": {},
+  "bytes": {},
+  "duration_ms": {:.3f},
+  "audio_ms": {:.3f},
+  "probes": {{"count": {}, "lost": {}, "reordered": {}}},
+  "interarrival_us": {{"p50": {}, "p99": {}, "p999": {}, "max": {}}},
+  "playout": {{"prefill_ms": {:.3f}, "capacity_ms": {:.3f}, "underruns": {}, "starved_ms": {:.3f}, "overflow_ms": {:.3f},
+              "latency_us": {{"p50": {}, "p90": {}, "p99": {}, "p999": {}, "max": {}}}}}
+}}
+)",
+            path, reader.clock() == packet_trace::clock_source::kernel ? "kernel" : "steady",
+            (int)format.encoding(), format.channels(), format.sample_rate(),
+            packets, bytes, ms(last), ms(to_duration((int64_t)bytes)),
+            probes.probes, probes.lost(), probes.reordered,
+            percentile(interarrival_us, 0.5), percentile(interarrival_us, 0.99), percentile(interarrival_us, 0.999),
+            interarrival_us.empty() ? 0 : interarrival_us.back(),
+            ms(model.prefill), ms(model.capacity), model.underruns, ms(model.starved), ms(model.overflowed),
+            percentile(model.latency_us, 0.5), percentile(model.latency_us, 0.9), percentile(model.latency_us, 0.99),
+            percentile(model.latency_us, 0.999), model.latency_us.empty() ? 0 : model.latency_us.back());
+    } catch (const std::exception& e) {
+        std::cerr << e.what() << '\n';
+        return EXIT_FAILURE;
+    }
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,258 @@
+/*
+   Copyright 2022-2024 mkckr0 <https://github.com/mkckr0>
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+*/
+
+// Long session soak test on a manual pipeline_clock. A server with a synthetic
+// source and N clients run in process over 127.0.0.1, all driven from this
+// thread: advance the clock by one quantum, then poll every io_context. A
+// simulated day takes seconds to minutes depending on --period, and the
+// result only depends on the options.
+//
+// Checks that the source produced exactly one quantum per period (no drift),
+// that polled clients lost nothing, that a client which stops sending
+// heartbeats (--stall-after) is dropped by the heartbeat timeout, and that
+// no send or post queue is left growing. Prints JSON and exits with 1 if a
+// check failed. The default format is small because the run time is bound by
+// the number of datagrams.
+
+#include <algorithm>
+#include <iostream>
+#include <memory>
+#include <vector>
+
+#include <cxxopts.hpp>
+#include <fmt/format.h>
+#include <spdlog/spdlog.h>
+
+#include "audio_manager.hpp"
+#include "metrics.hpp"
+#include "network_manager.hpp"
+#include "pipeline_clock.hpp"
+#include "synthetic_source.hpp"
+
+using namespace std::chrono_literals;
+
+namespace {
+
+struct client_stats {
+    uint64_t packets = 0;
+    uint64_t probes = 0;
+    uint64_t reordered = 0;
+    bool started = false;
+    uint32_t first_seq = 0;
+    uint32_t max_seq = 0;
+
+    void on_datagram(const char* data, size_t size)
+    {
+        ++packets;
+        synthetic_source::probe_t probe;
+        if (!synthetic_source::read_probe(data, size, probe)) {
+            return;
+        }
+        ++probes;
+        if (!started) {
+            started = true;
+            first_seq = max_seq = probe.seq;
+            return;
+        }
+        if (probe.seq < max_seq) {
+            ++reordered;
+        }
+        max_seq = std::max(max_seq, probe.seq);
+    }
+
+    uint64_t lost() const
+    {
+        if (!started) {
+            return 0;
+        }
+        auto expected = (uint64_t)(max_seq - first_seq + 1);
+        return expected > probes ? expected - probes : 0;
+    }
+};
+
+} // namespace
+
+int main(int argc, char* argv[])
+{
+    cxxopts::Options options("as-soak-test", "Run a long session on a manual clock and check drift, loss, heartbeat timeouts and queue growth");
+
+    // clang-format off
+    options.add_options()
+        ("h,help", "Print usage")
+        ("clients", "Number of clients", cxxopts::value<int>()->default_value("4"), "[n]")
+        ("hours", "Simulated duration in hours", cxxopts::value<double>()->default_value("24"), "[hours]")
+        ("period", "Synthetic source quantum in microseconds, also the clock step", cxxopts::value<int>()->default_value("100000"), "[us]")
+        ("encoding", "Synthetic source encoding", cxxopts::value<audio_manager::encoding_t>()->default_value("s16"), "[encoding]")
+        ("channels", "Synthetic source channels", cxxopts::value<int>()->default_value("1"), "[channels]")
+        ("sample-rate", "Synthetic source sample rate(Hz)", cxxopts::value<int>()->default_value("8000"), "[sample_rate]")
+        ("stall-after", "Stop polling the last client after this many simulated seconds, 0 disables", cxxopts::value<int>()->default_value("0"), "[seconds]")
+        ("port", "Server port", cxxopts::value<uint16_t>()->default_value("65532"), "[port]")
+        ("V,verbose", "Set log level to \"trace\"")
+        ;
+    // clang-format on
+
+    cxxopts::ParseResult result;
+    try {
+        result = options.parse(argc, argv);
+    } catch (const cxxopts::exceptions::exception& e) {
+        std::cerr << e.what() << '\n'
+                  << options.help();
+        return EXIT_FAILURE;
+    }
+    if (result.count("help")) {
+        std::cout << options.help();
+        return EXIT_SUCCESS;
+    }
+    spdlog::set_level(result.count("verbose") ? spdlog::level::trace : spdlog::level::warn);
+
+    const int client_count = std::max(1, result["clients"].as<int>());
+    const auto period = std::chrono::microseconds(std::max(1000, result["period"].as<int>()));
+    const auto duration = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::duration<double, std::ratio<3600>>(result["hours"].as<double>()));
+    const auto stall_after = std::chrono::seconds(result["stall-after"].as<int>());
+    const auto port = result["port"].as<uint16_t>();
+
+    pipeline_clock::use_manual_time();
+
+    audio_manager::capture_config capture_config;
+    capture_config.synthetic = true;
+    capture_config.synthetic_period = period;
+    capture_config.encoding = result["encoding"].as<audio_manager::encoding_t>();
+    capture_config.channels = result["channels"].as<int>();
+    capture_config.sample_rate = result["sample-rate"].as<int>();
+
+    auto server_audio = std::make_shared<audio_manager>();
+    auto server = std::make_shared<network_manager>(server_audio);
+    server->start_server("127.0.0.1", port, capture_config);
+
+    auto client_audio = std::make_shared<audio_manager>();
+    std::vector<std::shared_ptr<network_manager>> clients;
+    std::vector<std::unique_ptr<client_stats>> stats;
+    for (int i = 0; i < client_count; ++i) {
+        auto& s = stats.emplace_back(std::make_unique<client_stats>());
+        auto client = std::make_shared<network_manager>(client_audio);
+        client->set_datagram_handler([s = s.get()](const char* data, size_t size) {
+            s->on_datagram(data, size);
+        });
+        client->start_client("127.0.0.1", port);
+        clients.push_back(client);
+    }
+
+    auto step = [&](bool poll_last_client) {
+        pipeline_clock::advance(period);
+        server->poll();
+        for (size_t i = 0; i < clients.size(); ++i) {
+            if (poll_last_client || i + 1 < clients.size()) {
+                clients[i]->poll();
+            }
+        }
+        // deliver what the clients sent, e.g. heartbeats
+        server->poll();
+    };
+
+    // handshakes, until every client receives audio
+    for (int i = 0; i < 1000; ++i) {
+        step(true);
+        if (std::all_of(stats.begin(), stats.end(), [](auto& s) { return s->probes > 0; })) {
+            break;
+        }
+    }
+    if (!std::all_of(stats.begin(), stats.end(), [](auto& s) { return s->probes > 0; })) {
+        std::cerr << "clients failed to connect\n";
+        return EXIT_FAILURE;
+    }
+    for (auto& s : stats) {
+        *s = client_stats {};
+    }
+
+    auto& m = metrics::get();
+    const auto quanta_begin = m.capture_quanta.value();
+    const auto timeouts_begin = m.heartbeat_timeouts.value();
+    int64_t max_post_queue = 0;
+    int64_t max_send_queue = 0;
+
+    const auto real_begin = std::chrono::steady_clock::now();
+    const auto begin = pipeline_clock::now();
+    const auto steps = duration / period;
+    for (int64_t i = 0; i < steps; ++i) {
+        bool stalled = stall_after.count() > 0 && pipeline_clock::now() - begin >= stall_after;
+        step(!stalled);
+        max_post_queue = std::max(max_post_queue, m.post_queue_bytes.value());
+        max_send_queue = std::max(max_send_queue, m.send_queue_bytes.value());
+    }
+    const auto simulated = pipeline_clock::now() - begin;
+    const auto real_elapsed = std::chrono::steady_clock::now() - real_begin;
+
+    const auto quanta = m.capture_quanta.value() - quanta_begin;
+    const auto timeouts = m.heartbeat_timeouts.value() - timeouts_begin;
+    const auto sessions = m.sessions.value();
+    const bool stalling = stall_after.count() > 0 && stall_after < simulated;
+
+    std::vector<std::string> failures;
+    if (quanta != (uint64_t)steps) {
+        failures.push_back(fmt::format("drift: {} quanta in {} periods", quanta, steps));
+    }
+    for (size_t i = 0; i < stats.size(); ++i) {
+        bool polled = !stalling || i + 1 < stats.size();
+        if (polled && stats[i]->lost()) {
+            failures.push_back(fmt::format("client {} lost {} segments", i, stats[i]->lost()));
+        }
+    }
+    if (timeouts != (stalling ? 1u : 0u)) {
+        failures.push_back(fmt::format("{} heartbeat timeouts", timeouts));
+    }
+    if (sessions != client_count - (stalling ? 1 : 0)) {
+        failures.push_back(fmt::format("{} sessions left", sessions));
+    }
+    if (m.post_queue_bytes.value() != 0 || m.send_queue_bytes.value() != 0) {
+        failures.push_back(fmt::format("queues not drained: post {} send {}", m.post_queue_bytes.value(), m.send_queue_bytes.value()));
+    }
+
+    for (auto& client : clients) {
+        client->stop_client();
+    }
+    server->stop_server();
+
+    std::string clients_json;
+    for (size_t i = 0; i < stats.size(); ++i) {
+        auto& s = *stats[i];
+        clients_json += fmt::format(R"({}{{"id": {}, "packets": {}, "lost": {}, "reordered": {}}})",
+            i ? ", " : "", i, s.packets, s.lost(), s.reordered);
+    }
+    std::string failures_json;
+    for (size_t i = 0; i < failures.size(); ++i) {
+        failures_json += fmt::format(R"({}"{}")", i ? ", " : "", failures[i]);
+    }
+
+    const double simulated_s = std::chrono::duration<double>(simulated).count();
+    const double real_s = std::chrono::duration<double>(real_elapsed).count();
+    fmt::print(R"({{
+  "simulated_s": {:.3f},
+  "real_s": {:.3f},
+  "speedup": {:.1f},
+  "quanta": {},
+  "heartbeat_timeouts": {},
+  "sessions": {},
+  "max_post_queue_bytes": {},
+  "max_send_queue_bytes": {},
+  "clients": [{}],
+  "failures": [{}]
+}}
+)",
+        simulated_s, real_s, real_s > 0 ? simulated_s / real_s : 0.0, quanta, timeouts, sessions,
+        max_post_queue, max_send_queue, clients_json, failures_json);
+
+    return failures.empty() ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -22,6 +22,7 @@
 #include "AudioShareServer.h"
 #include "CMainDialog.h"
 #include "AppMsg.h"
+#include "async_log.hpp"
 
 #include <wil/resource.h>
 #include <spdlog/spdlog.h>
@@ -60,6 +61,11 @@ CAudioShareServerApp::CAudioShareServerApp()
 
     free((void*)m_pszProfileName);
     m_pszProfileName = _wcsdup((exe_dir / "config.ini").c_str());
+
+    // like --async-log of as-cmd, the capture and network threads don't wait for the file
+    if (this->GetProfileIntW(L"App", L"asyncLog", false)) {
+        async_log::start();
+    }
 }
 
 CAudioShareServerApp::~CAudioShareServerApp()